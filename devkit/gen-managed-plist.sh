@@ -64,12 +64,23 @@ add_bool NaturalScroll         "${TVNC_NATURAL_SCROLL:-}"
 add_bool AutoAssistEnabled     "${TVNC_AUTO_ASSIST_ENABLED:-}"
 add_bool ServerCursor          "${TVNC_SERVER_CURSOR:-}"
 add_bool AsyncSwap             "${TVNC_ASYNC_SWAP:-}"
+add_bool ContentClasses        "${TVNC_CONTENT_CLASSES:-}"
+add_bool ClientScaling         "${TVNC_CLIENT_SCALING:-}"
+add_bool SharedEncoding        "${TVNC_SHARED_ENCODING:-}"
+add_bool HextileEncoding       "${TVNC_HEXTILE_ENCODING:-}"
+add_bool H264Encoding          "${TVNC_H264_ENCODING:-}"
+add_bool EncodingPolicy        "${TVNC_ENCODING_POLICY:-}"
+add_bool ContinuousUpdates     "${TVNC_CONTINUOUS_UPDATES:-}"
+add_bool UpdatePacing          "${TVNC_UPDATE_PACING:-}"
+add_bool SocketTuning          "${TVNC_SOCKET_TUNING:-}"
+add_bool PointerFocus          "${TVNC_POINTER_FOCUS:-}"
 add_bool BonjourEnabled        "${TVNC_BONJOUR_ENABLED:-}"
 add_bool KeyLogging            "${TVNC_KEY_LOGGING:-}"
 
 # Strings (optional)
 add_str DesktopName            "${TVNC_DESKTOP_NAME:-}"
 add_str FrameRateSpec          "${TVNC_FRAME_RATE_SPEC:-}"
+add_str AdaptiveQuality        "${TVNC_ADAPTIVE_QUALITY:-}"
 add_str WheelTuning            "${TVNC_WHEEL_TUNING:-}"
 add_str HttpDir                "${TVNC_HTTP_DIR:-}"
 add_str SslCertFile            "${TVNC_SSL_CERT_FILE:-}"
@@ -89,13 +100,19 @@ add_int MaxInflight                    "${TVNC_MAX_INFLIGHT:-}"
 add_int TileSize                       "${TVNC_TILE_SIZE:-}"
 add_int FullscreenThresholdPercent     "${TVNC_FULLSCREEN_THRESHOLD_PERCENT:-}"
 add_int MaxRects                       "${TVNC_MAX_RECTS:-}"
+add_int ChangeTolerance                "${TVNC_CHANGE_TOLERANCE:-}"
+add_int VideoRegionQuality             "${TVNC_VIDEO_REGION_QUALITY:-}"
+add_int SendHighWaterKB                "${TVNC_SEND_HIGH_WATER_KB:-}"
+add_int SliceTargetMs                  "${TVNC_SLICE_TARGET_MS:-}"
 add_int HttpPort                       "${TVNC_HTTP_PORT:-}"
 add_int ReverseRepeaterID              "${TVNC_REVERSE_REPEATER_ID:-}"
 
 # Reals (optional)
 add_real KeepAliveSec         "${TVNC_KEEPALIVE_SEC:-}"
 add_real Scale                "${TVNC_SCALE:-}"
+add_real DownshiftMinScale    "${TVNC_DOWNSHIFT_MIN_SCALE:-}"
 add_real DeferWindowSec       "${TVNC_DEFER_WINDOW_SEC:-}"
+add_real LosslessRefineSec    "${TVNC_LOSSLESS_REFINE_SEC:-}"
 add_real WheelStepPx          "${TVNC_WHEEL_STEP_PX:-}"
 
 # Footer
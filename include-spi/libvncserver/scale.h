@@ -0,0 +1,29 @@
+/*
+ * Declarations from libvncserver/scale.h (libvncserver 0.9.15), which is not
+ * installed with the public headers. The symbols are exported by libvncserver.
+ */
+
+#ifndef LIBVNCSERVER_SCALE_H
+#define LIBVNCSERVER_SCALE_H
+
+#include <rfb/rfb.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int ScaleX(rfbScreenInfoPtr from, rfbScreenInfoPtr to, int x);
+int ScaleY(rfbScreenInfoPtr from, rfbScreenInfoPtr to, int y);
+void rfbScaledCorrection(rfbScreenInfoPtr from, rfbScreenInfoPtr to, int *x, int *y, int *w, int *h,
+                         const char *function);
+void rfbScaledScreenUpdateRect(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, int x0, int y0, int w0, int h0);
+void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2);
+rfbScreenInfoPtr rfbScaledScreenAllocate(rfbClientPtr cl, int width, int height);
+rfbScreenInfoPtr rfbScalingFind(rfbClientPtr cl, int width, int height);
+void rfbScalingSetup(rfbClientPtr cl, int width, int height);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBVNCSERVER_SCALE_H */
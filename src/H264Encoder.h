@@ -0,0 +1,61 @@
+/*
+ This file is part of TrollVNC
+ Copyright (c) 2025 82Flex <82flex@gmail.com> and contributors
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License version 2
+ as published by the Free Software Foundation.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef H264Encoder_h
+#define H264Encoder_h
+
+#import <stddef.h>
+#import <stdint.h>
+#import <vector>
+
+/**
+ H264Encoder
+ -----------
+ A VideoToolbox H.264 session that turns whole framebuffers into an Annex-B stream, as carried by the
+ Open H.264 RFB encoding.
+
+ Stream:
+ - Constrained to what a real-time decoder handles: Baseline profile, no frame reordering.
+ - Keyframes carry SPS and PPS in front of the IDR slice, so a decoder can start from any of them.
+ - A keyframe is produced for the first frame, when asked for, and at least every keyframeIntervalSec.
+
+ Formats:
+ - Input is the server framebuffer: 32-bit little-endian BGRX.
+ - VideoToolbox picks the encoder: the hardware one on devices, a software one in the simulator.
+
+ Threading:
+ - One encoder per client, used by one thread at a time. Frames are encoded synchronously.
+ */
+
+typedef struct TVH264Encoder TVH264Encoder;
+
+// Create an encoder for width x height frames. Returns NULL if VideoToolbox has no session for that size.
+TVH264Encoder *TVH264EncoderCreate(int width, int height, int bitRate, double keyframeIntervalSec);
+void TVH264EncoderDestroy(TVH264Encoder *encoder);
+
+int TVH264EncoderWidth(const TVH264Encoder *encoder);
+int TVH264EncoderHeight(const TVH264Encoder *encoder);
+
+// Average bit rate in bits/s; applies from the next frame.
+void TVH264EncoderSetBitRate(TVH264Encoder *encoder, int bitRate);
+
+// Encode fb as the next frame and append its Annex-B data to out. *isKeyframe tells whether the frame
+// can be decoded on its own. Returns false (out unchanged) if the frame was dropped or encoding failed.
+bool TVH264EncodeFrame(TVH264Encoder *encoder, const uint8_t *fb, size_t stride, bool forceKeyframe,
+                       std::vector<uint8_t> &out, bool *isKeyframe);
+
+#endif /* H264Encoder_h */
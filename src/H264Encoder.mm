@@ -0,0 +1,218 @@
+/*
+ This file is part of TrollVNC
+ Copyright (c) 2025 82Flex <82flex@gmail.com> and contributors
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License version 2
+ as published by the Free Software Foundation.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#import <CoreMedia/CoreMedia.h>
+#import <CoreVideo/CoreVideo.h>
+#import <Foundation/Foundation.h>
+#import <VideoToolbox/VideoToolbox.h>
+#import <cstring>
+
+#import "H264Encoder.h"
+
+static const uint8_t cAnnexBStartCode[4] = {0, 0, 0, 1};
+static const double cH264PeakBitRateFactor = 1.5; // short-term data rate limit over the average
+
+struct TVH264Encoder {
+    VTCompressionSessionRef session = NULL;
+    int width = 0;
+    int height = 0;
+    int64_t lastPts = -1; // ms
+
+    // Frame being encoded, filled by the output callback
+    std::vector<uint8_t> *out = nullptr;
+    std::vector<uint8_t> avcc; // sample data before conversion
+    bool produced = false;
+    bool keyframe = false;
+};
+
+static void tvH264PutNal(std::vector<uint8_t> &out, const uint8_t *nal, size_t size) {
+    out.insert(out.end(), cAnnexBStartCode, cAnnexBStartCode + sizeof(cAnnexBStartCode));
+    out.insert(out.end(), nal, nal + size);
+}
+
+// Convert one encoded sample from length-prefixed NAL units (AVCC) to start codes (Annex-B).
+static bool tvH264PutSample(TVH264Encoder *enc, CMSampleBufferRef sampleBuffer, std::vector<uint8_t> &out) {
+    // Sync samples have no NotSync attachment
+    bool keyframe = true;
+    CFArrayRef attachments = CMSampleBufferGetSampleAttachmentsArray(sampleBuffer, false);
+    if (attachments && CFArrayGetCount(attachments) > 0) {
+        CFDictionaryRef attachment = (CFDictionaryRef)CFArrayGetValueAtIndex(attachments, 0);
+        keyframe = !CFDictionaryContainsKey(attachment, kCMSampleAttachmentKey_NotSync);
+    }
+
+    CMFormatDescriptionRef format = CMSampleBufferGetFormatDescription(sampleBuffer);
+    size_t parameterSets = 0;
+    int lengthSize = 0;
+    if (!format || CMVideoFormatDescriptionGetH264ParameterSetAtIndex(format, 0, NULL, NULL, &parameterSets,
+                                                                      &lengthSize) != noErr)
+        return false;
+    if (lengthSize < 1 || lengthSize > 4)
+        return false;
+
+    if (keyframe) {
+        for (size_t i = 0; i < parameterSets; ++i) {
+            const uint8_t *ps = NULL;
+            size_t psSize = 0;
+            if (CMVideoFormatDescriptionGetH264ParameterSetAtIndex(format, i, &ps, &psSize, NULL, NULL) != noErr)
+                return false;
+            tvH264PutNal(out, ps, psSize);
+        }
+    }
+
+    // The block buffer may be non-contiguous
+    CMBlockBufferRef block = CMSampleBufferGetDataBuffer(sampleBuffer);
+    size_t length = block ? CMBlockBufferGetDataLength(block) : 0;
+    enc->avcc.resize(length);
+    if (length == 0 || CMBlockBufferCopyDataBytes(block, 0, length, enc->avcc.data()) != kCMBlockBufferNoErr)
+        return false;
+
+    const uint8_t *data = enc->avcc.data();
+    size_t pos = 0;
+    while (pos + (size_t)lengthSize <= length) {
+        size_t nalSize = 0;
+        for (int i = 0; i < lengthSize; ++i)
+            nalSize = (nalSize << 8) | data[pos + i];
+        pos += (size_t)lengthSize;
+        if (nalSize > length - pos)
+            return false;
+        tvH264PutNal(out, data + pos, nalSize);
+        pos += nalSize;
+    }
+
+    enc->keyframe = keyframe;
+    return true;
+}
+
+static void tvH264OutputCallback(void *outputCallbackRefCon, void *sourceFrameRefCon, OSStatus status,
+                                 VTEncodeInfoFlags infoFlags, CMSampleBufferRef sampleBuffer) {
+    (void)sourceFrameRefCon;
+    TVH264Encoder *enc = (TVH264Encoder *)outputCallbackRefCon;
+    if (!enc->out || status != noErr || (infoFlags & kVTEncodeInfo_FrameDropped) || !sampleBuffer ||
+        !CMSampleBufferDataIsReady(sampleBuffer))
+        return;
+
+    std::vector<uint8_t> &out = *enc->out;
+    size_t start = out.size();
+    if (tvH264PutSample(enc, sampleBuffer, out))
+        enc->produced = true;
+    else
+        out.resize(start);
+}
+
+TVH264Encoder *TVH264EncoderCreate(int width, int height, int bitRate, double keyframeIntervalSec) {
+    if (width <= 0 || height <= 0)
+        return NULL;
+
+    TVH264Encoder *enc = new TVH264Encoder();
+    enc->width = width;
+    enc->height = height;
+
+    NSDictionary *sourceAttributes = @{
+        (__bridge NSString *)kCVPixelBufferPixelFormatTypeKey : @(kCVPixelFormatType_32BGRA),
+        (__bridge NSString *)kCVPixelBufferWidthKey : @(width),
+        (__bridge NSString *)kCVPixelBufferHeightKey : @(height),
+        (__bridge NSString *)kCVPixelBufferIOSurfacePropertiesKey : @{},
+    };
+    OSStatus err = VTCompressionSessionCreate(kCFAllocatorDefault, width, height, kCMVideoCodecType_H264, NULL,
+                                              (__bridge CFDictionaryRef)sourceAttributes, NULL, tvH264OutputCallback,
+                                              enc, &enc->session);
+    if (err != noErr || !enc->session) {
+        delete enc;
+        return NULL;
+    }
+
+    VTSessionSetProperty(enc->session, kVTCompressionPropertyKey_RealTime, kCFBooleanTrue);
+    VTSessionSetProperty(enc->session, kVTCompressionPropertyKey_AllowFrameReordering, kCFBooleanFalse);
+    VTSessionSetProperty(enc->session, kVTCompressionPropertyKey_ProfileLevel, kVTProfileLevel_H264_Baseline_AutoLevel);
+    VTSessionSetProperty(enc->session, kVTCompressionPropertyKey_MaxKeyFrameIntervalDuration,
+                         (__bridge CFNumberRef)@(keyframeIntervalSec));
+    TVH264EncoderSetBitRate(enc, bitRate);
+
+    err = VTCompressionSessionPrepareToEncodeFrames(enc->session);
+    if (err != noErr) {
+        TVH264EncoderDestroy(enc);
+        return NULL;
+    }
+    return enc;
+}
+
+void TVH264EncoderDestroy(TVH264Encoder *encoder) {
+    if (!encoder)
+        return;
+    if (encoder->session) {
+        VTCompressionSessionInvalidate(encoder->session);
+        CFRelease(encoder->session);
+    }
+    delete encoder;
+}
+
+int TVH264EncoderWidth(const TVH264Encoder *encoder) { return encoder->width; }
+
+int TVH264EncoderHeight(const TVH264Encoder *encoder) { return encoder->height; }
+
+void TVH264EncoderSetBitRate(TVH264Encoder *encoder, int bitRate) {
+    VTSessionSetProperty(encoder->session, kVTCompressionPropertyKey_AverageBitRate, (__bridge CFNumberRef)@(bitRate));
+
+    // Bytes per second, over one second
+    NSArray *limits = @[ @((double)bitRate / 8.0 * cH264PeakBitRateFactor), @1.0 ];
+    VTSessionSetProperty(encoder->session, kVTCompressionPropertyKey_DataRateLimits, (__bridge CFArrayRef)limits);
+}
+
+bool TVH264EncodeFrame(TVH264Encoder *encoder, const uint8_t *fb, size_t stride, bool forceKeyframe,
+                       std::vector<uint8_t> &out, bool *isKeyframe) {
+    CVPixelBufferPoolRef pool = VTCompressionSessionGetPixelBufferPool(encoder->session);
+    CVPixelBufferRef pixelBuffer = NULL;
+    if (!pool || CVPixelBufferPoolCreatePixelBuffer(kCFAllocatorDefault, pool, &pixelBuffer) != kCVReturnSuccess)
+        return false;
+
+    CVPixelBufferLockBaseAddress(pixelBuffer, 0);
+    uint8_t *dst = (uint8_t *)CVPixelBufferGetBaseAddress(pixelBuffer);
+    size_t dstStride = CVPixelBufferGetBytesPerRow(pixelBuffer);
+    size_t rowBytes = (size_t)encoder->width * 4;
+    for (int y = 0; y < encoder->height; ++y)
+        memcpy(dst + (size_t)y * dstStride, fb + (size_t)y * stride, rowBytes);
+    CVPixelBufferUnlockBaseAddress(pixelBuffer, 0);
+
+    // Wall-clock timestamps; rate control needs real frame intervals
+    int64_t pts = (int64_t)(CFAbsoluteTimeGetCurrent() * 1000.0);
+    if (pts <= encoder->lastPts)
+        pts = encoder->lastPts + 1;
+    encoder->lastPts = pts;
+    CMTime time = CMTimeMake(pts, 1000);
+
+    NSDictionary *frameProperties =
+        forceKeyframe ? @{(__bridge NSString *)kVTEncodeFrameOptionKey_ForceKeyFrame : @YES} : nil;
+
+    size_t start = out.size();
+    encoder->out = &out;
+    encoder->produced = false;
+    encoder->keyframe = false;
+    OSStatus err = VTCompressionSessionEncodeFrame(encoder->session, pixelBuffer, time, kCMTimeInvalid,
+                                                   (__bridge CFDictionaryRef)frameProperties, NULL, NULL);
+    if (err == noErr)
+        err = VTCompressionSessionCompleteFrames(encoder->session, time);
+    encoder->out = nullptr;
+    CVPixelBufferRelease(pixelBuffer);
+
+    if (err != noErr || !encoder->produced) {
+        out.resize(start);
+        return false;
+    }
+    if (isKeyframe)
+        *isKeyframe = encoder->keyframe;
+    return true;
+}
@@ -0,0 +1,62 @@
+/*
+ This file is part of TrollVNC
+ Copyright (c) 2025 82Flex <82flex@gmail.com> and contributors
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License version 2
+ as published by the Free Software Foundation.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HextileEncoder_h
+#define HextileEncoder_h
+
+#import <stddef.h>
+#import <stdint.h>
+#import <vector>
+
+/**
+ HextileEncoder
+ --------------
+ A Hextile rectangle encoder. Like libvncserver's, it splits a rectangle into 16x16 tiles and sends each as
+ a solid colour, a background with subrects, or raw pixels, whichever is smallest. Background and
+ foreground colours carry over between the tiles of one rectangle only, so every rectangle can be encoded
+ on its own.
+
+ Formats:
+ - Input is the server framebuffer: 32-bit little-endian BGRX.
+ - Pixels are written as they are in the framebuffer, for clients that use the server's pixel format
+   (libvncserver's rfbTranslateNone).
+
+ Kernels:
+ - Colour counting, background skipping and run scans for the subrect search use NEON on arm64 and SSE2 on
+   x86_64 (simulator), with scalar fallbacks.
+
+ Threading:
+ - Thread-safe; no state is kept between calls.
+ */
+
+// Encoder counters, totals since start.
+typedef struct {
+    uint64_t rects;
+    uint64_t tiles;
+    uint64_t rawTiles; // tiles whose subrects would have been larger than their pixels
+    uint64_t pixels;
+    uint64_t bytes; // output including rectangle headers
+    uint64_t nanos; // time spent encoding
+} TVHextileStats;
+
+// Append a rectangle header and Hextile payload for (x, y, w, h) of fb to out.
+void TVHextileEncodeRect(const uint8_t *fb, size_t stride, int x, int y, int w, int h, std::vector<uint8_t> &out);
+
+// Snapshot of the encoder counters.
+void TVHextileGetStats(TVHextileStats *stats);
+
+#endif /* HextileEncoder_h */
@@ -0,0 +1,276 @@
+/*
+ This file is part of TrollVNC
+ Copyright (c) 2025 82Flex <82flex@gmail.com> and contributors
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License version 2
+ as published by the Free Software Foundation.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#import <atomic>
+#import <chrono>
+#import <cstring>
+
+#if defined(__ARM_NEON)
+#import <arm_neon.h>
+#define TV_HEXTILE_NEON 1
+#elif defined(__SSE2__)
+#import <emmintrin.h>
+#define TV_HEXTILE_SSE2 1
+#endif
+
+#import "HextileEncoder.h"
+
+// Tile subencoding bits
+static const uint8_t cHextileRaw = 1;
+static const uint8_t cHextileBackgroundSpecified = 2;
+static const uint8_t cHextileForegroundSpecified = 4;
+static const uint8_t cHextileAnySubrects = 8;
+static const uint8_t cHextileSubrectsColoured = 16;
+
+static const int cHextileTile = 16;           // tile side
+static const int32_t cHextileEncoding = 5;    // rfbEncodingHextile
+static const int cHextileMaxSubrects = 255;   // the count is one byte
+static const int cHextileBytesPerPixel = 4;   // server format, sent as is
+
+// Encoder counters, see TVHextileGetStats
+static std::atomic<uint64_t> gHextileRects;
+static std::atomic<uint64_t> gHextileTiles;
+static std::atomic<uint64_t> gHextileRawTiles;
+static std::atomic<uint64_t> gHextilePixels;
+static std::atomic<uint64_t> gHextileBytes;
+static std::atomic<uint64_t> gHextileNanos;
+
+// Number of leading pixels of p[0..n) equal to px.
+static inline int tvHextileRunLength(const uint32_t *p, int n, uint32_t px) {
+    int i = 0;
+#if TV_HEXTILE_NEON
+    uint32x4_t target = vdupq_n_u32(px);
+    for (; i + 4 <= n; i += 4) {
+        if (vminvq_u32(vceqq_u32(vld1q_u32(p + i), target)) == 0)
+            break;
+    }
+#elif TV_HEXTILE_SSE2
+    __m128i target = _mm_set1_epi32((int)px);
+    for (; i + 4 <= n; i += 4) {
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p + i)), target)) != 0xFFFF)
+            break;
+    }
+#endif
+    while (i < n && p[i] == px)
+        ++i;
+    return i;
+}
+
+// Number of pixels of p[0..n) equal to px.
+static inline int tvHextileCount(const uint32_t *p, int n, uint32_t px) {
+    int i = 0;
+    int count = 0;
+#if TV_HEXTILE_NEON
+    uint32x4_t target = vdupq_n_u32(px);
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (; i + 4 <= n; i += 4)
+        acc = vsubq_u32(acc, vceqq_u32(vld1q_u32(p + i), target)); // equal lanes are all ones, i.e. -1
+    count = (int)vaddvq_u32(acc);
+#elif TV_HEXTILE_SSE2
+    __m128i target = _mm_set1_epi32((int)px);
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4)
+        acc = _mm_sub_epi32(acc, _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p + i)), target));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    count = _mm_cvtsi128_si32(acc);
+#endif
+    for (; i < n; ++i)
+        count += p[i] == px;
+    return count;
+}
+
+// The tile's two most frequent colours when it has at most two; bg is the more frequent one.
+static void tvHextileColours(const uint32_t *t, int n, uint32_t *bg, uint32_t *fg, bool *solid, bool *mono) {
+    uint32_t c1 = t[0];
+    int n1 = tvHextileCount(t, n, c1);
+    if (n1 == n) {
+        *bg = *fg = c1;
+        *solid = *mono = true;
+        return;
+    }
+    int first = tvHextileRunLength(t, n, c1);
+    uint32_t c2 = t[first];
+    int n2 = tvHextileCount(t + first, n - first, c2);
+    *solid = false;
+    *mono = n1 + n2 == n;
+    *bg = n1 >= n2 ? c1 : c2;
+    *fg = n1 >= n2 ? c2 : c1;
+}
+
+// Cover the tile's non-background pixels with subrects, largest first along each run, and write them to
+// dst after the count byte. Returns the bytes written, or -1 when they would exceed limit.
+static int tvHextilePutSubrects(uint32_t *t, int w, int h, uint32_t bg, bool mono, uint8_t *dst, int limit) {
+    int len = 1;
+    int count = 0;
+    for (int y = 0; y < h; ++y) {
+        uint32_t *line = t + (size_t)y * w;
+        int x = 0;
+        for (;;) {
+            x += tvHextileRunLength(line + x, w - x, bg);
+            if (x >= w)
+                break;
+            uint32_t c = line[x];
+
+            // Horizontal candidate: rows whose run reaches as far as the first one; vertical candidate: all
+            // rows that start with c, as wide as the narrowest run
+            int hx = x + tvHextileRunLength(line + x, w - x, c) - 1;
+            int vx = hx;
+            int hy = y;
+            bool extending = true;
+            int j = y + 1;
+            for (; j < h; ++j) {
+                const uint32_t *seg = t + (size_t)j * w;
+                if (seg[x] != c)
+                    break;
+                int i = x + tvHextileRunLength(seg + x, w - x, c) - 1;
+                vx = i < vx ? i : vx;
+                if (extending && i >= hx)
+                    hy = j;
+                else
+                    extending = false;
+            }
+            int vy = j - 1;
+            int hw = hx - x + 1, hh = hy - y + 1;
+            int vw = vx - x + 1, vh = vy - y + 1;
+            int sw = hw * hh > vw * vh ? hw : vw;
+            int sh = hw * hh > vw * vh ? hh : vh;
+
+            int need = mono ? 2 : 2 + cHextileBytesPerPixel;
+            if (len + need > limit || count == cHextileMaxSubrects)
+                return -1;
+            if (!mono) {
+                memcpy(dst + len, &c, cHextileBytesPerPixel);
+                len += cHextileBytesPerPixel;
+            }
+            dst[len++] = (uint8_t)((x << 4) | y);
+            dst[len++] = (uint8_t)(((sw - 1) << 4) | (sh - 1));
+            count++;
+
+            for (int r = y; r < y + sh; ++r) {
+                uint32_t *p = t + (size_t)r * w + x;
+                for (int k = 0; k < sw; ++k)
+                    p[k] = bg;
+            }
+            x += sw;
+        }
+    }
+    dst[0] = (uint8_t)count;
+    return len;
+}
+
+static inline void tvHextilePutU16(std::vector<uint8_t> &out, int v) {
+    out.push_back((uint8_t)(v >> 8));
+    out.push_back((uint8_t)v);
+}
+
+static inline void tvHextilePutPixel(std::vector<uint8_t> &out, uint32_t px) {
+    uint8_t b[cHextileBytesPerPixel];
+    memcpy(b, &px, sizeof(b));
+    out.insert(out.end(), b, b + sizeof(b));
+}
+
+void TVHextileEncodeRect(const uint8_t *fb, size_t stride, int x, int y, int w, int h, std::vector<uint8_t> &out) {
+    auto began = std::chrono::steady_clock::now();
+    size_t start = out.size();
+    tvHextilePutU16(out, x);
+    tvHextilePutU16(out, y);
+    tvHextilePutU16(out, w);
+    tvHextilePutU16(out, h);
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back((uint8_t)(cHextileEncoding >> shift));
+
+    uint32_t tile[cHextileTile * cHextileTile];
+    uint8_t subrects[1 + cHextileTile * cHextileTile * cHextileBytesPerPixel];
+    uint32_t bg = 0, fg = 0;
+    bool validBg = false, validFg = false;
+    uint64_t tiles = 0, rawTiles = 0;
+
+    for (int ty = y; ty < y + h; ty += cHextileTile) {
+        int th = y + h - ty < cHextileTile ? y + h - ty : cHextileTile;
+        for (int tx = x; tx < x + w; tx += cHextileTile) {
+            int tw = x + w - tx < cHextileTile ? x + w - tx : cHextileTile;
+            int n = tw * th;
+            size_t rowBytes = (size_t)tw * cHextileBytesPerPixel;
+            for (int r = 0; r < th; ++r)
+                memcpy(tile + (size_t)r * tw, fb + (size_t)(ty + r) * stride + (size_t)tx * cHextileBytesPerPixel,
+                       rowBytes);
+            tiles++;
+
+            uint32_t newBg, newFg;
+            bool solid, mono;
+            tvHextileColours(tile, n, &newBg, &newFg, &solid, &mono);
+
+            size_t tileStart = out.size();
+            out.push_back(0);
+            uint8_t sub = 0;
+            if (!validBg || newBg != bg) {
+                bg = newBg;
+                validBg = true;
+                sub |= cHextileBackgroundSpecified;
+                tvHextilePutPixel(out, bg);
+            }
+            if (!solid) {
+                sub |= cHextileAnySubrects;
+                if (mono) {
+                    if (!validFg || newFg != fg) {
+                        fg = newFg;
+                        validFg = true;
+                        sub |= cHextileForegroundSpecified;
+                        tvHextilePutPixel(out, fg);
+                    }
+                } else {
+                    validFg = false;
+                    sub |= cHextileSubrectsColoured;
+                }
+
+                int len = tvHextilePutSubrects(tile, tw, th, bg, mono, subrects, n * cHextileBytesPerPixel);
+                if (len < 0) {
+                    // Raw pixels are smaller; they leave both colours undefined for the next tile
+                    out.resize(tileStart + 1);
+                    sub = cHextileRaw;
+                    for (int r = 0; r < th; ++r) {
+                        const uint8_t *src = fb + (size_t)(ty + r) * stride + (size_t)tx * cHextileBytesPerPixel;
+                        out.insert(out.end(), src, src + rowBytes);
+                    }
+                    validBg = validFg = false;
+                    rawTiles++;
+                } else {
+                    out.insert(out.end(), subrects, subrects + len);
+                }
+            }
+            out[tileStart] = sub;
+        }
+    }
+
+    auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - began);
+    gHextileRects.fetch_add(1, std::memory_order_relaxed);
+    gHextileTiles.fetch_add(tiles, std::memory_order_relaxed);
+    gHextileRawTiles.fetch_add(rawTiles, std::memory_order_relaxed);
+    gHextilePixels.fetch_add((uint64_t)w * (uint64_t)h, std::memory_order_relaxed);
+    gHextileBytes.fetch_add(out.size() - start, std::memory_order_relaxed);
+    gHextileNanos.fetch_add((uint64_t)nanos.count(), std::memory_order_relaxed);
+}
+
+void TVHextileGetStats(TVHextileStats *stats) {
+    stats->rects = gHextileRects.load(std::memory_order_relaxed);
+    stats->tiles = gHextileTiles.load(std::memory_order_relaxed);
+    stats->rawTiles = gHextileRawTiles.load(std::memory_order_relaxed);
+    stats->pixels = gHextilePixels.load(std::memory_order_relaxed);
+    stats->bytes = gHextileBytes.load(std::memory_order_relaxed);
+    stats->nanos = gHextileNanos.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,88 @@
+/*
+ This file is part of TrollVNC
+ Copyright (c) 2025 82Flex <82flex@gmail.com> and contributors
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License version 2
+ as published by the Free Software Foundation.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef TightEncoder_h
+#define TightEncoder_h
+
+#import <rfb/rfb.h>
+#import <stdint.h>
+#import <vector>
+
+/**
+ TightEncoder
+ ------------
+ A stateless Tight rectangle encoder. The bytes it produces for a rectangle depend only on the pixels and
+ the parameters, never on what was sent before, so one encoded rectangle can be written to any number of
+ clients.
+
+ Stream usage:
+ - zlib data always goes through Tight stream 3 with the stream's reset bit set, so every rectangle starts
+   a fresh zlib stream on the client.
+ - libvncserver's own Tight encoder uses streams 0 to 2 (full colour, mono and indexed), leaving stream 3
+   as the only free one, so rectangles from both encoders can be mixed on one connection.
+
+ Formats:
+ - Input is the server framebuffer: 32-bit little-endian BGRX.
+ - Output is for clients with a 24-bit true-colour format (3-byte TPIXEL), see TVTightFormatSupported.
+ - JPEG needs TurboJPEG; builds without it (simulator) fall back to lossless rectangles.
+
+ Kernels:
+ - Run scans (palette counting, solid rectangles, 8 bpp indices), the 1 bpp bitmap and TPIXEL packing use
+   NEON on arm64 and SSE2/SSSE3 on x86_64 (simulator), with scalar fallbacks.
+
+ Threading:
+ - Thread-safe. zlib and TurboJPEG contexts are kept per thread.
+ */
+
+typedef struct {
+    int jpegQuality; // TurboJPEG quality 1..100, or -1 for lossless only
+    int jpegSubsamp; // libvncserver turboSubsampLevel (0 = 4:4:4, 1 = 4:2:0, 2 = 4:2:2, 3 = gray)
+    int zlibLevel;   // 0..9, as tightCompressLevel
+} TVTightParams;
+
+// Kind of Tight rectangle chosen for the pixels.
+typedef enum {
+    TVTightKindFill,      // solid colour
+    TVTightKindPalette,   // 2..16 colours
+    TVTightKindFullColor, // zlib-compressed TPIXELs
+    TVTightKindJpeg,      // JPEG
+    TVTightKindCount,
+} TVTightKind;
+
+// Encoder counters of one kind, totals since start.
+typedef struct {
+    uint64_t rects;
+    uint64_t pixels;
+    uint64_t bytes; // output including rectangle headers
+    uint64_t nanos; // time spent encoding
+} TVTightKindStats;
+
+// Largest rectangle width a Tight decoder has to accept.
+#define TV_TIGHT_MAX_RECT_WIDTH 2048
+
+// Whether a client pixel format takes 3-byte TPIXEL data (true colour, 32 bpp, depth 24, 8-bit channels).
+bool TVTightFormatSupported(const rfbPixelFormat *format);
+
+// Append a rectangle header and Tight payload for (x, y, w, h) of fb to out.
+// w must not exceed TV_TIGHT_MAX_RECT_WIDTH. Returns false (out unchanged) if encoding failed.
+bool TVTightEncodeRect(const uint8_t *fb, size_t stride, int x, int y, int w, int h, const TVTightParams *params,
+                       std::vector<uint8_t> &out);
+
+// Snapshot of the encoder counters, indexed by TVTightKind.
+void TVTightGetStats(TVTightKindStats stats[TVTightKindCount]);
+
+#endif /* TightEncoder_h */
@@ -0,0 +1,411 @@
+/*
+ This file is part of TrollVNC
+ Copyright (c) 2025 82Flex <82flex@gmail.com> and contributors
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License version 2
+ as published by the Free Software Foundation.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#import <atomic>
+#import <chrono>
+#import <cstring>
+#import <zlib.h>
+
+#if defined(__ARM_NEON)
+#import <arm_neon.h>
+#define TV_TIGHT_NEON 1
+#elif defined(__SSE2__)
+#import <emmintrin.h>
+#define TV_TIGHT_SSE2 1
+#if defined(__SSSE3__)
+#import <tmmintrin.h>
+#define TV_TIGHT_SSSE3 1
+#endif
+#endif
+
+#if __has_include(<jpeg/turbojpeg.h>)
+#import <jpeg/turbojpeg.h>
+#define TV_TIGHT_HAS_JPEG 1
+#else
+#define TV_TIGHT_HAS_JPEG 0
+#endif
+
+#import "TightEncoder.h"
+
+// Compression control byte (high nibble: type / stream, low nibble: stream reset bits)
+static const uint8_t cTightStream = 3;                      // the only zlib stream we use
+static const uint8_t cTightResetStream = 1 << cTightStream; // reset it before this rectangle
+static const uint8_t cTightExplicitFilter = 0x40;           // a filter id byte follows
+static const uint8_t cTightFill = 0x80;                     // solid rectangle
+static const uint8_t cTightJpeg = 0x90;                     // JPEG rectangle
+static const uint8_t cTightFilterPalette = 0x01;            // palette filter id
+static const int cTightMinToCompress = 12;                  // shorter data is sent uncompressed
+static const int cTightMaxPaletteColors = 16;               // more colours: full colour or JPEG
+static const int cTightMinJpegArea = 256;                   // smaller many-colour rects stay lossless
+
+#if TV_TIGHT_HAS_JPEG
+// libvncserver turboSubsampLevel -> TurboJPEG subsampling
+static const int cTightSubsampToTJ[4] = {TJSAMP_444, TJSAMP_420, TJSAMP_422, TJSAMP_GRAY};
+#endif
+
+// Per-thread encoder state; libvncserver runs one output thread per client.
+struct TVTightContext {
+    z_stream zs = {};
+    bool inited = false;
+    int level = -1;
+    std::vector<uint8_t> packed; // filtered data before compression
+    std::vector<uint8_t> zbuf;   // compressed data
+#if TV_TIGHT_HAS_JPEG
+    tjhandle tj = NULL;
+    std::vector<uint8_t> jpeg;
+#endif
+
+    ~TVTightContext() {
+        if (inited)
+            deflateEnd(&zs);
+#if TV_TIGHT_HAS_JPEG
+        if (tj)
+            tjDestroy(tj);
+#endif
+    }
+};
+
+static TVTightContext *tvTightContext(void) {
+    static thread_local TVTightContext ctx;
+    return &ctx;
+}
+
+bool TVTightFormatSupported(const rfbPixelFormat *format) {
+    return format->trueColour && format->bitsPerPixel == 32 && format->depth == 24 && format->redMax == 255 &&
+           format->greenMax == 255 && format->blueMax == 255;
+}
+
+// Encoder counters per kind of rectangle, see TVTightGetStats
+static std::atomic<uint64_t> gTightRects[TVTightKindCount];
+static std::atomic<uint64_t> gTightPixels[TVTightKindCount];
+static std::atomic<uint64_t> gTightBytes[TVTightKindCount];
+static std::atomic<uint64_t> gTightNanos[TVTightKindCount];
+
+static const uint32_t cTightPixelMask = 0x00FFFFFFu; // BGRX little-endian: B in bits 0..7, R in bits 16..23
+
+static inline const uint32_t *tvTightRow(const uint8_t *fb, size_t stride, int x, int y) {
+    return (const uint32_t *)(fb + (size_t)y * stride + (size_t)x * 4);
+}
+
+// Number of leading pixels of row[0..n) equal to px (a masked pixel).
+static inline int tvTightRunLength(const uint32_t *row, int n, uint32_t px) {
+    int i = 0;
+#if TV_TIGHT_NEON
+    uint32x4_t mask = vdupq_n_u32(cTightPixelMask);
+    uint32x4_t target = vdupq_n_u32(px);
+    for (; i + 4 <= n; i += 4) {
+        if (vminvq_u32(vceqq_u32(vandq_u32(vld1q_u32(row + i), mask), target)) == 0)
+            break;
+    }
+#elif TV_TIGHT_SSE2
+    __m128i mask = _mm_set1_epi32((int)cTightPixelMask);
+    __m128i target = _mm_set1_epi32((int)px);
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(row + i)), mask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, target)) != 0xFFFF)
+            break;
+    }
+#endif
+    while (i < n && (row[i] & cTightPixelMask) == px)
+        ++i;
+    return i;
+}
+
+// One byte of the 1 bpp palette bitmap: bit 7 - k is set when row[k] equals px (a masked pixel).
+static inline uint8_t tvTightMonoByte(const uint32_t *row, uint32_t px) {
+#if TV_TIGHT_NEON
+    static const uint8_t bits[8] = {0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
+    uint32x4_t mask = vdupq_n_u32(cTightPixelMask);
+    uint32x4_t target = vdupq_n_u32(px);
+    uint32x4_t lo = vceqq_u32(vandq_u32(vld1q_u32(row), mask), target);
+    uint32x4_t hi = vceqq_u32(vandq_u32(vld1q_u32(row + 4), mask), target);
+    uint8x8_t eq = vmovn_u16(vcombine_u16(vmovn_u32(lo), vmovn_u32(hi)));
+    return vaddv_u8(vand_u8(eq, vld1_u8(bits)));
+#elif TV_TIGHT_SSE2
+    static const uint8_t reversed[16] = {0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE,
+                                         0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF};
+    __m128i mask = _mm_set1_epi32((int)cTightPixelMask);
+    __m128i target = _mm_set1_epi32((int)px);
+    __m128i lo = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i *)row), mask), target);
+    __m128i hi = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i *)(row + 4)), mask), target);
+    return (uint8_t)((reversed[_mm_movemask_ps(_mm_castsi128_ps(lo))] << 4) |
+                     reversed[_mm_movemask_ps(_mm_castsi128_ps(hi))]);
+#else
+    uint8_t byte = 0;
+    for (int k = 0; k < 8; ++k) {
+        if ((row[k] & cTightPixelMask) == px)
+            byte |= (uint8_t)(0x80 >> k);
+    }
+    return byte;
+#endif
+}
+
+// BGRX pixels to 3-byte TPIXELs (R, G, B).
+static inline void tvTightPackRow(uint8_t *dst, const uint32_t *row, int n) {
+    int i = 0;
+#if TV_TIGHT_NEON
+    for (; i + 16 <= n; i += 16, dst += 48) {
+        uint8x16x4_t bgrx = vld4q_u8((const uint8_t *)(row + i));
+        uint8x16x3_t rgb = {{bgrx.val[2], bgrx.val[1], bgrx.val[0]}};
+        vst3q_u8(dst, rgb);
+    }
+#elif TV_TIGHT_SSSE3
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    for (; i + 4 <= n; i += 4, dst += 12) {
+        __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(row + i)), shuffle);
+        _mm_storel_epi64((__m128i *)dst, v);
+        uint32_t tail = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+        memcpy(dst + 8, &tail, 4);
+    }
+#endif
+    for (; i < n; ++i, dst += 3) {
+        uint32_t px = row[i];
+        dst[0] = (uint8_t)(px >> 16); // R
+        dst[1] = (uint8_t)(px >> 8);  // G
+        dst[2] = (uint8_t)px;         // B
+    }
+}
+
+static inline void tvTightPutTPixel(uint8_t *dst, uint32_t px) {
+    dst[0] = (uint8_t)(px >> 16); // R
+    dst[1] = (uint8_t)(px >> 8);  // G
+    dst[2] = (uint8_t)px;         // B
+}
+
+static void tvTightPutHeader(std::vector<uint8_t> &out, int x, int y, int w, int h) {
+    uint8_t hdr[sz_rfbFramebufferUpdateRectHeader] = {
+        (uint8_t)(x >> 8), (uint8_t)x, (uint8_t)(y >> 8), (uint8_t)y, (uint8_t)(w >> 8), (uint8_t)w,
+        (uint8_t)(h >> 8), (uint8_t)h, 0, 0, 0, (uint8_t)rfbEncodingTight,
+    };
+    out.insert(out.end(), hdr, hdr + sizeof(hdr));
+}
+
+static void tvTightPutCompactLength(std::vector<uint8_t> &out, size_t len) {
+    out.push_back((uint8_t)(len & 0x7F) | (len > 0x7F ? 0x80 : 0));
+    if (len > 0x7F) {
+        out.push_back((uint8_t)((len >> 7) & 0x7F) | (len > 0x3FFF ? 0x80 : 0));
+        if (len > 0x3FFF)
+            out.push_back((uint8_t)(len >> 14));
+    }
+}
+
+// Count distinct colours, giving up past maxColors. Returns the count (maxColors + 1 if exceeded).
+static int tvTightFillPalette(const uint8_t *fb, size_t stride, int x, int y, int w, int h, uint32_t *palette,
+                              int maxColors) {
+    int n = 0;
+    uint32_t last = 0;
+    for (int j = 0; j < h; ++j) {
+        const uint32_t *row = tvTightRow(fb, stride, x, y + j);
+        int i = 0;
+        while (i < w) {
+            uint32_t px = row[i] & cTightPixelMask;
+            if (n == 0 || px != last) {
+                int k = 0;
+                while (k < n && palette[k] != px)
+                    ++k;
+                if (k == n) {
+                    if (n == maxColors)
+                        return maxColors + 1;
+                    palette[n++] = px;
+                }
+                last = px;
+            }
+            // Skip the whole run; flat UI areas are mostly long runs
+            i += tvTightRunLength(row + i, w - i, px);
+        }
+    }
+    return n;
+}
+
+static inline int tvTightPaletteIndex(const uint32_t *palette, int n, uint32_t px) {
+    for (int k = 0; k < n; ++k) {
+        if (palette[k] == px)
+            return k;
+    }
+    return 0;
+}
+
+// Append packed data: as is when short, otherwise as compact length plus a fresh zlib stream.
+static bool tvTightPutData(TVTightContext *ctx, std::vector<uint8_t> &out, int level) {
+    const std::vector<uint8_t> &data = ctx->packed;
+    if ((int)data.size() < cTightMinToCompress) {
+        out.insert(out.end(), data.begin(), data.end());
+        return true;
+    }
+
+    level = level < 0 ? 0 : (level > 9 ? 9 : level);
+    if (!ctx->inited) {
+        if (deflateInit2(&ctx->zs, level, Z_DEFLATED, MAX_WBITS, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        ctx->inited = true;
+        ctx->level = level;
+    } else {
+        deflateReset(&ctx->zs);
+        if (ctx->level != level && deflateParams(&ctx->zs, level, Z_DEFAULT_STRATEGY) == Z_OK)
+            ctx->level = level;
+    }
+
+    ctx->zbuf.resize(deflateBound(&ctx->zs, (uLong)data.size()) + 16);
+    ctx->zs.next_in = (Bytef *)data.data();
+    ctx->zs.avail_in = (uInt)data.size();
+    ctx->zs.next_out = ctx->zbuf.data();
+    ctx->zs.avail_out = (uInt)ctx->zbuf.size();
+    if (deflate(&ctx->zs, Z_SYNC_FLUSH) != Z_OK || ctx->zs.avail_in != 0)
+        return false;
+
+    size_t zlen = ctx->zbuf.size() - ctx->zs.avail_out;
+    tvTightPutCompactLength(out, zlen);
+    out.insert(out.end(), ctx->zbuf.begin(), ctx->zbuf.begin() + zlen);
+    return true;
+}
+
+static bool tvTightPutIndexed(TVTightContext *ctx, std::vector<uint8_t> &out, const uint8_t *fb, size_t stride,
+                              int x, int y, int w, int h, const uint32_t *palette, int n, int level) {
+    out.push_back(cTightExplicitFilter | (cTightStream << 4) | cTightResetStream);
+    out.push_back(cTightFilterPalette);
+    out.push_back((uint8_t)(n - 1));
+    for (int k = 0; k < n; ++k) {
+        uint8_t tp[3];
+        tvTightPutTPixel(tp, palette[k]);
+        out.insert(out.end(), tp, tp + 3);
+    }
+
+    std::vector<uint8_t> &packed = ctx->packed;
+    if (n == 2) {
+        // 1 bit per pixel, rows padded to whole bytes, most significant bit first
+        int rowBytes = (w + 7) / 8;
+        packed.assign((size_t)rowBytes * (size_t)h, 0);
+        for (int j = 0; j < h; ++j) {
+            const uint32_t *src = tvTightRow(fb, stride, x, y + j);
+            uint8_t *row = packed.data() + (size_t)j * (size_t)rowBytes;
+            int i = 0;
+            for (; i + 8 <= w; i += 8)
+                row[i >> 3] = tvTightMonoByte(src + i, palette[1]);
+            for (; i < w; ++i) {
+                if ((src[i] & cTightPixelMask) == palette[1])
+                    row[i >> 3] |= (uint8_t)(0x80 >> (i & 7));
+            }
+        }
+    } else {
+        packed.resize((size_t)w * (size_t)h);
+        uint8_t *dst = packed.data();
+        for (int j = 0; j < h; ++j) {
+            const uint32_t *row = tvTightRow(fb, stride, x, y + j);
+            int i = 0;
+            while (i < w) {
+                uint32_t px = row[i] & cTightPixelMask;
+                int run = tvTightRunLength(row + i, w - i, px);
+                memset(dst, tvTightPaletteIndex(palette, n, px), (size_t)run);
+                dst += run;
+                i += run;
+            }
+        }
+    }
+    return tvTightPutData(ctx, out, level);
+}
+
+static bool tvTightPutFullColor(TVTightContext *ctx, std::vector<uint8_t> &out, const uint8_t *fb, size_t stride,
+                                int x, int y, int w, int h, int level) {
+    out.push_back((cTightStream << 4) | cTightResetStream);
+
+    std::vector<uint8_t> &packed = ctx->packed;
+    packed.resize((size_t)w * (size_t)h * 3);
+    for (int j = 0; j < h; ++j)
+        tvTightPackRow(packed.data() + (size_t)j * (size_t)w * 3, tvTightRow(fb, stride, x, y + j), w);
+    return tvTightPutData(ctx, out, level);
+}
+
+#if TV_TIGHT_HAS_JPEG
+static bool tvTightPutJpeg(TVTightContext *ctx, std::vector<uint8_t> &out, const uint8_t *fb, size_t stride, int x,
+                           int y, int w, int h, const TVTightParams *params) {
+    if (!ctx->tj && !(ctx->tj = tjInitCompress()))
+        return false;
+
+    int subsamp = cTightSubsampToTJ[(params->jpegSubsamp >= 0 && params->jpegSubsamp < 4) ? params->jpegSubsamp : 0];
+    int quality = params->jpegQuality < 1 ? 1 : (params->jpegQuality > 100 ? 100 : params->jpegQuality);
+    ctx->jpeg.resize(tjBufSize(w, h, subsamp));
+    unsigned char *buf = ctx->jpeg.data();
+    unsigned long size = ctx->jpeg.size();
+    const uint8_t *src = fb + (size_t)y * stride + (size_t)x * 4;
+    if (tjCompress2(ctx->tj, src, w, (int)stride, h, TJPF_BGRX, &buf, &size, subsamp, quality,
+                    TJFLAG_NOREALLOC | TJFLAG_FASTDCT) != 0)
+        return false;
+
+    out.push_back(cTightJpeg);
+    tvTightPutCompactLength(out, size);
+    out.insert(out.end(), buf, buf + size);
+    return true;
+}
+#endif
+
+bool TVTightEncodeRect(const uint8_t *fb, size_t stride, int x, int y, int w, int h, const TVTightParams *params,
+                       std::vector<uint8_t> &out) {
+    if (w <= 0 || h <= 0 || w > TV_TIGHT_MAX_RECT_WIDTH)
+        return false;
+
+    TVTightContext *ctx = tvTightContext();
+    auto began = std::chrono::steady_clock::now();
+    size_t start = out.size();
+    tvTightPutHeader(out, x, y, w, h);
+
+    uint32_t palette[cTightMaxPaletteColors];
+    int n = tvTightFillPalette(fb, stride, x, y, w, h, palette, cTightMaxPaletteColors);
+
+    bool ok;
+    TVTightKind kind;
+    if (n == 1) {
+        uint8_t fill[4] = {cTightFill};
+        tvTightPutTPixel(fill + 1, palette[0]);
+        out.insert(out.end(), fill, fill + sizeof(fill));
+        ok = true;
+        kind = TVTightKindFill;
+    } else if (n <= cTightMaxPaletteColors) {
+        ok = tvTightPutIndexed(ctx, out, fb, stride, x, y, w, h, palette, n, params->zlibLevel);
+        kind = TVTightKindPalette;
+    }
+#if TV_TIGHT_HAS_JPEG
+    else if (params->jpegQuality >= 0 && w * h >= cTightMinJpegArea) {
+        ok = tvTightPutJpeg(ctx, out, fb, stride, x, y, w, h, params);
+        kind = TVTightKindJpeg;
+    }
+#endif
+    else {
+        ok = tvTightPutFullColor(ctx, out, fb, stride, x, y, w, h, params->zlibLevel);
+        kind = TVTightKindFullColor;
+    }
+
+    if (!ok) {
+        out.resize(start);
+        return false;
+    }
+
+    auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - began);
+    gTightRects[kind].fetch_add(1, std::memory_order_relaxed);
+    gTightPixels[kind].fetch_add((uint64_t)w * (uint64_t)h, std::memory_order_relaxed);
+    gTightBytes[kind].fetch_add(out.size() - start, std::memory_order_relaxed);
+    gTightNanos[kind].fetch_add((uint64_t)nanos.count(), std::memory_order_relaxed);
+    return true;
+}
+
+void TVTightGetStats(TVTightKindStats stats[TVTightKindCount]) {
+    for (int k = 0; k < TVTightKindCount; ++k) {
+        stats[k].rects = gTightRects[k].load(std::memory_order_relaxed);
+        stats[k].pixels = gTightPixels[k].load(std::memory_order_relaxed);
+        stats[k].bytes = gTightBytes[k].load(std::memory_order_relaxed);
+        stats[k].nanos = gTightNanos[k].load(std::memory_order_relaxed);
+    }
+}
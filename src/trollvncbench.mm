@@ -0,0 +1,402 @@
+/*
+ This file is part of TrollVNC
+ Copyright (c) 2025 82Flex <82flex@gmail.com> and contributors
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License version 2
+ as published by the Free Software Foundation.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Encoder benchmark: feeds recorded frames to the in-tree encoders (HextileEncoder.mm, TightEncoder.mm) and
+// to libvncserver's Raw, Hextile, ZRLE and Tight encoders, cell by cell, and reports output size and time per
+// encoder. Frames are raw 32-bit BGRX, as the server's framebuffer, e.g. from a screenshot:
+//
+//   ffmpeg -i shot.png -f rawvideo -pix_fmt bgra shot.bgra
+//
+// A file may hold any number of frames back to back (a screen recording converted the same way).
+//
+// libvncserver's encoders only write to a client, so they are driven through a client connected over the
+// loopback interface, whose other end is drained by a thread; their time includes handing the bytes to the
+// kernel, which the in-tree encoders (measured encoding into memory) do not pay.
+
+#import <rfb/rfb.h>
+
+extern "C" {
+#import <rfb/rfbregion.h> // has no C++ guard of its own
+}
+
+#import <algorithm>
+#import <arpa/inet.h>
+#import <chrono>
+#import <errno.h>
+#import <netinet/in.h>
+#import <pthread.h>
+#import <stdio.h>
+#import <stdlib.h>
+#import <string.h>
+#import <string>
+#import <sys/socket.h>
+#import <unistd.h>
+#import <vector>
+
+#import "HextileEncoder.h"
+#import "TightEncoder.h"
+
+typedef enum {
+    TVBenchHextile,
+    TVBenchTight,
+    TVBenchVncRaw,
+    TVBenchVncHextile,
+    TVBenchVncZrle,
+    TVBenchVncTight,
+    TVBenchEncoderCount,
+} TVBenchEncoder;
+
+static const char *const kEncoderNames[TVBenchEncoderCount] = {
+    "hextile", "tight", "vnc-raw", "vnc-hextile", "vnc-zrle", "vnc-tight",
+};
+
+static const int kEncoderRfbEncodings[TVBenchEncoderCount] = {
+    rfbEncodingHextile, rfbEncodingTight, rfbEncodingRaw, rfbEncodingHextile, rfbEncodingZRLE, rfbEncodingTight,
+};
+
+typedef struct {
+    int width;
+    int height;
+    int cell;        // side of the cells a frame is cut into, as with -b
+    int passes;      // times every frame is encoded
+    int jpegQuality; // 1..100, or -1 for lossless only
+    int jpegSubsamp; // libvncserver turboSubsampLevel
+    int zlibLevel;   // 0..9
+    bool enabled[TVBenchEncoderCount];
+} TVBenchOptions;
+
+typedef struct {
+    uint64_t frames;
+    uint64_t pixels;
+    uint64_t bytes;
+    uint64_t nanos;
+} TVBenchResult;
+
+typedef struct {
+    rfbClientPtr cl;
+    int peer; // our end of the connection, drained by drainThread
+    pthread_t drainThread;
+} TVBenchClient;
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-c cell] [-n passes] [-q quality] [-s subsamp] [-z level] [-e encoders] WxH frames...\n"
+            "  -c cell      Cell side in pixels, 16..2048 (default 128, as -b)\n"
+            "  -n passes    Encode every frame this many times (default 3)\n"
+            "  -q quality   JPEG quality 1..100 for Tight, or -1 for lossless (default -1)\n"
+            "  -s subsamp   JPEG subsampling: 0 = 4:4:4, 1 = 4:2:0, 2 = 4:2:2, 3 = gray (default 0)\n"
+            "  -z level     zlib level 0..9 for Tight and ZRLE (default 1)\n"
+            "  -e encoders  Comma-separated subset of: hextile, tight, vnc-raw, vnc-hextile, vnc-zrle, vnc-tight\n"
+            "               (default all)\n"
+            "  frames       Files of raw 32-bit BGRX frames of WxH pixels, back to back\n",
+            prog);
+}
+
+static bool parseEncoders(const char *list, bool enabled[TVBenchEncoderCount]) {
+    for (int e = 0; e < TVBenchEncoderCount; ++e)
+        enabled[e] = false;
+    std::string rest(list);
+    size_t start = 0;
+    while (start <= rest.size()) {
+        size_t comma = rest.find(',', start);
+        std::string name = rest.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        bool found = false;
+        for (int e = 0; e < TVBenchEncoderCount; ++e) {
+            if (name == kEncoderNames[e]) {
+                enabled[e] = found = true;
+                break;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "Unknown encoder: %s\n", name.c_str());
+            return false;
+        }
+        if (comma == std::string::npos)
+            break;
+        start = comma + 1;
+    }
+    return true;
+}
+
+static bool loadFrames(const char *path, size_t frameBytes, std::vector<std::vector<uint8_t>> &frames) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    size_t count = 0;
+    for (;;) {
+        std::vector<uint8_t> frame(frameBytes);
+        size_t got = fread(frame.data(), 1, frameBytes, fp);
+        if (got == 0)
+            break;
+        if (got != frameBytes) {
+            fprintf(stderr, "%s: trailing %zu bytes are not a whole frame\n", path, got);
+            fclose(fp);
+            return false;
+        }
+        frames.push_back(std::move(frame));
+        count++;
+    }
+    fclose(fp);
+    if (count == 0) {
+        fprintf(stderr, "%s: no frames\n", path);
+        return false;
+    }
+    return true;
+}
+
+#pragma mark - Loopback Client
+
+static void *drainThread(void *arg) {
+    TVBenchClient *client = (TVBenchClient *)arg;
+    static uint8_t sink[1 << 16];
+    while (read(client->peer, sink, sizeof(sink)) > 0) {
+    }
+    return NULL;
+}
+
+// A libvncserver client of screen on a loopback TCP connection, past the handshake and ready for updates.
+static bool benchClientOpen(TVBenchClient *client, rfbScreenInfoPtr screen) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) {
+        perror("socket");
+        return false;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 1) < 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &addrLen) < 0) {
+        perror("listen");
+        close(listener);
+        return false;
+    }
+    client->peer = socket(AF_INET, SOCK_STREAM, 0);
+    if (client->peer < 0 || connect(client->peer, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        if (client->peer >= 0)
+            close(client->peer);
+        close(listener);
+        return false;
+    }
+    int sock = accept(listener, NULL, NULL);
+    close(listener);
+    if (sock < 0) {
+        perror("accept");
+        close(client->peer);
+        return false;
+    }
+    pthread_create(&client->drainThread, NULL, drainThread, client);
+
+    client->cl = rfbNewClient(screen, sock);
+    if (!client->cl) {
+        shutdown(client->peer, SHUT_RDWR);
+        pthread_join(client->drainThread, NULL);
+        close(client->peer);
+        return false;
+    }
+    client->cl->state = rfbClientRec::RFB_NORMAL;
+    client->cl->enableCursorShapeUpdates = TRUE; // keep the cursor out of the pixels
+    client->cl->cursorWasChanged = FALSE;
+    client->cl->cursorWasMoved = FALSE;
+    return true;
+}
+
+static void benchClientClose(TVBenchClient *client) {
+    rfbCloseClient(client->cl);
+    rfbClientConnectionGone(client->cl);
+    pthread_join(client->drainThread, NULL);
+    close(client->peer);
+}
+
+#pragma mark - Runs
+
+static uint64_t elapsedNanos(std::chrono::steady_clock::time_point began) {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - began)
+        .count();
+}
+
+// One pass of an in-tree encoder over fb, cell by cell.
+static void encodeInTree(TVBenchEncoder encoder, const TVBenchOptions *opts, const uint8_t *fb,
+                         const TVTightParams *params, std::vector<uint8_t> &out, TVBenchResult *result) {
+    size_t stride = (size_t)opts->width * 4;
+    out.clear();
+    auto began = std::chrono::steady_clock::now();
+    for (int y = 0; y < opts->height; y += opts->cell) {
+        int h = std::min(opts->cell, opts->height - y);
+        for (int x = 0; x < opts->width; x += opts->cell) {
+            int w = std::min(opts->cell, opts->width - x);
+            if (encoder == TVBenchHextile)
+                TVHextileEncodeRect(fb, stride, x, y, w, h, out);
+            else
+                TVTightEncodeRect(fb, stride, x, y, w, h, params, out);
+        }
+    }
+    result->nanos += elapsedNanos(began);
+    result->bytes += out.size();
+}
+
+// One pass of libvncserver's encoder over the screen's framebuffer, one update per cell.
+static void encodeWithClient(const TVBenchOptions *opts, rfbClientPtr cl, TVBenchResult *result) {
+    uint32_t sentBefore = (uint32_t)rfbStatGetSentBytes(cl);
+    auto began = std::chrono::steady_clock::now();
+    for (int y = 0; y < opts->height; y += opts->cell) {
+        int h = std::min(opts->cell, opts->height - y);
+        for (int x = 0; x < opts->width; x += opts->cell) {
+            int w = std::min(opts->cell, opts->width - x);
+            sraRegionPtr region = sraRgnCreateRect(x, y, x + w, y + h);
+            sraRgnOr(cl->requestedRegion, region);
+            rfbSendFramebufferUpdate(cl, region);
+            sraRgnDestroy(region);
+        }
+    }
+    result->nanos += elapsedNanos(began);
+    result->bytes += (uint32_t)rfbStatGetSentBytes(cl) - sentBefore;
+}
+
+static void printResult(const char *name, const TVBenchResult *r) {
+    double mpix = r->pixels / 1e6;
+    double ms = r->nanos / 1e6;
+    printf("%-12s %8llu %10.1f %10.2f %8.3f %10.2f %10.1f\n", name, (unsigned long long)r->frames, mpix,
+           r->bytes / 1048576.0, r->pixels ? (double)r->bytes / (double)(r->pixels * 4) : 0.0,
+           r->frames ? ms / (double)r->frames : 0.0, ms > 0 ? mpix / (ms / 1e3) : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+    TVBenchOptions opts;
+    opts.width = opts.height = 0;
+    opts.cell = 128;
+    opts.passes = 3;
+    opts.jpegQuality = -1;
+    opts.jpegSubsamp = 0;
+    opts.zlibLevel = 1;
+    for (int e = 0; e < TVBenchEncoderCount; ++e)
+        opts.enabled[e] = true;
+
+    int ch;
+    while ((ch = getopt(argc, argv, "c:n:q:s:z:e:h")) != -1) {
+        switch (ch) {
+        case 'c':
+            opts.cell = atoi(optarg);
+            break;
+        case 'n':
+            opts.passes = atoi(optarg);
+            break;
+        case 'q':
+            opts.jpegQuality = atoi(optarg);
+            break;
+        case 's':
+            opts.jpegSubsamp = atoi(optarg);
+            break;
+        case 'z':
+            opts.zlibLevel = atoi(optarg);
+            break;
+        case 'e':
+            if (!parseEncoders(optarg, opts.enabled))
+                return EXIT_FAILURE;
+            break;
+        default:
+            usage(argv[0]);
+            return ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind + 2 > argc || sscanf(argv[optind], "%dx%d", &opts.width, &opts.height) != 2 || opts.width <= 0 ||
+        opts.height <= 0 || opts.width > 0xFFFF || opts.height > 0xFFFF) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (opts.cell < 16 || opts.cell > TV_TIGHT_MAX_RECT_WIDTH || opts.passes < 1 || opts.jpegQuality == 0 ||
+        opts.jpegQuality < -1 || opts.jpegQuality > 100 || opts.jpegSubsamp < 0 || opts.jpegSubsamp > 3 ||
+        opts.zlibLevel < 0 || opts.zlibLevel > 9) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    size_t frameBytes = (size_t)opts.width * (size_t)opts.height * 4;
+    std::vector<std::vector<uint8_t>> frames;
+    for (int i = optind + 1; i < argc; ++i) {
+        if (!loadFrames(argv[i], frameBytes, frames))
+            return EXIT_FAILURE;
+    }
+
+    rfbLogEnable(0);
+    int screenArgc = 1;
+    rfbScreenInfoPtr screen = rfbGetScreen(&screenArgc, argv, opts.width, opts.height, 8, 3, 4);
+    if (!screen) {
+        fprintf(stderr, "Failed to create rfbScreenInfo\n");
+        return EXIT_FAILURE;
+    }
+    std::vector<uint8_t> fb(frameBytes);
+    screen->frameBuffer = (char *)fb.data();
+
+    TVTightParams params;
+    params.jpegQuality = opts.jpegQuality;
+    params.jpegSubsamp = opts.jpegSubsamp;
+    params.zlibLevel = opts.zlibLevel;
+
+    printf("%zu frames of %dx%d, %dpx cells, %d passes, JPEG quality %d, zlib level %d\n\n", frames.size(),
+           opts.width, opts.height, opts.cell, opts.passes, opts.jpegQuality, opts.zlibLevel);
+    printf("%-12s %8s %10s %10s %8s %10s %10s\n", "encoder", "frames", "MP", "out MB", "ratio", "ms/frame", "MP/s");
+
+    std::vector<uint8_t> out;
+    for (int e = 0; e < TVBenchEncoderCount; ++e) {
+        if (!opts.enabled[e])
+            continue;
+        TVBenchEncoder encoder = (TVBenchEncoder)e;
+        bool inTree = encoder == TVBenchHextile || encoder == TVBenchTight;
+
+        // Every encoder gets a connection of its own, so zlib streams start fresh
+        TVBenchClient client;
+        if (!inTree) {
+            if (!benchClientOpen(&client, screen)) {
+                fprintf(stderr, "%s: failed to set up the loopback client\n", kEncoderNames[e]);
+                continue;
+            }
+            rfbClientPtr cl = client.cl;
+            cl->preferredEncoding = kEncoderRfbEncodings[e];
+            cl->tightCompressLevel = opts.zlibLevel;
+            cl->zlibCompressLevel = opts.zlibLevel;
+            cl->tightQualityLevel = opts.jpegQuality > 0 ? std::min(opts.jpegQuality / 10, 9) : -1;
+            cl->turboQualityLevel = opts.jpegQuality;
+            cl->turboSubsampLevel = opts.jpegSubsamp;
+        }
+
+        TVBenchResult result;
+        memset(&result, 0, sizeof(result));
+        for (int pass = 0; pass < opts.passes; ++pass) {
+            for (const std::vector<uint8_t> &frame : frames) {
+                memcpy(fb.data(), frame.data(), frameBytes);
+                if (inTree)
+                    encodeInTree(encoder, &opts, fb.data(), &params, out, &result);
+                else
+                    encodeWithClient(&opts, client.cl, &result);
+                result.frames++;
+                result.pixels += (uint64_t)opts.width * (uint64_t)opts.height;
+            }
+        }
+        if (!inTree)
+            benchClientClose(&client);
+        printResult(kEncoderNames[e], &result);
+    }
+
+    screen->frameBuffer = NULL;
+    rfbScreenCleanup(screen);
+    return EXIT_SUCCESS;
+}
@@ -22,6 +22,7 @@
 #import <Accelerate/Accelerate.h>
 #import <Foundation/Foundation.h>
 
+#import <algorithm>
 #import <arpa/inet.h>
 #import <atomic>
 #import <climits>
@@ -30,26 +31,48 @@
 #import <cstring>
 #import <errno.h>
 #import <fcntl.h>
+#import <libvncserver/scale.h>
+#import <list>
 #import <mach-o/dyld.h>
+#import <memory>
 #import <netinet/in.h>
+#import <netinet/tcp.h>
+#import <poll.h>
 #import <pthread.h>
 #import <rfb/keysym.h>
 #import <rfb/rfb.h>
 #import <string>
+#import <sys/event.h>
+#import <sys/resource.h>
 #import <sys/socket.h>
 #import <sys/sysctl.h>
+#import <sys/uio.h>
 #import <unistd.h>
+#import <unordered_map>
 #import <vector>
 
 #import "BulletinManager.h"
 #import "ClipboardManager.h"
 #import "Control.h"
 #import "FBSOrientationObserver.h"
+#import "H264Encoder.h"
+#import "HextileEncoder.h"
 #import "IOKitSPI.h"
 #import "Logging.h"
 #import "PSAssistiveTouchSettingsDetail.h"
 #import "STHIDEventGenerator.h"
 #import "ScreenCapturer.h"
+#import "TightEncoder.h"
+
+extern "C" {
+#import <rfb/rfbregion.h>
+}
+
+#if !TARGET_OS_SIMULATOR
+extern "C" {
+#import "kern_memorystatus.h"
+}
+#endif
 
 #define LocalizedString(key, comment, bundle, table)                                                                   \
     (NSLocalizedStringFromTableInBundle((key), (table), (bundle), (comment)) ?: (key))
@@ -81,6 +104,24 @@ static int gTileSize = 32;                  // Tile size for dirty detection (pi
 static int gFullscreenThresholdPercent = 0; // If changed tiles exceed this %, update full screen
 static int gMaxRectsLimit = 256;            // Max rects before falling back to bbox/fullscreen
 static BOOL gAsyncSwapEnabled = NO;         // Enable non-blocking swap (may cause tearing)
+static BOOL gClientScalingEnabled = NO;     // Let each client pick a scale level via SetDesktopSize
+static BOOL gSharedEncodingEnabled = NO;    // Encode Tight updates once for clients with equal parameters
+static BOOL gHextileEncodingEnabled = NO;   // Encode Hextile updates with the in-tree vectorized encoder
+static BOOL gH264Enabled = NO;              // Send Open H.264 to clients that advertise it
+static BOOL gEncodingPolicyEnabled = NO;    // Adjust encoder parameters to each client's link and CPU headroom
+static BOOL gContinuousUpdatesEnabled = NO; // Offer ContinuousUpdates and Fence to clients that support them
+static BOOL gUpdatePacingEnabled = NO;      // Pace each client's updates to its measured delivery rate
+static int gSendHighWaterKB = 0;            // Hold updates while a client's socket backlog exceeds this (0 = off)
+static BOOL gSocketTuningEnabled = NO;      // Size each client's socket buffers to its link
+static BOOL gPointerFocusEnabled = NO;      // Send the area around a client's pointer first on congested links
+static int gSliceTargetMs = 0;              // Slice updates that would hold a client's link longer (0 = off)
+static int gChangeTolerance = 0;            // Ignore tile changes up to this per-channel delta (0 = off)
+static int gVideoRegionQuality = 0;         // JPEG quality for detected video regions (0 = off)
+static BOOL gTileClassesEnabled = NO;       // Classify flushed tiles; send text/palette-only updates lossless
+static double gRefineIdleSec = 0.0;         // Re-send lossy tiles losslessly once idle this long (0 = off)
+static int gAdaptiveQualityMin = 0;         // Adaptive JPEG quality lower bound
+static int gAdaptiveQualityMax = 0;         // Adaptive JPEG quality upper bound (0 = controller off)
+static double gDownshiftMinScale = 0.0;     // Lowest congestion downshift factor (0 = off)
 
 // Wheel scroll coalescing state (async, non-blocking)
 static double gWheelStepPx = 48.0;        // base pixels per wheel tick (lower = slower)
@@ -255,16 +296,35 @@ static void printUsageAndExit(const char *prog) {
 
     fprintf(stderr, "Display/Perf:\n");
     fprintf(stderr, "  -s scale   Output scale 0<s<=1 (default: %.2f)\n", gScale);
+    fprintf(stderr, "  -S min     Lower output scale under congestion down to min x scale (0.25..0.75, 0=off)\n");
     fprintf(stderr, "  -F spec    Frame rate: fps | min-max | min:pref:max\n");
     fprintf(stderr, "  -d sec     Defer window (0..0.5, default: %.3f)\n", gDeferWindowSec);
-    fprintf(stderr, "  -Q n       Max in-flight encodes (0=never drop, default: %d)\n\n", gMaxInflightUpdates);
+    fprintf(stderr, "  -Q n       Max in-flight encodes (0=never drop, default: %d)\n", gMaxInflightUpdates);
+    fprintf(stderr, "  -q spec    Adaptive JPEG quality bounds per client: min-max | max (1..100, 0=off)\n\n");
 
     fprintf(stderr, "Dirty detection:\n");
     fprintf(stderr, "  -t size    Tile size (8..128, default: %d)\n", gTileSize);
     fprintf(stderr, "  -P pct     Fullscreen fallback threshold (0..100; 0=disable dirty detection, default: %d)\n",
             gFullscreenThresholdPercent);
     fprintf(stderr, "  -R max     Max dirty rects before bbox (default: %d)\n", gMaxRectsLimit);
-    fprintf(stderr, "  -a         Non-blocking swap (may cause tearing)\n\n");
+    fprintf(stderr, "  -L thr     Ignore tile changes within this color delta (0..64, 0=off, default: %d)\n",
+            gChangeTolerance);
+    fprintf(stderr, "  -G q       JPEG quality for detected video regions (0..100, 0=off, default: %d)\n",
+            gVideoRegionQuality);
+    fprintf(stderr, "  -g         Send updates of solid, palette and text tiles lossless\n");
+    fprintf(stderr, "  -r sec     Re-send lossy tiles losslessly once unchanged this long (0.5..30, 0=off)\n");
+    fprintf(stderr, "  -a         Non-blocking swap (may cause tearing)\n");
+    fprintf(stderr, "  -m         Per-client output size 1, 1/2 or 1/4 from the viewer's resize request\n");
+    fprintf(stderr, "  -b         Encode Tight updates once and share them between clients\n");
+    fprintf(stderr, "  -E         Encode Hextile updates with the in-tree vectorized encoder\n");
+    fprintf(stderr, "  -x         Send H.264 video (Open H.264) to clients that support it\n");
+    fprintf(stderr, "  -o         Adjust compression per client from link speed and CPU headroom\n");
+    fprintf(stderr, "  -u         Push updates without waiting for requests (ContinuousUpdates, Fence)\n");
+    fprintf(stderr, "  -l         Pace each client's updates to its measured link rate\n");
+    fprintf(stderr, "  -z kb      Hold updates while a client's unsent data exceeds kb KiB (16..16384, 0=off)\n");
+    fprintf(stderr, "  -j         Size each client's socket buffers to its link (NODELAY, NOTSENT_LOWAT, SNDBUF)\n");
+    fprintf(stderr, "  -f         On congested links, send the area around each client's pointer first\n");
+    fprintf(stderr, "  -y ms      Slice updates that would take a client's link longer than ms (20..1000, 0=off)\n\n");
 
     fprintf(stderr, "Scroll/Input:\n");
     fprintf(stderr, "  -W px      Wheel step in pixels (0=disable, default: %.0f)\n", gWheelStepPx);
@@ -386,6 +446,32 @@ static void parseWheelOptions(const char *spec) {
     free(dup);
 }
 
+// Parse "min-max" or "max" (min defaults to 1) into adaptive quality bounds; "0" turns the controller off.
+static BOOL parseAdaptiveQualitySpec(const char *spec, int *outMin, int *outMax) {
+    if (!spec || spec[0] == '\0')
+        return NO;
+    char *end = NULL;
+    long a = strtol(spec, &end, 10);
+    long b = a;
+    if (end && *end == '-') {
+        b = strtol(end + 1, &end, 10);
+    } else {
+        a = a > 0 ? 1 : 0;
+    }
+    if (!end || *end != '\0')
+        return NO;
+    if (b == 0 && a == 0) {
+        *outMin = 0;
+        *outMax = 0;
+        return YES;
+    }
+    if (a < 1 || b > 100 || a > b)
+        return NO;
+    *outMin = (int)a;
+    *outMax = (int)b;
+    return YES;
+}
+
 static void parseDaemonOptions(void) {
     NSDictionary *prefs = nil;
 
@@ -456,6 +542,21 @@ static void parseDaemonOptions(void) {
         gScale = v;
     }
 
+    NSNumber *downshiftN = [prefs objectForKey:@"DownshiftMinScale"];
+    if ([downshiftN isKindOfClass:[NSNumber class]]) {
+        double v = downshiftN.doubleValue;
+        if (v < 0.0 || v > 0.75 || (v > 0.0 && v < 0.25)) {
+            TVLog(@"-daemon: invalid DownshiftMinScale=%.3f; clamped to [0.25..0.75] (0=off)", v);
+        }
+        if (v <= 0.0)
+            v = 0.0;
+        else if (v < 0.25)
+            v = 0.25;
+        else if (v > 0.75)
+            v = 0.75;
+        gDownshiftMinScale = v;
+    }
+
     NSNumber *deferN = [prefs objectForKey:@"DeferWindowSec"];
     if ([deferN isKindOfClass:[NSNumber class]]) {
         double v = deferN.doubleValue;
@@ -526,6 +627,90 @@ static void parseDaemonOptions(void) {
         gMaxRectsLimit = v;
     }
 
+    NSNumber *tolN = [prefs objectForKey:@"ChangeTolerance"];
+    if ([tolN isKindOfClass:[NSNumber class]]) {
+        int v = tolN.intValue;
+        if (v < 0) {
+            TVLog(@"-daemon: ChangeTolerance < 0; set to 0");
+            v = 0;
+        }
+        if (v > 64) {
+            TVLog(@"-daemon: ChangeTolerance > 64; clamped to 64");
+            v = 64;
+        }
+        gChangeTolerance = v;
+    }
+
+    NSNumber *videoQN = [prefs objectForKey:@"VideoRegionQuality"];
+    if ([videoQN isKindOfClass:[NSNumber class]]) {
+        int v = videoQN.intValue;
+        if (v < 0) {
+            TVLog(@"-daemon: VideoRegionQuality < 0; set to 0");
+            v = 0;
+        }
+        if (v > 100) {
+            TVLog(@"-daemon: VideoRegionQuality > 100; clamped to 100");
+            v = 100;
+        }
+        gVideoRegionQuality = v;
+    }
+
+    NSNumber *refineN = [prefs objectForKey:@"LosslessRefineSec"];
+    if ([refineN isKindOfClass:[NSNumber class]]) {
+        double v = refineN.doubleValue;
+        if (v < 0.0 || v > 30.0 || (v > 0.0 && v < 0.5)) {
+            TVLog(@"-daemon: invalid LosslessRefineSec=%.3f; clamped to [0.5..30] (0=off)", v);
+        }
+        if (v <= 0.0)
+            v = 0.0;
+        else if (v < 0.5)
+            v = 0.5;
+        else if (v > 30.0)
+            v = 30.0;
+        gRefineIdleSec = v;
+    }
+
+    NSNumber *sliceN = [prefs objectForKey:@"SliceTargetMs"];
+    if ([sliceN isKindOfClass:[NSNumber class]]) {
+        int v = sliceN.intValue;
+        if (v < 0 || v > 1000 || (v > 0 && v < 20)) {
+            TVLog(@"-daemon: invalid SliceTargetMs=%d; clamped to [20..1000] (0=off)", v);
+        }
+        if (v <= 0)
+            v = 0;
+        else if (v < 20)
+            v = 20;
+        else if (v > 1000)
+            v = 1000;
+        gSliceTargetMs = v;
+    }
+
+    NSNumber *highWaterN = [prefs objectForKey:@"SendHighWaterKB"];
+    if ([highWaterN isKindOfClass:[NSNumber class]]) {
+        int v = highWaterN.intValue;
+        if (v < 0 || v > 16384 || (v > 0 && v < 16)) {
+            TVLog(@"-daemon: invalid SendHighWaterKB=%d; clamped to [16..16384] (0=off)", v);
+        }
+        if (v <= 0)
+            v = 0;
+        else if (v < 16)
+            v = 16;
+        else if (v > 16384)
+            v = 16384;
+        gSendHighWaterKB = v;
+    }
+
+    NSString *aqSpec = [prefs objectForKey:@"AdaptiveQuality"];
+    if ([aqSpec isKindOfClass:[NSString class]] && aqSpec.length > 0) {
+        int minV = 0, maxV = 0;
+        if (parseAdaptiveQualitySpec(aqSpec.UTF8String, &minV, &maxV)) {
+            gAdaptiveQualityMin = minV;
+            gAdaptiveQualityMax = maxV;
+        } else {
+            TVLog(@"-daemon: invalid AdaptiveQuality=%@; ignored", aqSpec);
+        }
+    }
+
     NSNumber *wheelPxN = [prefs objectForKey:@"WheelStepPx"];
     if ([wheelPxN isKindOfClass:[NSNumber class]]) {
         double v = wheelPxN.doubleValue;
@@ -582,6 +767,36 @@ static void parseDaemonOptions(void) {
     NSNumber *asyncSwapN = [prefs objectForKey:@"AsyncSwap"];
     if ([asyncSwapN isKindOfClass:[NSNumber class]])
         gAsyncSwapEnabled = asyncSwapN.boolValue;
+    NSNumber *classesN = [prefs objectForKey:@"ContentClasses"];
+    if ([classesN isKindOfClass:[NSNumber class]])
+        gTileClassesEnabled = classesN.boolValue;
+    NSNumber *clientScalingN = [prefs objectForKey:@"ClientScaling"];
+    if ([clientScalingN isKindOfClass:[NSNumber class]])
+        gClientScalingEnabled = clientScalingN.boolValue;
+    NSNumber *sharedEncN = [prefs objectForKey:@"SharedEncoding"];
+    if ([sharedEncN isKindOfClass:[NSNumber class]])
+        gSharedEncodingEnabled = sharedEncN.boolValue;
+    NSNumber *hextileN = [prefs objectForKey:@"HextileEncoding"];
+    if ([hextileN isKindOfClass:[NSNumber class]])
+        gHextileEncodingEnabled = hextileN.boolValue;
+    NSNumber *h264N = [prefs objectForKey:@"H264Encoding"];
+    if ([h264N isKindOfClass:[NSNumber class]])
+        gH264Enabled = h264N.boolValue;
+    NSNumber *policyN = [prefs objectForKey:@"EncodingPolicy"];
+    if ([policyN isKindOfClass:[NSNumber class]])
+        gEncodingPolicyEnabled = policyN.boolValue;
+    NSNumber *continuousN = [prefs objectForKey:@"ContinuousUpdates"];
+    if ([continuousN isKindOfClass:[NSNumber class]])
+        gContinuousUpdatesEnabled = continuousN.boolValue;
+    NSNumber *pacingN = [prefs objectForKey:@"UpdatePacing"];
+    if ([pacingN isKindOfClass:[NSNumber class]])
+        gUpdatePacingEnabled = pacingN.boolValue;
+    NSNumber *sockTuneN = [prefs objectForKey:@"SocketTuning"];
+    if ([sockTuneN isKindOfClass:[NSNumber class]])
+        gSocketTuningEnabled = sockTuneN.boolValue;
+    NSNumber *focusN = [prefs objectForKey:@"PointerFocus"];
+    if ([focusN isKindOfClass:[NSNumber class]])
+        gPointerFocusEnabled = focusN.boolValue;
     NSNumber *keyLogN = [prefs objectForKey:@"KeyLogging"];
     if ([keyLogN isKindOfClass:[NSNumber class]])
         gKeyEventLogging = keyLogN.boolValue;
@@ -837,8 +1052,19 @@ static void parseDaemonOptions(void) {
     [cfg appendFormat:@"viewOnly=%@ clip=%@ keepAlive=%.0fs ", gViewOnly ? @"YES" : @"NO",
                       gClipboardEnabled ? @"YES" : @"NO", gKeepAliveSec];
     [cfg appendFormat:@"scale=%.2f fps=%d:%d:%d defer=%.3f ", gScale, gFpsMin, gFpsPref, gFpsMax, gDeferWindowSec];
-    [cfg appendFormat:@"inflight=%d tile=%d full%%=%d rects=%d ", gMaxInflightUpdates, gTileSize,
-                      gFullscreenThresholdPercent, gMaxRectsLimit];
+    [cfg appendFormat:@"inflight=%d tile=%d full%%=%d rects=%d tol=%d videoQ=%d refine=%.2f ", gMaxInflightUpdates,
+                      gTileSize, gFullscreenThresholdPercent, gMaxRectsLimit, gChangeTolerance, gVideoRegionQuality,
+                      gRefineIdleSec];
+    [cfg appendFormat:@"classes=%@ ", gTileClassesEnabled ? @"YES" : @"NO"];
+    [cfg appendFormat:@"aq=%d-%d downshift=%.2f ", gAdaptiveQualityMin, gAdaptiveQualityMax, gDownshiftMinScale];
+    [cfg appendFormat:@"clientScale=%@ sharedEnc=%@ h264=%@ policy=%@ continuous=%@ pacing=%@ highWater=%dKB ",
+                      gClientScalingEnabled ? @"YES" : @"NO", gSharedEncodingEnabled ? @"YES" : @"NO",
+                      gH264Enabled ? @"YES" : @"NO", gEncodingPolicyEnabled ? @"YES" : @"NO",
+                      gContinuousUpdatesEnabled ? @"YES" : @"NO", gUpdatePacingEnabled ? @"YES" : @"NO",
+                      gSendHighWaterKB];
+    [cfg appendFormat:@"hextile=%@ ", gHextileEncodingEnabled ? @"YES" : @"NO"];
+    [cfg appendFormat:@"sockTune=%@ focus=%@ slice=%dms ", gSocketTuningEnabled ? @"YES" : @"NO",
+                      gPointerFocusEnabled ? @"YES" : @"NO", gSliceTargetMs];
     [cfg appendFormat:@"async=%@ cursor=%@ orient=%@ keylog=%@ ", gAsyncSwapEnabled ? @"YES" : @"NO",
                       gCursorEnabled ? @"YES" : @"NO", gOrientationSyncEnabled ? @"YES" : @"NO",
                       gKeyEventLogging ? @"YES" : @"NO"];
@@ -1048,7 +1274,7 @@ static void parseCLI(int argc, const char *argv[]) {
 #pragma clang diagnostic pop
 
     int opt;
-    const char *optstr = "p:n:vA:c:C:s:F:d:Q:t:P:R:aW:w:NM:KU:O:I:i:H:D:e:k:B:T:Vh";
+    const char *optstr = "p:n:vA:c:C:s:S:F:d:Q:q:t:P:R:L:G:gr:ambxEoulz:jfy:W:w:NM:KU:O:I:i:H:D:e:k:B:T:Vh";
     optind = 1;
     while ((opt = getopt(__argc2, __argv2.data(), optstr)) != -1) {
         switch (opt) {
@@ -1116,6 +1342,16 @@ static void parseCLI(int argc, const char *argv[]) {
             TVLog(@"CLI: Output scale factor set to %.3f", gScale);
             break;
         }
+        case 'S': {
+            double v = strtod(optarg, NULL);
+            if (!(v == 0.0 || (v >= 0.25 && v <= 0.75))) {
+                TVPrintError("Invalid downshift floor: %s (expected 0.25..0.75, or 0 to disable)", optarg);
+                exit(EXIT_FAILURE);
+            }
+            gDownshiftMinScale = v;
+            TVLog(@"CLI: Congestion downshift floor set to %.3f", gDownshiftMinScale);
+            break;
+        }
         case 'F': {
             // Accept formats: "fps", "min-max", "min:pref:max"
             const char *spec = optarg ? optarg : "";
@@ -1233,11 +1469,119 @@ static void parseCLI(int argc, const char *argv[]) {
             TVLog(@"CLI: Max rects limit set to %d", gMaxRectsLimit);
             break;
         }
+        case 'L': {
+            long t = strtol(optarg, NULL, 10);
+            if (t < 0 || t > 64) {
+                TVPrintError("Invalid change tolerance: %s (expected 0..64; 0 disables)", optarg);
+                exit(EXIT_FAILURE);
+            }
+            gChangeTolerance = (int)t;
+            TVLog(@"CLI: Change tolerance set to %d", gChangeTolerance);
+            break;
+        }
+        case 'g': {
+            gTileClassesEnabled = YES;
+            TVLog(@"CLI: Content-aware lossless updates enabled (-g)");
+            break;
+        }
+        case 'G': {
+            long q = strtol(optarg, NULL, 10);
+            if (q < 0 || q > 100) {
+                TVPrintError("Invalid video region quality: %s (expected 0..100; 0 disables)", optarg);
+                exit(EXIT_FAILURE);
+            }
+            gVideoRegionQuality = (int)q;
+            TVLog(@"CLI: Video region quality set to %d", gVideoRegionQuality);
+            break;
+        }
+        case 'r': {
+            double v = strtod(optarg, NULL);
+            if (!(v == 0.0 || (v >= 0.5 && v <= 30.0))) {
+                TVPrintError("Invalid lossless refine delay: %s (expected 0.5..30 seconds, or 0 to disable)", optarg);
+                exit(EXIT_FAILURE);
+            }
+            gRefineIdleSec = v;
+            TVLog(@"CLI: Lossless refinement of idle tiles after %.2fs", gRefineIdleSec);
+            break;
+        }
+        case 'q': {
+            if (!parseAdaptiveQualitySpec(optarg, &gAdaptiveQualityMin, &gAdaptiveQualityMax)) {
+                TVPrintError("Invalid adaptive quality spec: %s (expected min-max or max, 1..100; 0 disables)", optarg);
+                exit(EXIT_FAILURE);
+            }
+            TVLog(@"CLI: Adaptive quality bounds set to %d-%d", gAdaptiveQualityMin, gAdaptiveQualityMax);
+            break;
+        }
         case 'a': {
             gAsyncSwapEnabled = YES;
             TVLog(@"CLI: Non-blocking swap enabled (-a)");
             break;
         }
+        case 'm': {
+            gClientScalingEnabled = YES;
+            TVLog(@"CLI: Per-client output size enabled (-m)");
+            break;
+        }
+        case 'b': {
+            gSharedEncodingEnabled = YES;
+            TVLog(@"CLI: Shared Tight encoding enabled (-b)");
+            break;
+        }
+        case 'E': {
+            gHextileEncodingEnabled = YES;
+            TVLog(@"CLI: In-tree Hextile encoder enabled (-E)");
+            break;
+        }
+        case 'x': {
+            gH264Enabled = YES;
+            TVLog(@"CLI: Open H.264 encoding enabled (-x)");
+            break;
+        }
+        case 'o': {
+            gEncodingPolicyEnabled = YES;
+            TVLog(@"CLI: Server-side encoding policy enabled (-o)");
+            break;
+        }
+        case 'u': {
+            gContinuousUpdatesEnabled = YES;
+            TVLog(@"CLI: Continuous updates enabled (-u)");
+            break;
+        }
+        case 'l': {
+            gUpdatePacingEnabled = YES;
+            TVLog(@"CLI: Per-client update pacing enabled (-l)");
+            break;
+        }
+        case 'z': {
+            long kb = strtol(optarg, NULL, 10);
+            if (!(kb == 0 || (kb >= 16 && kb <= 16384))) {
+                TVPrintError("Invalid send high-water mark: %s (expected 16..16384 KiB, or 0 to disable)", optarg);
+                exit(EXIT_FAILURE);
+            }
+            gSendHighWaterKB = (int)kb;
+            TVLog(@"CLI: Updates held while a client has more than %d KiB unsent", gSendHighWaterKB);
+            break;
+        }
+        case 'j': {
+            gSocketTuningEnabled = YES;
+            TVLog(@"CLI: Per-client socket tuning enabled (-j)");
+            break;
+        }
+        case 'f': {
+            gPointerFocusEnabled = YES;
+            TVLog(@"CLI: Pointer focus ordering enabled (-f)");
+            break;
+        }
+        case 'y': {
+            long ms = strtol(optarg, NULL, 10);
+            if (!(ms == 0 || (ms >= 20 && ms <= 1000))) {
+                TVPrintError("Invalid slice target: %s (expected 20..1000 ms, or 0 to disable)", optarg);
+                exit(EXIT_FAILURE);
+            }
+            gSliceTargetMs = (int)ms;
+            TVLog(@"CLI: Updates sliced to about %d ms of each client's link", gSliceTargetMs);
+            break;
+        }
         case 'W': {
             double px = strtod(optarg, NULL);
             if (px == 0.0) {
@@ -1487,6 +1831,11 @@ static int gBytesPerPixel = 4; // ARGB/BGRA 32-bit
 static void *gFrontBuffer = NULL; // Exposed to VNC clients via gScreen->frameBuffer
 static void *gBackBuffer = NULL;  // We render into this and then swap
 
+static double gOutputDownshift = 1.0; // extra scale applied under congestion (-S), 1.0 = none
+
+// Output scale actually in effect: -s scale times the congestion downshift.
+NS_INLINE double effectiveOutputScale(void) { return gScale * gOutputDownshift; }
+
 // Hash algorithm selection (auto: prefer CRC32 on ARM with hardware support)
 #if DEBUG
 #if defined(__aarch64__) || defined(__ARM_FEATURE_CRC32)
@@ -1570,7 +1919,8 @@ static int gTilesY = 0;
 static size_t gTileCount = 0;
 static uint64_t *gPrevHash = NULL;
 static uint64_t *gCurrHash = NULL;
-static uint8_t *gPendingDirty = NULL; // per-tile pending dirty mask
+static uint8_t *gPendingDirty = NULL;    // per-tile pending dirty mask
+static uint8_t *gSuppressedDirty = NULL; // per-tile mask of changes ignored by the -L tolerance
 static BOOL gHasPending = NO;
 
 static void initializeTilingOrReset(void) {
@@ -1620,6 +1970,14 @@ NS_INLINE void swapTileHashes(void) {
     gCurrHash = tmp;
 }
 
+// Whether a tile takes part in the flush being built: pending from the defer window or changed since the
+// last flush, and not held back by the -L tolerance. Valid between the flush hash and clearing pending.
+NS_INLINE BOOL tileChangedAtFlush(size_t i) {
+    if (gChangeTolerance > 0 && gSuppressedDirty && gSuppressedDirty[i])
+        return NO;
+    return (gPendingDirty && gPendingDirty[i]) || gCurrHash[i] != gPrevHash[i];
+}
+
 NS_INLINE void resetCurrTileHashes(void) {
     if (!gCurrHash || gTileCount == 0)
         return;
@@ -1756,181 +2114,4137 @@ NS_INLINE void hashTiledFromBufferParallel(const uint8_t *buf, int width, int he
             }
         });
     }
-    dispatch_group_wait(grp, DISPATCH_TIME_FOREVER);
+    dispatch_group_wait(grp, DISPATCH_TIME_FOREVER);
+}
+
+// Build dirty rectangles from tile hash diffs. Returns number of rects written, up to maxRects.
+static int buildDirtyRects(DirtyRect *rects, int maxRects, int *outChangedTiles) {
+    int rectCount = 0;
+    int changedTiles = 0;
+
+    // First pass: horizontal merge per tile row
+    for (int ty = 0; ty < gTilesY; ++ty) {
+        int tx = 0;
+        while (tx < gTilesX) {
+            size_t idx = (size_t)ty * (size_t)gTilesX + (size_t)tx;
+            int changed = (gCurrHash[idx] != gPrevHash[idx]) && !(gSuppressedDirty && gSuppressedDirty[idx]);
+            if (!changed) {
+                tx++;
+                continue;
+            }
+
+            // Start of a run
+            int runStart = tx;
+            changedTiles++;
+            tx++;
+            while (tx < gTilesX) {
+                size_t idx2 = (size_t)ty * (size_t)gTilesX + (size_t)tx;
+                if (gCurrHash[idx2] != gPrevHash[idx2] && !(gSuppressedDirty && gSuppressedDirty[idx2])) {
+                    changedTiles++;
+                    tx++;
+                } else
+                    break;
+            }
+
+            // Emit rect for this horizontal run
+            if (rectCount < maxRects) {
+                int x = runStart * gTileSize;
+                int w = (tx - runStart) * gTileSize;
+                int y = ty * gTileSize;
+                int h = gTileSize;
+                // Clip to screen bounds
+                if (x + w > gWidth)
+                    w = gWidth - x;
+                if (y + h > gHeight)
+                    h = gHeight - y;
+                rects[rectCount++] = (DirtyRect){x, y, w, h};
+            } else {
+                // Too many rects; caller may fallback to fullscreen
+                if (outChangedTiles)
+                    *outChangedTiles = changedTiles;
+                return rectCount;
+            }
+        }
+    }
+
+    // Optional vertical merge: merge rects with same x,w and contiguous vertically
+    // Simple O(n^2) merge for small rect counts
+    for (int i = 0; i < rectCount; ++i) {
+        for (int j = i + 1; j < rectCount; ++j) {
+            if (rects[j].w == 0 || rects[j].h == 0)
+                continue;
+            if (rects[i].x == rects[j].x && rects[i].w == rects[j].w) {
+                if (rects[i].y + rects[i].h == rects[j].y) {
+                    rects[i].h += rects[j].h;
+                    rects[j].w = rects[j].h = 0; // mark removed
+                } else if (rects[j].y + rects[j].h == rects[i].y) {
+                    rects[j].h += rects[i].h;
+                    rects[i].w = rects[i].h = 0;
+                }
+            }
+        }
+    }
+
+    // Compact removed entries
+    int k = 0;
+    for (int i = 0; i < rectCount; ++i) {
+        if (rects[i].w > 0 && rects[i].h > 0)
+            rects[k++] = rects[i];
+    }
+
+    rectCount = k;
+    if (outChangedTiles)
+        *outChangedTiles = changedTiles;
+    return rectCount;
+}
+
+// Build rects from pending mask by temporarily mapping to hashes
+static int buildRectsFromPending(DirtyRect *rects, int maxRects) {
+    if (!gPendingDirty)
+        return 0;
+
+    // Temporarily mark curr!=prev for pending tiles
+    // Save originals
+    // For efficiency, we only synthesize gCurrHash markers without touching buffers
+    size_t changed = 0;
+    for (size_t i = 0; i < gTileCount; ++i) {
+        if (gPendingDirty[i]) {
+            if (gCurrHash[i] == gPrevHash[i])
+                gCurrHash[i] ^= 0x1ULL;
+            changed++;
+        }
+    }
+
+    int dummyTiles = 0;
+    int cnt = buildDirtyRects(rects, maxRects, &dummyTiles);
+
+    // Restore hashes for tiles we toggled
+    for (size_t i = 0; i < gTileCount; ++i) {
+        if (gPendingDirty[i]) {
+            if (gCurrHash[i] == gPrevHash[i])
+                gCurrHash[i] ^= 0x1ULL; // unlikely path
+            else if ((gCurrHash[i] ^ 0x1ULL) == gPrevHash[i])
+                gCurrHash[i] ^= 0x1ULL;
+        }
+    }
+
+    (void)changed;
+    return cnt;
+}
+
+NS_INLINE void markRectsModified(DirtyRect *rects, int rectCount) {
+    for (int i = 0; i < rectCount; ++i) {
+        rfbMarkRectAsModified(gScreen, rects[i].x, rects[i].y, rects[i].x + rects[i].w, rects[i].y + rects[i].h);
+    }
+}
+
+NS_INLINE void copyRectsFromBackToFront(DirtyRect *rects, int rectCount) {
+    size_t fbBPR = (size_t)gWidth * (size_t)gBytesPerPixel;
+    for (int i = 0; i < rectCount; ++i) {
+        int x = rects[i].x, y = rects[i].y, w = rects[i].w, h = rects[i].h;
+        size_t rowBytes = (size_t)w * (size_t)gBytesPerPixel;
+        for (int r = 0; r < h; ++r) {
+            uint8_t *dst = (uint8_t *)gFrontBuffer + (size_t)(y + r) * fbBPR + (size_t)x * gBytesPerPixel;
+            uint8_t *src = (uint8_t *)gBackBuffer + (size_t)(y + r) * fbBPR + (size_t)x * gBytesPerPixel;
+            memcpy(dst, src, rowBytes);
+        }
+    }
+}
+
+#pragma mark - Display Tiling Constants
+
+// Hashing performance controls
+static const int cHashStrideX = 4;              // sparse sampling stride X (>=1; 1 = full scan)
+static const int cHashStrideY = 4;              // sparse sampling stride Y (>=1; 1 = full scan)
+static const BOOL cSparseHashDuringDefer = YES; // use sparse hashing while within defer window
+// Skip vImage scaling when src/dst size difference is small; copy with pad/crop instead
+static const int cNoScalePadThresholdPx = 8; // if both |dW| and |dH| <= this, do pad/crop copy
+
+// Flush-time hashing optimization
+static const BOOL cParallelHashOnFlush = YES; // use parallel hashing at flush to reduce wall time
+
+// Whole-frame fingerprint on the capture source, checked before any rotate/scale/copy work
+static const BOOL cFrameFingerprintEnabled = YES; // drop frames identical to the last processed one
+static const int cFingerprintPhases = 8;          // rows are split into N interleaved phases (y % N)
+static const double cFingerprintVerifySec = 0.25; // after a partial-match skip, verify all rows within this delay
+
+// Sub-tile refinement of dirty rects against the published (front) buffer
+static const int cRefineMaxRects = 64;       // refine only when a flush has at most this many rects (0 = off)
+static const double cRefineMergeSlack = 1.5; // merge per-tile-row boxes if the union costs at most this much area
+
+// Perceptual change tolerance (-L)
+static const int cToleranceBlockPx = 4;       // tiles are compared as averages of NxN pixel blocks
+static const double cToleranceSweepSec = 2.0; // tiles held back by the tolerance are re-sent at least this often
+
+// Video region detection (-G)
+static const double cVideoRateTauSec = 0.5;   // time constant of the per-tile change rate average
+static const double cVideoHotRate = 8.0;      // tiles changing this often per second become video candidates
+static const double cVideoCoolRate = 3.0;     // video tiles return to UI once their rate drops below this
+static const double cVideoHotHoldSec = 1.0;   // candidates must stay above cVideoHotRate this long
+static const int cVideoRegionMinTiles = 6;    // smaller groups of hot tiles are left to the UI path
+static const int cVideoRegionMaxRects = 8;    // keep at most this many regions (largest first)
+static const double cVideoIdleTickSec = 0.25; // keep decaying rates at this interval when no frames arrive
+
+// Tile content classes (-g)
+static const int cTileClassMaxPalette = 16; // tiles with at most this many colors are palette tiles
+static const int cTileClassEdgeDelta = 48;  // luma step between neighbours that counts as a sharp edge
+static const int cTileClassFlatPct = 60;    // text-like tiles have at least this % of equal neighbours
+
+// Lossless refinement (-r)
+static const double cRefineTickSec = 0.25;          // idle tiles are looked for at this interval
+static const double cRefineRateBytes = 256 * 1024;  // refinement budget per client in bytes/s
+static const double cRefineBurstSec = 1.0;          // unused budget is kept for at most this long
+static const double cRefineBytesPerPixel = 1.0;     // expected lossless size, used to size a batch
+static const double cRefineMaxDrainSec = 0.05;      // skip clients whose backlog drains slower (-q/-S)
+
+// Per-client output size (-m): level n serves the framebuffer at 1/2^n
+static const int cClientScaleLevels = 3; // 1, 1/2, 1/4
+
+// Shared encoding (-b)
+static const int cSharedCellShift = 7;                // updates are split into cells of 1 << N pixels
+static const int cSharedBudgetDivisor = 16;           // encoded rects may use 1/N of the process memory limit
+static const size_t cSharedBudgetMinBytes = 8 << 20;  // ... but at least this
+static const size_t cSharedBudgetMaxBytes = 64 << 20; // ... and at most this
+static const double cSharedStatsLogSec = 30.0;        // log cache counters at most this often (verbose)
+static const int cSharedKeyframeConfigs = 2;          // full-frame keyframes kept for this many parameter sets
+
+// Open H.264 (-x)
+static const double cH264KeyframeSec = 10.0;  // longest interval between keyframes
+static const int cH264StartBitRate = 4000000; // bit rate of a new encoder in bits/s
+static const int cH264MinBitRate = 500000;    // bit rate floor
+static const int cH264MaxBitRate = 20000000;  // bit rate ceiling
+static const double cH264RateAdjustSec = 1.0; // bit rate decisions at most this often
+static const double cH264DrainHighSec = 0.2;  // backlog drain time that lowers the bit rate
+static const double cH264DrainLowSec = 0.02;  // ... and below which it rises again
+static const double cH264RateStepDown = 0.7;  // factor per decision while congested
+static const double cH264RateStepUp = 1.15;   // factor per decision while the link keeps up
+static const double cH264RateHeadroom = 0.8;  // share of the measured delivery rate to aim for
+
+// Encoding policy (-o)
+static const double cPolicyIntervalSec = 1.0;       // re-classify a client's link at most this often
+static const double cPolicyLanRttSec = 0.015;       // baseline round trip below this = local network
+static const double cPolicyDrainLowSec = 0.02;      // ... with a backlog draining faster than this
+static const double cPolicyDrainHighSec = 0.20;     // backlog draining slower than this = slow link
+static const double cPolicySlowBytes = 1024 * 1024; // ... or a measured delivery rate (bytes/s) below this
+static const double cPolicyCpuBusy = 0.75;          // process CPU load (share of all cores) = no headroom
+static const int cPolicyFastCompress = 1;           // Tight zlib level cap on fast links or without headroom
+static const int cPolicySlowCompress = 6;           // Tight zlib level floor on slow links
+
+// Continuous updates (-u)
+static const int cFenceMaxInFlight = 32;                 // fences a client may owe us at once
+static const double cContinuousStartWindow = 256 * 1024; // bytes in flight allowed to a new client
+static const double cContinuousMinWindow = 64 * 1024;    // window floor
+static const double cContinuousMaxWindow = 16 << 20;     // window ceiling
+static const double cContinuousQueueDelaySec = 0.05;     // fence round trip above the baseline = congestion
+static const double cContinuousWindowDecrease = 0.75;    // window factor per round trip while congested
+
+// Update pacing (-l)
+static const double cPaceTickSec = 0.01;    // how often held updates are re-checked
+static const double cPaceRateGain = 1.1;    // bucket fill rate over the measured delivery rate
+static const double cPaceBurstSec = 0.05;   // bucket size in seconds of the fill rate (at least one round trip)
+static const double cPaceMaxDrainSec = 0.1; // hold updates while the socket backlog needs longer to drain
+
+// Socket tuning (-j)
+static const int cSockNotsentLowat = 32 * 1024; // unsent bytes before the socket stops being writable
+static const double cSockBufBdpFactor = 2.0;    // send buffer over the bandwidth-delay product
+static const int cSockBufMin = 64 * 1024;       // smallest send buffer
+static const int cSockBufMax = 4 * 1024 * 1024; // largest send buffer (also caps the product)
+static const double cSockBufMinRtt = 0.005;     // floor of the round trip used for the product
+static const double cSockBufChange = 0.25;      // relative change needed to resize the buffer
+static const double cSockTuneSec = 1.0;         // how often the buffer is re-sized at most
+
+// Pointer focus (-f)
+static const double cFocusRadiusFrac = 0.15;    // half side of the focus box, as a share of the longer screen side
+static const double cFocusRecentSec = 2.0;      // pointer events older than this place no focus
+static const double cFocusDrainSec = 0.03;      // shape updates while the backlog needs longer to drain,
+static const double cFocusQueueDelaySec = 0.05; // ... or the round trip is this much above its baseline
+
+// Sliced delivery (-y)
+static const int cSliceMinRows = 32;                // thinnest slice
+static const double cSliceStartBytesPerPixel = 1.0; // size estimate before the first measurement
+static const double cSliceRatioGain = 0.3;          // weight of a new bytes-per-pixel measurement
+
+// Send queue; the high-water mark is -z
+static const int cSendIovMax = 1024;               // segments per writev call (IOV_MAX)
+static const size_t cWsFrameMaxBytes = 256 * 1024; // payload of a WebSocket frame written by the send queue
+static const size_t cWsHeaderMaxBytes = 10;        // header of a server frame with a 64-bit length
+static const uint8_t cWsOpcodeBinary = 0x2;        // opcode of a binary frame
+static const size_t cTlsRecordBytes = 16384;       // largest TLS record payload
+
+// Output downshift (-S); the steps are factors applied on top of -s
+static const double cDownshiftSteps[] = {1.0, 0.75, 0.5, 0.375, 0.25};
+static const double cDownshiftWindowSec = 1.0;      // congestion is judged per window of this length
+static const double cDownshiftDropRatio = 0.3;      // window over budget if more frames than this were dropped
+static const double cDownshiftDrainHighSec = 0.30;  // ... or a client's backlog needs longer than this to drain
+static const double cDownshiftQueueHighSec = 0.40;  // ... or a client's round trip is this far above its baseline
+static const double cDownshiftDrainLowSec = 0.05;   // calm window: backlog drains faster than this
+static const double cDownshiftQueueLowSec = 0.10;   // calm window: round trip this close to its baseline
+static const double cDownshiftDownHoldSec = 2.0;    // step down after being over budget this long
+static const double cDownshiftUpHoldSec = 8.0;      // step up after being calm this long
+static const double cDownshiftUpHoldMaxSec = 120.0; // cap for the calm period after failed step-ups
+
+// Adaptive quality (-q)
+static const double cAqIntervalSec = 0.25;       // re-evaluate a client's quality at most this often
+static const double cAqDrainHighSec = 0.20;      // socket backlog needing longer than this to drain = congested
+static const double cAqDrainLowSec = 0.05;       // backlog draining faster than this = headroom
+static const double cAqQueueDelayHighSec = 0.25; // request round trip this far above its baseline = congested
+static const double cAqQueueDelayLowSec = 0.08;  // round trip this close to its baseline = headroom
+static const double cAqDecreaseFactor = 0.75;    // multiplicative quality decrease on congestion
+static const int cAqIncreaseStep = 5;            // additive quality increase with headroom
+static const double cAqIncreaseHoldSec = 1.0;    // no increase for this long after a decrease
+static const int cAqCompressStep = 15;           // zlib level +1 per this many quality points below the ceiling
+
+#pragma mark - Frame Fingerprint
+
+// The fingerprint is one running hash per row phase. An incoming frame hashes only one phase (rotating
+// per frame) and is dropped when that phase matches the last processed frame. Since a change confined
+// to unsampled rows would then go unnoticed until a later frame samples them, a partial match schedules
+// a forced frame that compares every phase before the screen is considered idle.
+//
+// Frames that go through keep only their sampled phase, so a changing screen costs one phase per frame.
+// The sample then stays on the phases known for the last processed frame. Only the forced frame hashes
+// every phase; when some of them were not known, it goes through as well and completes the fingerprint.
+
+typedef struct {
+    size_t width, height, bytesPerRow;
+    int rotQ, outWidth, outHeight;
+    double scale;
+} FrameFingerprintKey;
+
+static std::atomic<bool> gFrameFingerprintStale(true);     // set to force the next frame through the full pipeline
+static FrameFingerprintKey gFingerprintKey;                // geometry of the last processed frame
+static uint64_t gFingerprint[cFingerprintPhases];          // per-phase hashes of the last processed frame
+static uint32_t gFingerprintPhases = 0;                    // phases of gFingerprint that were hashed
+static uint64_t gFingerprintCandidate[cFingerprintPhases]; // per-phase hashes of the frame in flight
+static uint32_t gFingerprintCandidatePhases = 0;           // phases of gFingerprintCandidate that were hashed
+static FrameFingerprintKey gFingerprintCandidateKey;       // geometry of the frame in flight
+static BOOL gFingerprintValid = NO;                        // gFingerprint describes a processed frame
+static BOOL gFingerprintNeedsVerify = NO;                  // last skip matched a single phase only
+static BOOL gFingerprintVerifyScheduled = NO;              // a forced verification frame is pending
+static BOOL gFingerprintVerifyNext = NO;                   // next frame must compare all phases
+
+NS_INLINE BOOL fingerprintKeyEqual(const FrameFingerprintKey *a, const FrameFingerprintKey *b) {
+    return a->width == b->width && a->height == b->height && a->bytesPerRow == b->bytesPerRow && a->rotQ == b->rotQ &&
+           a->outWidth == b->outWidth && a->outHeight == b->outHeight && a->scale == b->scale;
+}
+
+// Hash the rows of a single phase (y % cFingerprintPhases == phase).
+NS_INLINE uint64_t fingerprintSourcePhase(const uint8_t *base, size_t width, size_t height, size_t bpr, int phase) {
+    uint64_t h = hash_basis();
+    size_t rowBytes = width * (size_t)gBytesPerPixel;
+    for (size_t y = (size_t)phase; y < height; y += (size_t)cFingerprintPhases) {
+        h = hash_update(h, base + y * bpr, rowBytes);
+    }
+    return h;
+}
+
+// Hash every row, accumulating each one into the hash of its phase.
+NS_INLINE void fingerprintSourceAllPhases(const uint8_t *base, size_t width, size_t height, size_t bpr,
+                                          uint64_t *out) {
+    size_t rowBytes = width * (size_t)gBytesPerPixel;
+    for (int p = 0; p < cFingerprintPhases; ++p)
+        out[p] = hash_basis();
+    for (size_t y = 0; y < height; ++y) {
+        size_t p = y % (size_t)cFingerprintPhases;
+        out[p] = hash_update(out[p], base + y * bpr, rowBytes);
+    }
+}
+
+// Called once the frame in flight has been published (swapped or flushed) to clients.
+NS_INLINE void commitFrameFingerprint(void) {
+    if (!cFrameFingerprintEnabled)
+        return;
+    memcpy(gFingerprint, gFingerprintCandidate, sizeof(gFingerprint));
+    gFingerprintPhases = gFingerprintCandidatePhases;
+    gFingerprintKey = gFingerprintCandidateKey;
+    gFingerprintValid = YES;
+    gFingerprintNeedsVerify = NO;
+}
+
+// Schedule a forced frame that compares all phases, unless one is already pending.
+static void scheduleFingerprintVerify(void) {
+    if (gFingerprintVerifyScheduled)
+        return;
+    gFingerprintVerifyScheduled = YES;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(cFingerprintVerifySec * NSEC_PER_SEC)),
+                   dispatch_get_main_queue(), ^{
+                       gFingerprintVerifyScheduled = NO;
+                       if (!gFingerprintNeedsVerify)
+                           return;
+                       gFingerprintVerifyNext = YES;
+                       [[ScreenCapturer sharedCapturer] forceNextFrameUpdate];
+                   });
+}
+
+// Returns YES when the locked source buffer matches the last processed frame and can be dropped.
+// Otherwise leaves the fingerprint of this frame in the candidate slot for commitFrameFingerprint(): every
+// phase for a forced verification frame, the sampled phase only for any other.
+static BOOL shouldDropIdenticalFrame(const uint8_t *base, size_t width, size_t height, size_t bpr, int rotQ) {
+    if (!cFrameFingerprintEnabled)
+        return NO;
+
+    FrameFingerprintKey key = {width, height, bpr, rotQ, gWidth, gHeight, effectiveOutputScale()};
+    BOOL stale = gFrameFingerprintStale.exchange(false, std::memory_order_relaxed);
+    BOOL comparable = gFingerprintValid && !stale && !gHasPending && fingerprintKeyEqual(&key, &gFingerprintKey);
+    gFingerprintCandidateKey = key;
+
+    const uint32_t allPhases = (1u << cFingerprintPhases) - 1;
+    if (gFingerprintVerifyNext) {
+        gFingerprintVerifyNext = NO;
+        fingerprintSourceAllPhases(base, width, height, bpr, gFingerprintCandidate);
+        gFingerprintCandidatePhases = allPhases;
+        if (comparable && gFingerprintPhases == allPhases &&
+            memcmp(gFingerprintCandidate, gFingerprint, sizeof(gFingerprint)) == 0) {
+            gFingerprintNeedsVerify = NO; // every row matched: the screen is idle
+            return YES;
+        }
+        return NO;
+    }
+
+    // Sample the next phase that is known for the last processed frame
+    static int sPhase = 0;
+    int phase = sPhase;
+    while (comparable && !(gFingerprintPhases & (1u << phase)))
+        phase = (phase + 1) % cFingerprintPhases;
+    sPhase = (phase + 1) % cFingerprintPhases;
+
+    uint64_t h = fingerprintSourcePhase(base, width, height, bpr, phase);
+    if (comparable && h == gFingerprint[phase]) {
+        gFingerprintNeedsVerify = YES;
+        scheduleFingerprintVerify();
+        return YES;
+    }
+    gFingerprintCandidate[phase] = h;
+    gFingerprintCandidatePhases = 1u << phase;
+    return NO;
+}
+
+#pragma mark - Dirty Rect Refinement
+
+// Tile hashes only tell which tiles changed. For small dirty sets, compare the new frame (back buffer)
+// against what clients currently have (front buffer) and shrink every rect to the exact changed pixels,
+// one box per tile row, merging neighbouring boxes back together when splitting would not save area.
+
+// Find the first/last differing pixel of a row span. Returns NO if the span is identical.
+NS_INLINE BOOL rowSpanDiffBounds(const uint8_t *a, const uint8_t *b, int w, int *outL, int *outR) {
+    size_t bytes = (size_t)w * (size_t)gBytesPerPixel;
+    if (memcmp(a, b, bytes) == 0)
+        return NO;
+    int l = 0;
+    while (l < w && memcmp(a + (size_t)l * gBytesPerPixel, b + (size_t)l * gBytesPerPixel, gBytesPerPixel) == 0)
+        l++;
+    int r = w - 1;
+    while (r > l && memcmp(a + (size_t)r * gBytesPerPixel, b + (size_t)r * gBytesPerPixel, gBytesPerPixel) == 0)
+        r--;
+    *outL = l;
+    *outR = r;
+    return YES;
+}
+
+NS_INLINE long long dirtyRectArea(DirtyRect r) { return (long long)r.w * (long long)r.h; }
+
+NS_INLINE DirtyRect dirtyRectUnion(DirtyRect a, DirtyRect b) {
+    int x0 = MIN(a.x, b.x), y0 = MIN(a.y, b.y);
+    int x1 = MAX(a.x + a.w, b.x + b.w), y1 = MAX(a.y + a.h, b.y + b.h);
+    return (DirtyRect){x0, y0, x1 - x0, y1 - y0};
+}
+
+// Refine rects in place. Returns the new rect count (0 if none of the rects holds a real change).
+// Falls back to the input rects unchanged if the refined set would not fit into capacity.
+static int refineDirtyRects(DirtyRect *rects, int rectCount, int capacity) {
+    enum { kRefineOutMax = 1024 };
+    static DirtyRect sOut[kRefineOutMax];
+    if (capacity > kRefineOutMax)
+        capacity = kRefineOutMax;
+
+    const size_t fbBPR = (size_t)gWidth * (size_t)gBytesPerPixel;
+    const uint8_t *front = (const uint8_t *)gFrontBuffer;
+    const uint8_t *back = (const uint8_t *)gBackBuffer;
+    int outCount = 0;
+
+    for (int i = 0; i < rectCount; ++i) {
+        DirtyRect rc = rects[i];
+        if (rc.w <= 0 || rc.h <= 0)
+            continue;
+
+        BOOL haveAcc = NO;
+        DirtyRect acc = {0, 0, 0, 0};
+        for (int by = rc.y; by < rc.y + rc.h; by += gTileSize) {
+            int bandEnd = MIN(by + gTileSize, rc.y + rc.h);
+            int minX = INT_MAX, maxX = -1, minY = -1, maxY = -1;
+            for (int y = by; y < bandEnd; ++y) {
+                size_t off = (size_t)y * fbBPR + (size_t)rc.x * (size_t)gBytesPerPixel;
+                int l, r;
+                if (!rowSpanDiffBounds(front + off, back + off, rc.w, &l, &r))
+                    continue;
+                if (minY < 0)
+                    minY = y;
+                maxY = y;
+                minX = MIN(minX, rc.x + l);
+                maxX = MAX(maxX, rc.x + r);
+            }
+            if (minY < 0)
+                continue; // band identical to what clients already have
+
+            DirtyRect band = {minX, minY, maxX - minX + 1, maxY - minY + 1};
+            if (!haveAcc) {
+                acc = band;
+                haveAcc = YES;
+                continue;
+            }
+
+            DirtyRect merged = dirtyRectUnion(acc, band);
+            double splitArea = (double)(dirtyRectArea(acc) + dirtyRectArea(band));
+            if ((double)dirtyRectArea(merged) <= splitArea * cRefineMergeSlack) {
+                acc = merged;
+            } else {
+                if (outCount >= capacity)
+                    return rectCount;
+                sOut[outCount++] = acc;
+                acc = band;
+            }
+        }
+
+        if (haveAcc) {
+            if (outCount >= capacity)
+                return rectCount;
+            sOut[outCount++] = acc;
+        }
+    }
+
+    memcpy(rects, sOut, (size_t)outCount * sizeof(DirtyRect));
+    return outCount;
+}
+
+#pragma mark - Change Tolerance
+
+// With -L, a changed tile is only sent when its block averages differ from the ones of the version
+// clients last received by more than the threshold. This filters dithering, overlay noise and slow
+// translucency animations. Held-back tiles are tracked as stale: the front buffer still receives their
+// latest pixels, and a periodic sweep re-sends them exactly, so clients converge once things settle.
+
+static uint8_t *gTolThumb = NULL;  // per-tile block averages (B, G, R) of what clients were last sent
+static uint8_t *gTolStale = NULL;  // per-tile: clients hold a version older than the front buffer
+static size_t gTolTileCount = 0;   // tile count the buffers above were allocated for
+static int gTolTileSize = 0;       // tile size the buffers above were allocated for
+static size_t gTolThumbStride = 0; // bytes per tile in gTolThumb
+static BOOL gTolThumbValid = NO;   // thumbnails describe the front buffer
+static BOOL gTolSweepScheduled = NO;
+
+NS_INLINE int toleranceBlocksPerTile(void) { return (gTileSize + cToleranceBlockPx - 1) / cToleranceBlockPx; }
+
+NS_INLINE DirtyRect tileRectForIndex(size_t tileIndex) {
+    int x = (int)(tileIndex % (size_t)gTilesX) * gTileSize;
+    int y = (int)(tileIndex / (size_t)gTilesX) * gTileSize;
+    return (DirtyRect){x, y, MIN(gTileSize, gWidth - x), MIN(gTileSize, gHeight - y)};
+}
+
+static void invalidateChangeTolerance(void) {
+    gTolThumbValid = NO;
+    if (gTolStale)
+        memset(gTolStale, 0, gTolTileCount);
+    if (gSuppressedDirty)
+        memset(gSuppressedDirty, 0, gTolTileCount);
+}
+
+static void ensureChangeToleranceState(void) {
+    if (gTolThumb && gTolTileCount == gTileCount && gTolTileSize == gTileSize)
+        return;
+
+    int blocks = toleranceBlocksPerTile();
+    size_t stride = (size_t)blocks * (size_t)blocks * 3;
+
+    free(gTolThumb);
+    free(gTolStale);
+    free(gSuppressedDirty);
+    gTolThumb = (uint8_t *)calloc(gTileCount, stride);
+    gTolStale = (uint8_t *)calloc(gTileCount, 1);
+    gSuppressedDirty = (uint8_t *)calloc(gTileCount, 1);
+    if (!gTolThumb || !gTolStale || !gSuppressedDirty) {
+        TVPrintError("Out of memory for change tolerance state");
+        exit(EXIT_FAILURE);
+    }
+
+    gTolTileCount = gTileCount;
+    gTolTileSize = gTileSize;
+    gTolThumbStride = stride;
+    gTolThumbValid = NO;
+}
+
+// Average each NxN block of a tile into 3 bytes (B, G, R).
+static void toleranceTileThumb(const uint8_t *buf, size_t tileIndex, uint8_t *out) {
+    const size_t fbBPR = (size_t)gWidth * (size_t)gBytesPerPixel;
+    const int blocks = toleranceBlocksPerTile();
+    DirtyRect tr = tileRectForIndex(tileIndex);
+
+    for (int by = 0; by < blocks; ++by) {
+        int py0 = tr.y + by * cToleranceBlockPx;
+        int py1 = MIN(py0 + cToleranceBlockPx, tr.y + tr.h);
+        for (int bx = 0; bx < blocks; ++bx) {
+            uint8_t *o = out + ((size_t)by * (size_t)blocks + (size_t)bx) * 3;
+            int px0 = tr.x + bx * cToleranceBlockPx;
+            int px1 = MIN(px0 + cToleranceBlockPx, tr.x + tr.w);
+            if (py0 >= py1 || px0 >= px1) {
+                o[0] = o[1] = o[2] = 0;
+                continue;
+            }
+
+            unsigned s0 = 0, s1 = 0, s2 = 0;
+            for (int y = py0; y < py1; ++y) {
+                const uint8_t *p = buf + (size_t)y * fbBPR + (size_t)px0 * (size_t)gBytesPerPixel;
+                for (int x = px0; x < px1; ++x, p += gBytesPerPixel) {
+                    s0 += p[0];
+                    s1 += p[1];
+                    s2 += p[2];
+                }
+            }
+
+            unsigned n = (unsigned)((py1 - py0) * (px1 - px0));
+            o[0] = (uint8_t)((s0 + n / 2) / n);
+            o[1] = (uint8_t)((s1 + n / 2) / n);
+            o[2] = (uint8_t)((s2 + n / 2) / n);
+        }
+    }
+}
+
+NS_INLINE BOOL toleranceThumbExceeds(const uint8_t *a, const uint8_t *b, size_t len, int threshold) {
+    for (size_t i = 0; i < len; ++i) {
+        int d = (int)a[i] - (int)b[i];
+        if (d > threshold || d < -threshold)
+            return YES;
+    }
+    return NO;
+}
+
+// At flush, hold back dirty tiles whose change stays within the tolerance. Must run after the full
+// hash and before rects are built. Returns the number of tiles held back.
+static int applyChangeTolerance(void) {
+    enum { kToleranceThumbMax = (128 / cToleranceBlockPx) * (128 / cToleranceBlockPx) * 3 };
+    uint8_t cand[kToleranceThumbMax];
+
+    ensureChangeToleranceState();
+    memset(gSuppressedDirty, 0, gTileCount);
+    if (!gTolThumbValid)
+        return 0; // no reference yet: send everything, thumbnails are rebuilt after publish
+
+    int suppressed = 0;
+    const uint8_t *back = (const uint8_t *)gBackBuffer;
+    for (size_t i = 0; i < gTileCount; ++i) {
+        BOOL dirty = (gPendingDirty && gPendingDirty[i]) || gCurrHash[i] != gPrevHash[i];
+        if (!dirty)
+            continue;
+
+        uint8_t *ref = gTolThumb + i * gTolThumbStride;
+        toleranceTileThumb(back, i, cand);
+        if (toleranceThumbExceeds(cand, ref, gTolThumbStride, gChangeTolerance)) {
+            memcpy(ref, cand, gTolThumbStride); // this version is about to be sent
+            continue;
+        }
+
+        gSuppressedDirty[i] = 1;
+        gTolStale[i] = 1;
+        if (gPendingDirty)
+            gPendingDirty[i] = 0;
+        suppressed++;
+    }
+    return suppressed;
+}
+
+// Stale tiles that changed enough to be sent again go out whole: refined rects only cover pixels that
+// differ from the front buffer, which already holds the held-back version.
+static int appendStaleToleranceTiles(DirtyRect *rects, int rectCount, int capacity) {
+    for (size_t i = 0; i < gTileCount && rectCount < capacity; ++i) {
+        if (!gTolStale[i] || gSuppressedDirty[i])
+            continue;
+        if (!((gPendingDirty && gPendingDirty[i]) || gCurrHash[i] != gPrevHash[i]))
+            continue;
+        rects[rectCount++] = tileRectForIndex(i);
+        gTolStale[i] = 0;
+    }
+    return rectCount;
+}
+
+// Keep the front buffer current for held-back tiles when it is not swapped. Without -a, callers hold every
+// client's sendMutex.
+static void copySuppressedTilesToFront(void) {
+    size_t fbBPR = (size_t)gWidth * (size_t)gBytesPerPixel;
+    for (size_t i = 0; i < gTileCount; ++i) {
+        if (!gSuppressedDirty[i])
+            continue;
+        DirtyRect tr = tileRectForIndex(i);
+        size_t rowBytes = (size_t)tr.w * (size_t)gBytesPerPixel;
+        for (int r = 0; r < tr.h; ++r) {
+            size_t off = (size_t)(tr.y + r) * fbBPR + (size_t)tr.x * (size_t)gBytesPerPixel;
+            memcpy((uint8_t *)gFrontBuffer + off, (const uint8_t *)gBackBuffer + off, rowBytes);
+        }
+    }
+}
+
+static void sweepStaleToleranceTiles(void) {
+    gTolSweepScheduled = NO;
+    if (!gScreen || !gTolStale || !gTolThumbValid || gTolTileCount != gTileCount)
+        return;
+
+    int resent = 0;
+    for (int ty = 0; ty < gTilesY; ++ty) {
+        int tx = 0;
+        while (tx < gTilesX) {
+            size_t idx = (size_t)ty * (size_t)gTilesX + (size_t)tx;
+            if (!gTolStale[idx]) {
+                tx++;
+                continue;
+            }
+            int runStart = tx;
+            while (tx < gTilesX && gTolStale[(size_t)ty * (size_t)gTilesX + (size_t)tx]) {
+                size_t i = (size_t)ty * (size_t)gTilesX + (size_t)tx;
+                toleranceTileThumb((const uint8_t *)gFrontBuffer, i, gTolThumb + i * gTolThumbStride);
+                gTolStale[i] = 0;
+                resent++;
+                tx++;
+            }
+            int x0 = runStart * gTileSize, y0 = ty * gTileSize;
+            rfbMarkRectAsModified(gScreen, x0, y0, MIN(tx * gTileSize, gWidth), MIN(y0 + gTileSize, gHeight));
+        }
+    }
+
+    if (resent > 0)
+        TVLogVerbose(@"tolerance sweep: re-sent %d held-back tiles", resent);
+}
+
+static void scheduleToleranceSweep(void) {
+    if (gTolSweepScheduled)
+        return;
+    gTolSweepScheduled = YES;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(cToleranceSweepSec * NSEC_PER_SEC)),
+                   dispatch_get_main_queue(), ^{
+                       sweepStaleToleranceTiles();
+                   });
+}
+
+// After a flush has been published. announcedAll: the whole screen was marked modified.
+static void finishChangeTolerance(BOOL announcedAll) {
+    if (!gTolThumbValid || announcedAll) {
+        for (size_t i = 0; i < gTileCount; ++i) {
+            if (gTolThumbValid && !gTolStale[i] && !gSuppressedDirty[i])
+                continue;
+            toleranceTileThumb((const uint8_t *)gFrontBuffer, i, gTolThumb + i * gTolThumbStride);
+        }
+        memset(gTolStale, 0, gTileCount);
+        gTolThumbValid = YES;
+    }
+    memset(gSuppressedDirty, 0, gTileCount);
+
+    for (size_t i = 0; i < gTileCount; ++i) {
+        if (gTolStale[i]) {
+            scheduleToleranceSweep();
+            break;
+        }
+    }
+}
+
+#pragma mark - Video Regions
+
+// With -G, tiles that keep changing several times per second for a while (video playback, games, camera
+// previews) are grouped into rectangular regions. Updates that contain both such regions and ordinary UI
+// are split so the two parts take turns, and the video part is encoded at the -G JPEG quality while the
+// rest keeps the quality the viewer asked for. Areas that leave the regions are re-sent once so lossy
+// leftovers get replaced.
+
+static float *gVideoRate = NULL;            // per-tile change events per second (exponential average)
+static double *gVideoHotSince = NULL;       // per-tile time the rate first reached cVideoHotRate (0 = below)
+static uint8_t *gVideoHot = NULL;           // per-tile: part of a video region
+static int gVideoTilesX = 0;                // tile grid the buffers above were allocated for
+static int gVideoTilesY = 0;                // tile grid the buffers above were allocated for
+static CFAbsoluteTime gVideoLastSample = 0; // time the rates were last advanced
+static BOOL gVideoTickScheduled = NO;
+
+// Published regions, read by the client output threads in displayHook
+static pthread_mutex_t gVideoRegionLock = PTHREAD_MUTEX_INITIALIZER;
+static sraRegion *gVideoRegion = NULL; // framebuffer coordinates; NULL = none
+
+// Replace the published regions (takes ownership). With resendReleased, whatever left the regions is
+// marked modified so clients get it again at their own quality.
+static void publishVideoRegion(sraRegion *region, BOOL resendReleased) {
+    pthread_mutex_lock(&gVideoRegionLock);
+    sraRegion *old = gVideoRegion;
+    gVideoRegion = region;
+    pthread_mutex_unlock(&gVideoRegionLock);
+
+    if (!old)
+        return;
+    if (resendReleased && gScreen) {
+        if (region)
+            sraRgnSubtract(old, region);
+        if (!sraRgnEmpty(old))
+            rfbMarkRegionAsModified(gScreen, old);
+    }
+    sraRgnDestroy(old);
+}
+
+// Snapshot of the published regions for an output thread (caller destroys), or NULL when there are none.
+static sraRegion *copyVideoRegion(void) {
+    sraRegion *copy = NULL;
+    pthread_mutex_lock(&gVideoRegionLock);
+    if (gVideoRegion)
+        copy = sraRgnCreateRgn(gVideoRegion);
+    pthread_mutex_unlock(&gVideoRegionLock);
+    return copy;
+}
+
+// Forget all change history, e.g. after rotation or resize when tile coordinates no longer match.
+static void resetVideoRegions(void) {
+    size_t count = (size_t)gVideoTilesX * (size_t)gVideoTilesY;
+    if (gVideoRate) {
+        memset(gVideoRate, 0, count * sizeof(float));
+        memset(gVideoHotSince, 0, count * sizeof(double));
+        memset(gVideoHot, 0, count);
+    }
+    gVideoLastSample = 0;
+    publishVideoRegion(NULL, NO);
+}
+
+static void ensureVideoRegionState(void) {
+    if (gVideoRate && gVideoTilesX == gTilesX && gVideoTilesY == gTilesY)
+        return;
+
+    free(gVideoRate);
+    free(gVideoHotSince);
+    free(gVideoHot);
+    gVideoRate = (float *)calloc(gTileCount, sizeof(float));
+    gVideoHotSince = (double *)calloc(gTileCount, sizeof(double));
+    gVideoHot = (uint8_t *)calloc(gTileCount, 1);
+    if (!gVideoRate || !gVideoHotSince || !gVideoHot) {
+        TVPrintError("Out of memory for video region state");
+        exit(EXIT_FAILURE);
+    }
+
+    gVideoTilesX = gTilesX;
+    gVideoTilesY = gTilesY;
+    gVideoLastSample = 0;
+    publishVideoRegion(NULL, NO);
+}
+
+// Group hot tiles into connected components and return the bounding boxes of the largest ones.
+static sraRegion *buildVideoRegion(void) {
+    typedef struct {
+        int x0, y0, x1, y1, tiles;
+    } TileComponent;
+
+    TileComponent best[cVideoRegionMaxRects];
+    int bestCount = 0;
+
+    static std::vector<uint8_t> seen;
+    static std::vector<int> stack;
+    seen.assign(gTileCount, 0);
+
+    for (size_t start = 0; start < gTileCount; ++start) {
+        if (!gVideoHot[start] || seen[start])
+            continue;
+
+        TileComponent c = {gTilesX, gTilesY, -1, -1, 0};
+        stack.clear();
+        stack.push_back((int)start);
+        seen[start] = 1;
+        while (!stack.empty()) {
+            int i = stack.back();
+            stack.pop_back();
+            int tx = i % gTilesX, ty = i / gTilesX;
+            c.x0 = MIN(c.x0, tx);
+            c.y0 = MIN(c.y0, ty);
+            c.x1 = MAX(c.x1, tx);
+            c.y1 = MAX(c.y1, ty);
+            c.tiles++;
+
+            const int nx[4] = {tx - 1, tx + 1, tx, tx};
+            const int ny[4] = {ty, ty, ty - 1, ty + 1};
+            for (int k = 0; k < 4; ++k) {
+                if (nx[k] < 0 || ny[k] < 0 || nx[k] >= gTilesX || ny[k] >= gTilesY)
+                    continue;
+                int j = ny[k] * gTilesX + nx[k];
+                if (gVideoHot[j] && !seen[j]) {
+                    seen[j] = 1;
+                    stack.push_back(j);
+                }
+            }
+        }
+
+        if (c.tiles < cVideoRegionMinTiles)
+            continue;
+        if (bestCount < cVideoRegionMaxRects) {
+            best[bestCount++] = c;
+        } else {
+            int smallest = 0;
+            for (int k = 1; k < bestCount; ++k) {
+                if (best[k].tiles < best[smallest].tiles)
+                    smallest = k;
+            }
+            if (c.tiles > best[smallest].tiles)
+                best[smallest] = c;
+        }
+    }
+
+    if (bestCount == 0)
+        return NULL;
+
+    sraRegion *region = sraRgnCreate();
+    for (int k = 0; k < bestCount; ++k) {
+        sraRegion *r = sraRgnCreateRect(best[k].x0 * gTileSize, best[k].y0 * gTileSize,
+                                        MIN((best[k].x1 + 1) * gTileSize, gWidth),
+                                        MIN((best[k].y1 + 1) * gTileSize, gHeight));
+        sraRgnOr(region, r);
+        sraRgnDestroy(r);
+    }
+    return region;
+}
+
+// Advance per-tile change rates to now. At flush (after the full hash and the -L tolerance, before
+// pending tiles are cleared) every tile changed by this frame counts as one event; idle ticks only decay.
+// Returns YES while some tiles are hot or about to become hot.
+static BOOL updateVideoRegions(BOOL atFlush) {
+    ensureVideoRegionState();
+
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    double dt = gVideoLastSample > 0 ? now - gVideoLastSample : 0.0;
+    gVideoLastSample = now;
+
+    const float decay = (float)exp(-dt / cVideoRateTauSec);
+    const float event = (float)(1.0 / cVideoRateTauSec);
+
+    BOOL hotChanged = NO;
+    BOOL active = NO;
+    for (size_t i = 0; i < gTileCount; ++i) {
+        BOOL changed = atFlush && tileChangedAtFlush(i);
+        float rate = gVideoRate[i] * decay + (changed ? event : 0.0f);
+        gVideoRate[i] = rate;
+
+        if (!gVideoHot[i]) {
+            if (rate < cVideoHotRate) {
+                gVideoHotSince[i] = 0;
+            } else if (gVideoHotSince[i] == 0) {
+                gVideoHotSince[i] = now;
+            } else if (now - gVideoHotSince[i] >= cVideoHotHoldSec) {
+                gVideoHot[i] = 1;
+                hotChanged = YES;
+            }
+        } else if (rate < cVideoCoolRate) {
+            gVideoHot[i] = 0;
+            gVideoHotSince[i] = 0;
+            hotChanged = YES;
+        }
+
+        if (gVideoHot[i] || gVideoHotSince[i] > 0)
+            active = YES;
+    }
+
+    if (hotChanged) {
+        sraRegion *region = buildVideoRegion();
+        TVLogVerbose(@"video regions: %lu rect(s)", region ? sraRgnCountRects(region) : 0UL);
+        publishVideoRegion(region, YES);
+    }
+
+    return active;
+}
+
+// Without new frames nothing else would let hot tiles cool down.
+static void scheduleVideoRegionTick(void) {
+    if (gVideoTickScheduled)
+        return;
+    gVideoTickScheduled = YES;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(cVideoIdleTickSec * NSEC_PER_SEC)),
+                   dispatch_get_main_queue(), ^{
+                       gVideoTickScheduled = NO;
+                       if (gVideoRegionQuality <= 0 || !gScreen || gVideoTilesX != gTilesX ||
+                           gVideoTilesY != gTilesY)
+                           return;
+                       if (updateVideoRegions(NO))
+                           scheduleVideoRegionTick();
+                   });
+}
+
+#pragma mark - Tile Classes
+
+// With -g, every tile that goes out in a flush is classified by its content: a single color, a small
+// palette, text-like (many colors from anti-aliasing, but mostly flat runs with sharp edges) or
+// photographic. Tiles classified as solid, palette or text form the lossless region, which the display
+// hooks use to keep JPEG away from updates that consist of such content only.
+
+typedef enum {
+    TileClassUnknown, // not classified since the last reset
+    TileClassSolid,
+    TileClassPalette,
+    TileClassText,
+    TileClassPhoto,
+} TileClass;
+
+static uint8_t *gTileClass = NULL; // per-tile TileClass of the latest published content
+static int gTileClassTilesX = 0;   // tile grid gTileClass was allocated for
+static int gTileClassTilesY = 0;   // tile grid gTileClass was allocated for
+
+// Published lossless region, read by the client output threads in displayHook
+static pthread_mutex_t gTileClassLock = PTHREAD_MUTEX_INITIALIZER;
+static sraRegion *gLosslessRegion = NULL; // framebuffer coordinates; NULL = none
+
+static void publishLosslessRegion(sraRegion *region) {
+    pthread_mutex_lock(&gTileClassLock);
+    sraRegion *old = gLosslessRegion;
+    gLosslessRegion = region;
+    pthread_mutex_unlock(&gTileClassLock);
+    if (old)
+        sraRgnDestroy(old);
+}
+
+static sraRegion *copyLosslessRegion(void) {
+    sraRegion *copy = NULL;
+    pthread_mutex_lock(&gTileClassLock);
+    if (gLosslessRegion)
+        copy = sraRgnCreateRgn(gLosslessRegion);
+    pthread_mutex_unlock(&gTileClassLock);
+    return copy;
+}
+
+static void resetTileClasses(void) {
+    if (gTileClass)
+        memset(gTileClass, TileClassUnknown, (size_t)gTileClassTilesX * (size_t)gTileClassTilesY);
+    publishLosslessRegion(NULL);
+}
+
+static void ensureTileClassState(void) {
+    if (gTileClass && gTileClassTilesX == gTilesX && gTileClassTilesY == gTilesY)
+        return;
+
+    free(gTileClass);
+    gTileClass = (uint8_t *)calloc(gTileCount, 1);
+    if (!gTileClass) {
+        TVPrintError("Out of memory for tile classes");
+        exit(EXIT_FAILURE);
+    }
+
+    gTileClassTilesX = gTilesX;
+    gTileClassTilesY = gTilesY;
+    publishLosslessRegion(NULL);
+}
+
+NS_INLINE int tileClassLuma(uint32_t px) {
+    // BGRA in memory: B in the low byte
+    return (int)((((px >> 16) & 0xFF) * 2 + ((px >> 8) & 0xFF) * 5 + (px & 0xFF)) >> 3);
+}
+
+// Classify one tile from every other row; equal neighbours skip the palette lookup, so flat content is cheap.
+static TileClass classifyTile(const uint8_t *buf, size_t tileIndex) {
+    const size_t fbBPR = (size_t)gWidth * (size_t)gBytesPerPixel;
+    DirtyRect tr = tileRectForIndex(tileIndex);
+
+    uint32_t palette[cTileClassMaxPalette];
+    int colors = 0;
+    BOOL manyColors = NO;
+    int pairs = 0, flat = 0, edges = 0;
+
+    for (int y = tr.y; y < tr.y + tr.h; y += 2) {
+        const uint32_t *row = (const uint32_t *)(buf + (size_t)y * fbBPR) + tr.x;
+        uint32_t prev = 0;
+        for (int x = 0; x < tr.w; ++x) {
+            uint32_t px = row[x] & 0x00FFFFFFu;
+            if (x > 0) {
+                pairs++;
+                if (px == prev) {
+                    flat++;
+                    continue;
+                }
+                int d = tileClassLuma(px) - tileClassLuma(prev);
+                if (d >= cTileClassEdgeDelta || d <= -cTileClassEdgeDelta)
+                    edges++;
+            }
+            prev = px;
+
+            if (manyColors)
+                continue;
+            int k = 0;
+            while (k < colors && palette[k] != px)
+                k++;
+            if (k == colors) {
+                if (colors < cTileClassMaxPalette)
+                    palette[colors++] = px;
+                else
+                    manyColors = YES;
+            }
+        }
+    }
+
+    if (!manyColors)
+        return colors <= 1 ? TileClassSolid : TileClassPalette;
+    if (edges > 0 && flat * 100 >= pairs * cTileClassFlatPct)
+        return TileClassText;
+    return TileClassPhoto;
+}
+
+// At flush (same window as updateVideoRegions): classify the tiles going out from the back buffer and
+// republish the lossless region when any class changed.
+static void updateTileClasses(void) {
+    ensureTileClassState();
+
+    const uint8_t *back = (const uint8_t *)gBackBuffer;
+    BOOL classChanged = NO;
+    for (size_t i = 0; i < gTileCount; ++i) {
+        if (!tileChangedAtFlush(i))
+            continue;
+        uint8_t cls = (uint8_t)classifyTile(back, i);
+        if (cls != gTileClass[i]) {
+            gTileClass[i] = cls;
+            classChanged = YES;
+        }
+    }
+    if (!classChanged)
+        return;
+
+    // One rect per horizontal run of lossless tiles
+    sraRegion *region = NULL;
+    int counts[TileClassPhoto + 1] = {0};
+    for (int ty = 0; ty < gTilesY; ++ty) {
+        int tx = 0;
+        while (tx < gTilesX) {
+            uint8_t cls = gTileClass[(size_t)ty * (size_t)gTilesX + (size_t)tx];
+            counts[cls]++;
+            if (cls == TileClassUnknown || cls == TileClassPhoto) {
+                tx++;
+                continue;
+            }
+            int runStart = tx++;
+            while (tx < gTilesX) {
+                uint8_t next = gTileClass[(size_t)ty * (size_t)gTilesX + (size_t)tx];
+                if (next == TileClassUnknown || next == TileClassPhoto)
+                    break;
+                counts[next]++;
+                tx++;
+            }
+            if (!region)
+                region = sraRgnCreate();
+            sraRegion *r = sraRgnCreateRect(runStart * gTileSize, ty * gTileSize, MIN(tx * gTileSize, gWidth),
+                                            MIN((ty + 1) * gTileSize, gHeight));
+            sraRgnOr(region, r);
+            sraRgnDestroy(r);
+        }
+    }
+
+    TVLogVerbose(@"tile classes: solid=%d palette=%d text=%d photo=%d unknown=%d", counts[TileClassSolid],
+                 counts[TileClassPalette], counts[TileClassText], counts[TileClassPhoto], counts[TileClassUnknown]);
+    publishLosslessRegion(region);
+}
+
+#pragma mark - Event Reactor
+
+// In reverse-connection mode (-reverse/-repeater), libvncserver runs unthreaded: the event thread calls
+// rfbProcessEvents, which selects over the server's sockets (listening and HTTP ones, if open, and the
+// clients') and then sends the updates that are due. Polling it with a select timeout meant that a frame
+// published just after the select started waited out the timeout, and that every pass scanned every
+// descriptor. The reactor waits with kqueue instead, on the same sockets plus a user event that the frame
+// pipeline and the main-thread ticks trigger once they have marked rects as modified; rfbProcessEvents then
+// runs without a timeout. The wait is only bounded by the update deferral while an update is pending, and
+// by cReactorIdleSec otherwise.
+//
+// In the default threaded mode, libvncserver's listener thread blocks in select without a timeout and each
+// client's output thread waits on its updateCond, which rfbMarkRectAsModified signals; the control socket
+// runs on dispatch sources. Nothing polls there, so the reactor is not used.
+
+static const double cReactorIdleSec = 1.0;    // longest wait without events
+static const uintptr_t cReactorWakeIdent = 1; // EVFILT_USER identifier of the wake-up event
+static const int cReactorMaxEvents = 16;      // events taken per wait
+
+static std::atomic<int> gReactorQueue(-1);
+static std::vector<int> gReactorFds; // sockets registered with the queue; event thread only
+
+static BOOL tvReactorOpen(void) {
+    int kq = kqueue();
+    if (kq < 0) {
+        TVLog(@"Event reactor: kqueue failed: %s", strerror(errno));
+        return NO;
+    }
+    struct kevent ev;
+    EV_SET(&ev, cReactorWakeIdent, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0) {
+        TVLog(@"Event reactor: cannot add the wake-up event: %s", strerror(errno));
+        close(kq);
+        return NO;
+    }
+    gReactorFds.clear();
+    gReactorQueue.store(kq, std::memory_order_release);
+    return YES;
+}
+
+// Event thread: whether rfbProcessEvents left an update waiting out the deferral (deferUpdateTime).
+static BOOL tvReactorUpdateDeferred(rfbScreenInfoPtr screen) {
+    BOOL deferred = NO;
+    rfbClientIteratorPtr it = rfbGetClientIterator(screen);
+    rfbClientPtr cl;
+    while (!deferred && (cl = rfbClientIteratorNext(it)))
+        deferred = cl->sock >= 0 && cl->startDeferring.tv_usec != 0;
+    rfbReleaseClientIterator(it);
+    return deferred;
+}
+
+static void tvReactorClose(void) {
+    int kq = gReactorQueue.exchange(-1, std::memory_order_acq_rel);
+    if (kq >= 0)
+        close(kq);
+    gReactorFds.clear();
+}
+
+// Any thread: end the reactor's current wait. Does nothing when the reactor is not running.
+static void tvReactorWake(void) {
+    int kq = gReactorQueue.load(std::memory_order_acquire);
+    if (kq < 0)
+        return;
+    struct kevent ev;
+    EV_SET(&ev, cReactorWakeIdent, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    kevent(kq, &ev, 1, NULL, 0, NULL);
+}
+
+// Event thread: wait until a socket rfbProcessEvents selects on is readable, or tvReactorWake is called.
+// The sockets change as clients come and go; a closed descriptor leaves the queue by itself, and one that
+// was reused is registered again, so all of them are (re-)added on every wait.
+static void tvReactorWait(rfbScreenInfoPtr screen, double timeoutSec) {
+    int kq = gReactorQueue.load(std::memory_order_acquire);
+    if (kq < 0)
+        return;
+
+    std::vector<int> fds;
+    const int listeners[] = {screen->listenSock, screen->listen6Sock, screen->httpListenSock,
+                             screen->httpListen6Sock, screen->httpSock};
+    for (int fd : listeners) {
+        if (fd >= 0)
+            fds.push_back(fd);
+    }
+    rfbClientIteratorPtr it = rfbGetClientIterator(screen);
+    rfbClientPtr cl;
+    while ((cl = rfbClientIteratorNext(it))) {
+        if (cl->sock >= 0)
+            fds.push_back(cl->sock);
+    }
+    rfbReleaseClientIterator(it);
+
+    std::vector<struct kevent> changes;
+    changes.reserve(fds.size() + gReactorFds.size());
+    for (int fd : gReactorFds) {
+        if (std::find(fds.begin(), fds.end(), fd) == fds.end()) {
+            struct kevent ev;
+            EV_SET(&ev, (uintptr_t)fd, EVFILT_READ, EV_DELETE | EV_RECEIPT, 0, 0, NULL);
+            changes.push_back(ev);
+        }
+    }
+    for (int fd : fds) {
+        struct kevent ev;
+        EV_SET(&ev, (uintptr_t)fd, EVFILT_READ, EV_ADD | EV_RECEIPT, 0, 0, NULL);
+        changes.push_back(ev);
+    }
+    gReactorFds.swap(fds);
+
+    // With EV_RECEIPT every change reports back (errors of deleted descriptors are expected); the
+    // registration is done before waiting, so the wait itself only returns real events
+    if (!changes.empty()) {
+        std::vector<struct kevent> receipts(changes.size());
+        kevent(kq, changes.data(), (int)changes.size(), receipts.data(), (int)receipts.size(), NULL);
+    }
+
+    struct kevent events[cReactorMaxEvents];
+    struct timespec ts;
+    ts.tv_sec = (time_t)timeoutSec;
+    ts.tv_nsec = (long)((timeoutSec - (double)ts.tv_sec) * 1e9);
+    if (kevent(kq, NULL, 0, events, cReactorMaxEvents, &ts) < 0 && errno != EINTR)
+        TVLogVerbose(@"Event reactor: kevent failed: %s", strerror(errno));
+}
+
+#pragma mark - Client State
+
+#define CLIENT_ID_LEN 8
+
+// Encoder parameters of a client, as negotiated through SetEncodings.
+typedef struct {
+    int tightQuality;  // tightQualityLevel (0..9, -1 = not requested)
+    int turboQuality;  // turboQualityLevel (1..100, -1 = lossless)
+    int turboSubsamp;  // turboSubsampLevel (see cTurboSubsamp*)
+    int tightCompress; // tightCompressLevel (0..9)
+} TVEncoderParams;
+
+// Link measurements of a client (see Link Statistics).
+typedef struct {
+    pthread_mutex_t lock; // guards the five fields below (shared with the input and main threads)
+    double lastSendEnd;   // end of the last update that carried data
+    BOOL awaitingRequest; // no update request seen since lastSendEnd
+    double rtt;           // update-to-next-request time (average)
+    double rttMin;        // baseline of the above
+    double drainSec;      // time the socket backlog needed to drain after the last update
+
+    uint32_t bytesAtStart; // rfbStatGetSentBytes when the update started
+    uint32_t delivered;    // bytes that had left the socket buffer at lastSample
+    int lastBacklog;       // socket send backlog at lastSample
+    double lastSample;     // time of the last delivery sample
+    double throughput;     // delivery rate in bytes/s while data was queued (average)
+} TVLinkStats;
+
+// Adaptive quality controller of a client (-q).
+typedef struct {
+    int quality;         // JPEG quality in use (0 = not adapting)
+    double lastAdjust;   // time of the last decision
+    double lastDecrease; // time of the last decrease
+} TVAdaptiveQuality;
+
+// A fence sent after a continuous update, waiting for the client's answer (-u).
+typedef struct {
+    uint32_t seq;  // payload of the fence
+    uint32_t sent; // continuous update bytes sent up to the fence
+    double sentAt; // time it was sent
+} TVFencePing;
+
+// Per-client state stored in cl->clientData to avoid cross-client conflicts.
+typedef struct {
+    int lastButtonMask;                // last received pointer button mask from this client
+    double wheelAccumPx;               // accumulated scroll in pixels (+down, -up) for this client
+    BOOL wheelFlushScheduled;          // whether a flush is pending for this client
+    BOOL isRepeaterClient;             // whether this client is a repeater
+    char clientId8[CLIENT_ID_LEN + 1]; // cached 8-char client id (NUL-terminated)
+
+    // Update shaping; only touched by the client's output thread (display hooks)
+    sraRegion *shapedRequest;   // requested region before it was narrowed for the current update
+    BOOL videoTurnNext;         // next update holding both UI and video sends the video part
+    BOOL encOverridden;         // encoder parameters were replaced for the current update
+    TVEncoderParams encSaved;   // parameters the client negotiated
+    TVEncoderParams encApplied; // parameters written for the current update
+
+    TVLinkStats link;     // link measurements
+    TVAdaptiveQuality aq; // adaptive quality controller
+    int scaleLevel;       // output size level chosen by the client (-m), 0 = full size
+
+    // Lossless refinement (-r); guarded by cl->updateMutex
+    sraRegion *lossyRegion;      // areas whose last update went out lossy
+    sraRegion *refineRegion;     // lossy areas queued for a lossless re-send
+    double refineTokens;         // refinement budget in bytes (negative after a large batch)
+    double refineRefill;         // time the budget was last refilled
+    BOOL refining;               // the update being sent is a refinement
+    uint32_t refineBytesAtStart; // rfbStatGetSentBytes when it started
+
+    // Encoding policy (-o); output thread only
+    int policyLink;        // link class (TVPolicyLink)
+    BOOL policyCpuBusy;    // server had no CPU headroom at the last evaluation
+    BOOL policyWarned;     // the uncompressed-encoding hint was logged
+    double policyLastEval; // time of the last evaluation
+
+    // Open H.264 (-x); h264Supported is set by the input thread, h264Keyframe is guarded by
+    // cl->updateMutex, the rest belongs to the output thread
+    BOOL h264Supported;    // client listed Open H.264 in its last SetEncodings
+    BOOL h264Keyframe;     // next frame must be a keyframe
+    TVH264Encoder *h264;   // encoder, created with the first frame
+    BOOL h264Fresh;        // next frame is the first of this encoder
+    int h264BitRate;       // bit rate in bits/s
+    double h264LastAdjust; // time of the last bit rate decision
+
+    // Continuous updates (-u); guarded by cl->updateMutex, except cuBytesAtStart (output thread)
+    BOOL fenceSupported;                    // client listed Fence; our Fence announced it
+    BOOL cuListed;                          // client listed ContinuousUpdates
+    BOOL cuSupported;                       // EndOfContinuousUpdates announced it
+    BOOL cuEnabled;                         // client turned continuous updates on
+    sraRegion *cuRegion;                    // area to keep current, in framebuffer coordinates
+    BOOL cuHeld;                            // the request was not re-armed because the window was full
+    BOOL cuLimited;                         // the window held an update back since the last answer
+    uint32_t cuSent;                        // continuous update bytes sent
+    uint32_t cuAcked;                       // ... of which a fence answer confirmed delivery
+    double cuWindow;                        // bytes allowed in flight
+    double cuRttMin;                        // baseline fence round trip
+    double cuLastDecrease;                  // time the window last shrank
+    TVFencePing cuPings[cFenceMaxInFlight]; // fences awaiting an answer, oldest at cuPingHead
+    int cuPingHead;                         // index of the oldest
+    int cuPingCount;                        // number waiting
+    uint32_t cuPingSeq;                     // payload of the last fence sent
+    uint32_t cuBytesAtStart;                // rfbStatGetSentBytes when the update started
+
+    // Update pacing (-l, -z) and the -Q gate; guarded by cl->updateMutex, except paceBytesAtStart (output thread)
+    BOOL sending;              // an update is being sent
+    sraRegion *pacedRequest;   // requested region held back until the bucket refills or the backlog drains
+    double paceRate;           // bucket fill rate in bytes/s (0 = not pacing)
+    double paceDepth;          // bucket size in bytes
+    double paceTokens;         // bytes that may go out now (negative after a large update)
+    double paceRefill;         // time the bucket was last refilled
+    uint32_t paceBytesAtStart; // rfbStatGetSentBytes when the update started
+
+    // Socket tuning (-j); sockBdp is guarded by cl->updateMutex, the rest belongs to the output thread
+    int sockBdp;         // estimated bandwidth-delay product in bytes (0 = not measured)
+    int sockSndBuf;      // SO_SNDBUF applied (0 = kernel default)
+    double sockLastTune; // time of the last decision
+
+    // Pointer focus (-f); the pointer fields are guarded by cl->updateMutex, focusRestNext belongs to the
+    // output thread
+    int focusX, focusY; // last pointer position, in framebuffer coordinates
+    double focusAt;     // time of the last pointer event (0 = none)
+    BOOL focusRestNext; // the last update sent only the focus; the next one sends the rest
+
+    // Sliced delivery (-y); output thread only
+    int sliceY;                 // top of the next slice
+    double sliceBytesPerPixel;  // encoded size of the client's updates (average, 0 = not measured)
+    long long slicePixels;      // pixels of the update being sent (0 = not measured)
+    uint32_t sliceBytesAtStart; // rfbStatGetSentBytes when it started
+
+    // TLS sessions; set by the main thread at connect, counted by the output thread
+    BOOL tlsSession;             // connected over TLS
+    CFAbsoluteTime tlsStartedAt; // when newClientHook saw the session
+    uint64_t tlsQueueBytes;      // written by the send queue
+    uint64_t tlsSentBytes;       // written in total, see tlsCountSentBytes
+    uint32_t tlsSentMark;        // rfbStatGetSentBytes when tlsSentBytes was last brought up to date
+} TVClientState;
+
+NS_INLINE TVClientState *tvGetClientState(rfbClientPtr cl) { return cl ? (TVClientState *)cl->clientData : NULL; }
+
+// libvncserver's turboSubsampLevel values
+static const int cTurboSubsamp444 = 0;
+static const int cTurboSubsamp420 = 1;
+static const int cTurboSubsamp422 = 2;
+static const int cTurboSubsampGray = 3;
+
+// JPEG quality behind each Tight QualityLevel pseudo-encoding (same table as libvncserver)
+static const int cTightToTurboQuality[10] = {15, 29, 41, 42, 62, 77, 79, 86, 92, 100};
+
+NS_INLINE TVEncoderParams tvReadEncoderParams(rfbClientPtr cl) {
+    TVEncoderParams p;
+    p.tightQuality = cl->tightQualityLevel;
+    p.turboQuality = cl->turboQualityLevel;
+    p.turboSubsamp = cl->turboSubsampLevel;
+    p.tightCompress = cl->tightCompressLevel;
+    return p;
+}
+
+NS_INLINE void tvWriteEncoderParams(rfbClientPtr cl, const TVEncoderParams *p) {
+    cl->tightQualityLevel = p->tightQuality;
+    cl->turboQualityLevel = p->turboQuality;
+    cl->turboSubsampLevel = p->turboSubsamp;
+    cl->tightCompressLevel = p->tightCompress;
+}
+
+NS_INLINE BOOL tvEncoderParamsEqual(const TVEncoderParams *a, const TVEncoderParams *b) {
+    return a->tightQuality == b->tightQuality && a->turboQuality == b->turboQuality &&
+           a->turboSubsamp == b->turboSubsamp && a->tightCompress == b->tightCompress;
+}
+
+// How much chroma a subsampling level discards (higher = less).
+NS_INLINE int tvSubsampRank(int subsamp) {
+    switch (subsamp) {
+    case cTurboSubsamp444:
+        return 0;
+    case cTurboSubsamp422:
+        return 1;
+    case cTurboSubsamp420:
+        return 2;
+    case cTurboSubsampGray:
+    default:
+        return 3;
+    }
+}
+
+// Lossy parameters at the given JPEG quality; subsampling follows the QualityLevel table and is never
+// finer than what the client already accepts.
+static TVEncoderParams tvLossyEncoderParams(const TVEncoderParams *base, int jpegQuality) {
+    TVEncoderParams p = *base;
+    int level = 0;
+    while (level < 9 && cTightToTurboQuality[level + 1] <= jpegQuality)
+        level++;
+    int subsamp = level <= 2 ? cTurboSubsamp420 : (level <= 5 ? cTurboSubsamp422 : cTurboSubsamp444);
+    if (tvSubsampRank(base->turboSubsamp) > tvSubsampRank(subsamp))
+        subsamp = base->turboSubsamp;
+
+    p.tightQuality = level;
+    p.turboQuality = jpegQuality;
+    p.turboSubsamp = subsamp;
+    return p;
+}
+
+// Replace the encoder parameters for the update being sent; tvRestoreEncoderParams puts the client's
+// own back once it is done.
+static void tvOverrideEncoderParams(rfbClientPtr cl, TVClientState *st, const TVEncoderParams *p) {
+    if (!st->encOverridden)
+        st->encSaved = tvReadEncoderParams(cl);
+    tvWriteEncoderParams(cl, p);
+    st->encApplied = *p;
+    st->encOverridden = YES;
+}
+
+static void tvRestoreEncoderParams(rfbClientPtr cl, TVClientState *st) {
+    if (!st->encOverridden)
+        return;
+    st->encOverridden = NO;
+
+    // A SetEncodings processed meanwhile wins over the saved values
+    TVEncoderParams cur = tvReadEncoderParams(cl);
+    if (tvEncoderParamsEqual(&cur, &st->encApplied))
+        tvWriteEncoderParams(cl, &st->encSaved);
+}
+
+#pragma mark - Link Statistics
+
+// Per-client link measurements taken in the display hooks, used by adaptive quality (-q), the output
+// downshift (-S), the H.264 bit rate (-x), the encoding policy (-o), update pacing (-l), socket tuning
+// (-j), pointer focus (-f) and sliced delivery (-y). After every
+// update that carried data, the socket send backlog (SO_NWRITE) and the bytes that left the buffer give a
+// delivery rate and the time the backlog needs to drain. The first update request after an update closes a
+// round trip (for continuous updates (-u), the answer to a fence does); its rise above the baseline is
+// queueing delay.
+
+NS_INLINE int tvSocketBacklog(int sock) {
+#ifdef SO_NWRITE
+    int nwrite = 0;
+    socklen_t len = sizeof(nwrite);
+    if (sock >= 0 && getsockopt(sock, SOL_SOCKET, SO_NWRITE, &nwrite, &len) == 0)
+        return nwrite;
+#endif
+    (void)sock;
+    return 0;
+}
+
+NS_INLINE BOOL isAdaptiveQualityEnabled(void) { return gAdaptiveQualityMax > 0; }
+NS_INLINE BOOL isOutputDownshiftEnabled(void) { return gDownshiftMinScale > 0.0; }
+NS_INLINE BOOL isLinkStatsEnabled(void) {
+    return isAdaptiveQualityEnabled() || isOutputDownshiftEnabled() || gH264Enabled || gEncodingPolicyEnabled ||
+           gUpdatePacingEnabled || gSocketTuningEnabled || gPointerFocusEnabled || gSliceTargetMs > 0;
+}
+
+// Output thread, from displayHook.
+static void linkBeginUpdate(rfbClientPtr cl, TVClientState *st) {
+    st->link.bytesAtStart = (uint32_t)rfbStatGetSentBytes(cl);
+}
+
+// Output thread, from displayFinishedHook. Returns NO when the update carried no data.
+static BOOL linkFinishUpdate(rfbClientPtr cl, TVClientState *st) {
+    TVLinkStats *ls = &st->link;
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    uint32_t sent = (uint32_t)rfbStatGetSentBytes(cl);
+    if (sent == ls->bytesAtStart)
+        return NO;
+
+    // Bytes that left the socket buffer since the last sample; the rate only says something about the
+    // link when data was queued during the whole interval.
+    int backlog = tvSocketBacklog(cl->sock);
+    uint32_t delivered = sent - (uint32_t)backlog;
+    if (ls->lastSample > 0 && ls->lastBacklog > 0) {
+        double dt = now - ls->lastSample;
+        if (dt > 0.005) {
+            double rate = (double)(uint32_t)(delivered - ls->delivered) / dt;
+            ls->throughput = ls->throughput > 0 ? ls->throughput * 0.8 + rate * 0.2 : rate;
+        }
+    }
+    ls->delivered = delivered;
+    ls->lastBacklog = backlog;
+    ls->lastSample = now;
+
+    double drainSec = (backlog > 0 && ls->throughput > 0) ? (double)backlog / ls->throughput : 0.0;
+
+    pthread_mutex_lock(&ls->lock);
+    ls->lastSendEnd = now;
+    ls->awaitingRequest = YES;
+    ls->drainSec = drainSec;
+    pthread_mutex_unlock(&ls->lock);
+    return YES;
+}
+
+// ls->lock held.
+NS_INLINE void linkAddRoundTrip(TVLinkStats *ls, double sample) {
+    ls->awaitingRequest = NO;
+    ls->rtt = ls->rtt > 0 ? ls->rtt * 0.75 + sample * 0.25 : sample;
+    // Let the baseline follow route changes slowly
+    if (ls->rttMin <= 0 || sample < ls->rttMin)
+        ls->rttMin = sample;
+    else
+        ls->rttMin += (sample - ls->rttMin) * 0.01;
+}
+
+// Input thread: the first request after an update closes a round trip.
+static void linkUpdateRequested(TVClientState *st) {
+    TVLinkStats *ls = &st->link;
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+
+    pthread_mutex_lock(&ls->lock);
+    if (ls->awaitingRequest)
+        linkAddRoundTrip(ls, now - ls->lastSendEnd);
+    pthread_mutex_unlock(&ls->lock);
+}
+
+// Input thread: a continuous-updates client sends no requests; the answer to a fence closes the round trip.
+static void linkFenceAnswered(TVClientState *st, double rtt) {
+    TVLinkStats *ls = &st->link;
+    pthread_mutex_lock(&ls->lock);
+    linkAddRoundTrip(ls, rtt);
+    pthread_mutex_unlock(&ls->lock);
+}
+
+// Any thread: backlog drain time and queueing delay of a client.
+static void linkSnapshot(TVClientState *st, double *drainSec, double *queueDelay) {
+    TVLinkStats *ls = &st->link;
+    pthread_mutex_lock(&ls->lock);
+    *drainSec = ls->drainSec;
+    *queueDelay = (ls->rtt > 0 && ls->rttMin > 0) ? ls->rtt - ls->rttMin : 0.0;
+    pthread_mutex_unlock(&ls->lock);
+}
+
+#pragma mark - Adaptive Quality
+
+// With -q, each client that asked for JPEG gets a quality controller driven by its link statistics.
+// Congestion cuts the JPEG quality multiplicatively; a link with headroom raises it additively, never
+// above the viewer's own quality or the -q maximum. Chroma subsampling follows the quality, and the
+// zlib level goes up as the quality goes down.
+
+// Output thread, from displayHook: apply the controller's parameters. The viewer's own parameters are
+// still in place at this point.
+static void aqBeginUpdate(rfbClientPtr cl, TVClientState *st) {
+    TVAdaptiveQuality *aq = &st->aq;
+    int clientQuality = cl->turboQualityLevel;
+    if (clientQuality < 0) {
+        aq->quality = 0; // lossless session: nothing to adapt
+        return;
+    }
+
+    int ceiling = MIN(clientQuality, gAdaptiveQualityMax);
+    if (aq->quality <= 0 || aq->quality > ceiling)
+        aq->quality = ceiling;
+    if (aq->quality >= clientQuality)
+        return;
+
+    TVEncoderParams base = tvReadEncoderParams(cl);
+    TVEncoderParams p = tvLossyEncoderParams(&base, aq->quality);
+    p.tightCompress = MIN(9, base.tightCompress + (ceiling - aq->quality) / cAqCompressStep);
+    tvOverrideEncoderParams(cl, st, &p);
+}
+
+// Output thread, from displayFinishedHook after a non-empty update (client parameters restored).
+static void aqFinishUpdate(rfbClientPtr cl, TVClientState *st) {
+    TVAdaptiveQuality *aq = &st->aq;
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    if (aq->quality <= 0 || now - aq->lastAdjust < cAqIntervalSec)
+        return;
+    aq->lastAdjust = now;
+
+    double drainSec = 0, queueDelay = 0;
+    linkSnapshot(st, &drainSec, &queueDelay);
+
+    int ceiling = MIN(cl->turboQualityLevel >= 0 ? cl->turboQualityLevel : 100, gAdaptiveQualityMax);
+    int minQuality = MIN(gAdaptiveQualityMin, ceiling);
+    int quality = aq->quality;
+    if (drainSec > cAqDrainHighSec || queueDelay > cAqQueueDelayHighSec) {
+        quality = MAX(minQuality, (int)(quality * cAqDecreaseFactor));
+        aq->lastDecrease = now;
+    } else if (drainSec < cAqDrainLowSec && queueDelay < cAqQueueDelayLowSec &&
+               now - aq->lastDecrease >= cAqIncreaseHoldSec) {
+        quality = MIN(ceiling, quality + cAqIncreaseStep);
+    }
+
+    if (quality != aq->quality) {
+        TVLogVerbose(@"adaptive quality: %d -> %d (drain=%.0fms queue=%.0fms rate=%.0fKB/s)", aq->quality, quality,
+                     drainSec * 1000.0, queueDelay * 1000.0, st->link.throughput / 1024.0);
+        aq->quality = quality;
+    }
+}
+
+#pragma mark - Encoding Policy
+
+// libvncserver encodes with the first encoding a viewer lists, at the compression the viewer asked for,
+// so a viewer set up for a slow line wastes CPU on a LAN and vice versa. With -o, the server classifies
+// each client's link once per cPolicyIntervalSec from the link statistics (fast: LAN round trip and no
+// backlog; slow: backlog or a low measured delivery rate) and samples its own CPU load. Tight clients
+// then get their zlib level adjusted: low on fast links or without CPU headroom, at least a moderate level
+// on slow links. Per rect, the tile classes and the Tight encoder still pick fill, palette, zlib or JPEG.
+// libvncserver does not keep the rest of the client's encoding list, so the encoding itself is only ever
+// changed to one the client is known to take (H.264 with -x); viewers stuck on an uncompressed encoding
+// over a slow link are logged.
+
+typedef enum {
+    TVPolicyLinkUnknown = 0,
+    TVPolicyLinkFast,
+    TVPolicyLinkNormal,
+    TVPolicyLinkSlow,
+} TVPolicyLink;
+
+static pthread_mutex_t gPolicyCpuLock = PTHREAD_MUTEX_INITIALIZER;
+static CFAbsoluteTime gPolicyCpuSampleAt = 0; // time of the last CPU sample
+static double gPolicyCpuSeconds = 0;          // user + system time at that sample
+static double gPolicyCpuLoad = 0;             // share of all cores used since the sample before
+
+// Any thread: process CPU load, refreshed at most once per cPolicyIntervalSec.
+static double policyCpuLoad(void) {
+    static double cores = 0;
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    pthread_mutex_lock(&gPolicyCpuLock);
+    if (now - gPolicyCpuSampleAt >= cPolicyIntervalSec) {
+        struct rusage ru;
+        if (getrusage(RUSAGE_SELF, &ru) == 0) {
+            double seconds = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec +
+                             ru.ru_stime.tv_usec / 1e6;
+            if (cores <= 0)
+                cores = MAX(1.0, (double)[NSProcessInfo processInfo].activeProcessorCount);
+            if (gPolicyCpuSampleAt > 0)
+                gPolicyCpuLoad = (seconds - gPolicyCpuSeconds) / (now - gPolicyCpuSampleAt) / cores;
+            gPolicyCpuSeconds = seconds;
+            gPolicyCpuSampleAt = now;
+        }
+    }
+    double load = gPolicyCpuLoad;
+    pthread_mutex_unlock(&gPolicyCpuLock);
+    return load;
+}
+
+NS_INLINE BOOL policyIsUncompressedEncoding(int encoding) {
+    return encoding == rfbEncodingRaw || encoding == rfbEncodingRRE || encoding == rfbEncodingCoRRE ||
+           encoding == rfbEncodingHextile;
+}
+
+// Output thread: classify the client's link and the CPU headroom.
+static void evaluateEncodingPolicy(rfbClientPtr cl, TVClientState *st) {
+    double drainSec = 0, queueDelay = 0;
+    linkSnapshot(st, &drainSec, &queueDelay);
+    pthread_mutex_lock(&st->link.lock);
+    double rttMin = st->link.rttMin;
+    pthread_mutex_unlock(&st->link.lock);
+    double throughput = st->link.throughput;
+
+    TVPolicyLink link = TVPolicyLinkNormal;
+    if (drainSec > cPolicyDrainHighSec || (throughput > 0 && throughput < cPolicySlowBytes))
+        link = TVPolicyLinkSlow;
+    else if (rttMin > 0 && rttMin < cPolicyLanRttSec && drainSec < cPolicyDrainLowSec)
+        link = TVPolicyLinkFast;
+    BOOL cpuBusy = policyCpuLoad() > cPolicyCpuBusy;
+
+    if (link != st->policyLink || cpuBusy != st->policyCpuBusy) {
+        static const char *names[] = {"unknown", "fast", "normal", "slow"};
+        TVLog(@"Client %s: encoding policy: %s link (rtt %.0f ms, drain %.0f ms)%s", st->clientId8, names[link],
+              rttMin * 1000.0, drainSec * 1000.0, cpuBusy ? @", CPU busy" : @"");
+    }
+    st->policyLink = link;
+    st->policyCpuBusy = cpuBusy;
+
+    if (link == TVPolicyLinkSlow && policyIsUncompressedEncoding(cl->preferredEncoding) && !st->policyWarned) {
+        char name[64];
+        encodingName((uint32_t)cl->preferredEncoding, name, sizeof(name));
+        TVLog(@"Client %s prefers %s on a slow link; set the viewer to Tight or ZRLE", st->clientId8, name);
+        st->policyWarned = YES;
+    }
+}
+
+// Output thread, from displayHook before adaptive quality builds on the parameters.
+static void applyEncodingPolicy(rfbClientPtr cl, TVClientState *st) {
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    if (now - st->policyLastEval >= cPolicyIntervalSec) {
+        st->policyLastEval = now;
+        evaluateEncodingPolicy(cl, st);
+    }
+
+    if (cl->preferredEncoding != rfbEncodingTight || st->policyLink == TVPolicyLinkUnknown)
+        return;
+
+    TVEncoderParams p = tvReadEncoderParams(cl);
+    int compress = p.tightCompress;
+    if (st->policyLink == TVPolicyLinkFast || st->policyCpuBusy)
+        compress = MIN(compress, cPolicyFastCompress);
+    else if (st->policyLink == TVPolicyLinkSlow)
+        compress = MAX(compress, cPolicySlowCompress);
+    if (compress != p.tightCompress) {
+        p.tightCompress = compress;
+        tvOverrideEncoderParams(cl, st, &p);
+    }
+}
+
+#pragma mark - Output Downshift
+
+// With -S, sustained congestion (frames dropped because encoders are still busy, or a client whose
+// backlog or queueing delay stays high) lowers the output scale one step at a time down to the -S floor,
+// and a long enough calm period raises it again. The framebuffer is then resized as on rotation, so
+// clients learn the new size through NewFBSize/ExtDesktopSize and pointer mapping follows gWidth and
+// gHeight. A step up that is followed by congestion doubles the calm period needed for the next one.
+
+static int gDownshiftStep = 0;                           // index into cDownshiftSteps
+static int gDownshiftFrames = 0;                         // frames seen in the current window
+static int gDownshiftDropped = 0;                        // frames dropped for busy encoders in the window
+static CFAbsoluteTime gDownshiftWindowStart = 0;         // start of the current window
+static CFAbsoluteTime gDownshiftOverSince = 0;           // start of the over-budget stretch (0 = not over)
+static CFAbsoluteTime gDownshiftCalmSince = 0;           // start of the calm stretch (0 = not calm)
+static CFAbsoluteTime gDownshiftLastUp = 0;              // time of the last step up (0 = confirmed)
+static CFAbsoluteTime gDownshiftLastOver = 0;            // last window judged over budget
+static double gDownshiftUpHoldSec = cDownshiftUpHoldSec; // calm period required for the next step up
+static BOOL gDownshiftTickScheduled = NO;
+
+static void setOutputDownshiftStep(int step, const char *reason) {
+    gDownshiftStep = step;
+    gOutputDownshift = cDownshiftSteps[step];
+    TVLog(@"Output downshift (%s): scale x%.3f, effective %.3f", reason, gOutputDownshift, effectiveOutputScale());
+
+    // The next frame resizes the framebuffer; make sure one comes even if the screen is idle
+    gFrameFingerprintStale.store(true, std::memory_order_relaxed);
+    [[ScreenCapturer sharedCapturer] forceNextFrameUpdate];
+}
+
+// Main thread. Judges the window once it is complete and moves at most one step. Returns YES while
+// downshifted, so that the caller keeps a tick running even when no frames arrive.
+static BOOL evaluateOutputDownshift(void) {
+    if (!isOutputDownshiftEnabled() || !gScreen)
+        return NO;
+
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    if (gDownshiftWindowStart <= 0)
+        gDownshiftWindowStart = now;
+    if (now - gDownshiftWindowStart < cDownshiftWindowSec)
+        return gDownshiftStep > 0;
+
+    BOOL dropping = gDownshiftFrames > 0 && gDownshiftDropped > gDownshiftFrames * cDownshiftDropRatio;
+    gDownshiftFrames = 0;
+    gDownshiftDropped = 0;
+    gDownshiftWindowStart = now;
+
+    // Worst client decides; resizing either way needs every client to understand a size change
+    double worstDrain = 0, worstQueue = 0;
+    BOOL allResizable = YES;
+    rfbClientIteratorPtr it = rfbGetClientIterator(gScreen);
+    rfbClientPtr cl;
+    while ((cl = rfbClientIteratorNext(it))) {
+        TVClientState *st = tvGetClientState(cl);
+        if (!st)
+            continue;
+        double drainSec = 0, queueDelay = 0;
+        linkSnapshot(st, &drainSec, &queueDelay);
+        worstDrain = MAX(worstDrain, drainSec);
+        worstQueue = MAX(worstQueue, queueDelay);
+        if (!cl->useNewFBSize && !cl->useExtDesktopSize)
+            allResizable = NO;
+    }
+    rfbReleaseClientIterator(it);
+
+    BOOL over = dropping || worstDrain > cDownshiftDrainHighSec || worstQueue > cDownshiftQueueHighSec;
+    BOOL calm = !dropping && worstDrain < cDownshiftDrainLowSec && worstQueue < cDownshiftQueueLowSec;
+
+    int lowest = 0;
+    int stepCount = (int)(sizeof(cDownshiftSteps) / sizeof(cDownshiftSteps[0]));
+    while (lowest + 1 < stepCount && cDownshiftSteps[lowest + 1] >= gDownshiftMinScale - 1e-6)
+        lowest++;
+
+    if (over) {
+        gDownshiftCalmSince = 0;
+        gDownshiftLastOver = now;
+        if (gDownshiftOverSince <= 0)
+            gDownshiftOverSince = now;
+        if (gDownshiftLastUp > 0 && now - gDownshiftLastUp < gDownshiftUpHoldSec) {
+            // The last step up did not hold
+            gDownshiftUpHoldSec = MIN(gDownshiftUpHoldSec * 2.0, cDownshiftUpHoldMaxSec);
+            gDownshiftLastUp = 0;
+        }
+        if (now - gDownshiftOverSince >= cDownshiftDownHoldSec && gDownshiftStep < lowest && allResizable) {
+            gDownshiftOverSince = 0;
+            setOutputDownshiftStep(gDownshiftStep + 1, "congested");
+        }
+    } else {
+        gDownshiftOverSince = 0;
+        if (gDownshiftLastUp > 0 && now - gDownshiftLastUp >= gDownshiftUpHoldSec)
+            gDownshiftLastUp = 0;
+        if (gDownshiftLastOver > 0 && now - gDownshiftLastOver >= cDownshiftUpHoldMaxSec)
+            gDownshiftUpHoldSec = cDownshiftUpHoldSec;
+
+        if (!calm) {
+            gDownshiftCalmSince = 0;
+        } else if (gDownshiftCalmSince <= 0) {
+            gDownshiftCalmSince = now;
+        } else if (gDownshiftStep > 0 && now - gDownshiftCalmSince >= gDownshiftUpHoldSec && allResizable) {
+            gDownshiftCalmSince = 0;
+            gDownshiftLastUp = now;
+            setOutputDownshiftStep(gDownshiftStep - 1, "recovered");
+        }
+    }
+
+    return gDownshiftStep > 0;
+}
+
+static void scheduleOutputDownshiftTick(void) {
+    if (gDownshiftTickScheduled)
+        return;
+    gDownshiftTickScheduled = YES;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(cDownshiftWindowSec * NSEC_PER_SEC)),
+                   dispatch_get_main_queue(), ^{
+                       gDownshiftTickScheduled = NO;
+                       if (evaluateOutputDownshift())
+                           scheduleOutputDownshiftTick();
+                   });
+}
+
+// Main thread, for every captured frame. dropped: skipped because encoders were busy.
+static void noteOutputDownshiftFrame(BOOL dropped) {
+    gDownshiftFrames++;
+    if (dropped)
+        gDownshiftDropped++;
+    if (evaluateOutputDownshift())
+        scheduleOutputDownshiftTick();
+}
+
+#pragma mark - Client Scale Levels
+
+// With -m, each client picks its own output size from 1, 1/2 and 1/4 of the framebuffer by asking for a
+// desktop size (ExtendedDesktopSize): it gets the largest level that fits. Levels are libvncserver scaled
+// screens, shared by all clients on the same level and refreshed by rfbMarkRectAsModified for the marked
+// rects only. Each client keeps its dirty region in framebuffer coordinates; libvncserver maps it to the
+// level when sending, and maps pointer events back before they reach vncPointToDevicePoint.
+
+NS_INLINE int clientScaleLevelForSize(int width, int height) {
+    for (int level = 0; level < cClientScaleLevels - 1; ++level) {
+        if ((gWidth >> level) <= width && (gHeight >> level) <= height)
+            return level;
+    }
+    return cClientScaleLevels - 1;
+}
+
+// Attach the client to the scaled screen of its level (allocated on first use) and queue a size update.
+static void applyClientScaleLevel(rfbClientPtr cl, TVClientState *st, int level) {
+    st->scaleLevel = level;
+    rfbScalingSetup(cl, MAX(1, gWidth >> level), MAX(1, gHeight >> level));
+}
+
+// Main thread, after the framebuffer was replaced: move scaled clients to levels of the new size.
+static void reapplyClientScaleLevels(void) {
+    if (!gScreen)
+        return;
+    rfbClientIteratorPtr it = rfbGetClientIterator(gScreen);
+    rfbClientPtr cl;
+    while ((cl = rfbClientIteratorNext(it))) {
+        TVClientState *st = tvGetClientState(cl);
+        if (st && st->scaleLevel > 0)
+            applyClientScaleLevel(cl, st, st->scaleLevel);
+    }
+    rfbReleaseClientIterator(it);
+}
+
+#pragma mark - Lossless Refinement
+
+// With -r, Tight clients get fast lossy updates while the screen moves, and the parts that went out as JPEG
+// are re-sent losslessly once their tiles have not changed for the -r delay. Each client tracks the area
+// whose last update was lossy; a tick on the main thread intersects it with the idle tiles and queues a
+// band of it as a refinement, but only while the client has an update request outstanding and nothing
+// else to send, and only as far as its refinement budget allows. New content always goes first: an
+// update that mixes refinement and fresh changes is sent at the client's quality.
+
+static CFAbsoluteTime *gRefineTileChanged = NULL; // last change per tile
+static int gRefineTilesX = 0;
+static int gRefineTilesY = 0;
+static BOOL gRefineTickScheduled = NO;
+
+NS_INLINE BOOL isLosslessRefineEnabled(void) { return gRefineIdleSec > 0.0; }
+
+static void ensureLosslessRefineState(void) {
+    if (gRefineTileChanged && gRefineTilesX == gTilesX && gRefineTilesY == gTilesY)
+        return;
+
+    free(gRefineTileChanged);
+    gRefineTileChanged = (CFAbsoluteTime *)malloc(gTileCount * sizeof(CFAbsoluteTime));
+    if (!gRefineTileChanged) {
+        TVPrintError("Out of memory for lossless refinement");
+        exit(EXIT_FAILURE);
+    }
+
+    // Unknown history counts as a change now
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    for (size_t i = 0; i < gTileCount; ++i)
+        gRefineTileChanged[i] = now;
+    gRefineTilesX = gTilesX;
+    gRefineTilesY = gTilesY;
+}
+
+// Main thread, after dirty rects were published: restart the idle clock of the tiles they touch.
+static void noteRefineTilesChanged(const DirtyRect *rects, int rectCount, BOOL fullScreen) {
+    ensureLosslessRefineState();
+
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    if (fullScreen) {
+        for (size_t i = 0; i < gTileCount; ++i)
+            gRefineTileChanged[i] = now;
+        return;
+    }
+    for (int i = 0; i < rectCount; ++i) {
+        const DirtyRect &r = rects[i];
+        if (r.w <= 0 || r.h <= 0)
+            continue;
+        int tx2 = MIN((r.x + r.w - 1) / gTileSize, gTilesX - 1);
+        int ty2 = MIN((r.y + r.h - 1) / gTileSize, gTilesY - 1);
+        for (int ty = r.y / gTileSize; ty <= ty2; ++ty) {
+            for (int tx = r.x / gTileSize; tx <= tx2; ++tx)
+                gRefineTileChanged[(size_t)ty * (size_t)gTilesX + (size_t)tx] = now;
+        }
+    }
+}
+
+// Tiles that have been idle for the -r delay, one rect per horizontal run. NULL if there are none.
+static sraRegion *copyIdleTileRegion(CFAbsoluteTime now) {
+    sraRegion *region = NULL;
+    for (int ty = 0; ty < gTilesY; ++ty) {
+        const CFAbsoluteTime *row = gRefineTileChanged + (size_t)ty * (size_t)gTilesX;
+        int tx = 0;
+        while (tx < gTilesX) {
+            if (now - row[tx] < gRefineIdleSec) {
+                tx++;
+                continue;
+            }
+            int runStart = tx++;
+            while (tx < gTilesX && now - row[tx] >= gRefineIdleSec)
+                tx++;
+            if (!region)
+                region = sraRgnCreate();
+            sraRegion *r = sraRgnCreateRect(runStart * gTileSize, ty * gTileSize, MIN(tx * gTileSize, gWidth),
+                                            MIN((ty + 1) * gTileSize, gHeight));
+            sraRgnOr(region, r);
+            sraRgnDestroy(r);
+        }
+    }
+    return region;
+}
+
+// Narrow region to the topmost band of tile rows whose pixels fit the budget (at least one row).
+static void limitRefineBand(sraRegion *region, double budgetPixels) {
+    std::vector<double> rowPixels((size_t)gTilesY, 0.0);
+    sraRectangleIterator *iter = sraRgnGetIterator(region);
+    sraRect r;
+    while (sraRgnIteratorNext(iter, &r)) {
+        int ty2 = MIN((r.y2 - 1) / gTileSize, gTilesY - 1);
+        for (int ty = r.y1 / gTileSize; ty <= ty2; ++ty) {
+            int y1 = MAX(r.y1, ty * gTileSize);
+            int y2 = MIN(r.y2, (ty + 1) * gTileSize);
+            rowPixels[(size_t)ty] += (double)(r.x2 - r.x1) * (double)(y2 - y1);
+        }
+    }
+    sraRgnReleaseIterator(iter);
+
+    int first = 0;
+    while (first < gTilesY && rowPixels[(size_t)first] <= 0)
+        first++;
+    if (first >= gTilesY)
+        return;
+    int end = first + 1;
+    double pixels = rowPixels[(size_t)first];
+    while (end < gTilesY && pixels + rowPixels[(size_t)end] <= budgetPixels)
+        pixels += rowPixels[(size_t)end++];
+    if (first == 0 && end == gTilesY)
+        return;
+
+    sraRegion *band = sraRgnCreateRect(0, first * gTileSize, gWidth, MIN(end * gTileSize, gHeight));
+    sraRgnAnd(region, band);
+    sraRgnDestroy(band);
+}
+
+// Main thread. Queues refinements for idle clients and returns YES while any client still has lossy
+// areas, so that the caller keeps the tick running.
+static BOOL evaluateLosslessRefine(void) {
+    if (!isLosslessRefineEnabled() || !gScreen)
+        return NO;
+    ensureLosslessRefineState();
+
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    sraRegion *idle = copyIdleTileRegion(now);
+    BOOL anyLossy = NO;
+    BOOL anyQueued = NO;
+
+    rfbClientIteratorPtr it = rfbGetClientIterator(gScreen);
+    rfbClientPtr cl;
+    while ((cl = rfbClientIteratorNext(it))) {
+        TVClientState *st = tvGetClientState(cl);
+        if (!st)
+            continue;
+        double drainSec = 0, queueDelay = 0;
+        if (isLinkStatsEnabled())
+            linkSnapshot(st, &drainSec, &queueDelay);
+
+        BOOL queued = NO;
+        pthread_mutex_lock(&cl->updateMutex);
+        if (st->lossyRegion && !sraRgnEmpty(st->lossyRegion)) {
+            anyLossy = YES;
+
+            double cap = cRefineRateBytes * cRefineBurstSec;
+            st->refineTokens = MIN(st->refineTokens + (now - st->refineRefill) * cRefineRateBytes, cap);
+            st->refineRefill = now;
+
+            // Only a client waiting with nothing else to send gets a refinement
+            BOOL waiting = !sraRgnEmpty(cl->requestedRegion);
+            if (waiting) {
+                sraRegion *busy = sraRgnCreateRgn(cl->modifiedRegion);
+                sraRgnAnd(busy, cl->requestedRegion);
+                waiting = sraRgnEmpty(busy);
+                sraRgnDestroy(busy);
+            }
+            if (idle && waiting && !st->refineRegion && st->refineTokens > 0 && drainSec <= cRefineMaxDrainSec) {
+                sraRegion *cand = sraRgnCreateRgn(st->lossyRegion);
+                sraRgnAnd(cand, idle);
+                if (!sraRgnEmpty(cand)) {
+                    limitRefineBand(cand, st->refineTokens / cRefineBytesPerPixel);
+                    sraRgnOr(cl->modifiedRegion, cand);
+                    st->refineRegion = cand;
+                    queued = YES;
+                } else {
+                    sraRgnDestroy(cand);
+                }
+            }
+        }
+        if (queued) {
+            pthread_cond_signal(&cl->updateCond);
+            anyQueued = YES;
+        }
+        pthread_mutex_unlock(&cl->updateMutex);
+    }
+    rfbReleaseClientIterator(it);
+
+    if (anyQueued)
+        tvReactorWake();
+    if (idle)
+        sraRgnDestroy(idle);
+    return anyLossy;
+}
+
+static void scheduleLosslessRefineTick(void) {
+    if (gRefineTickScheduled)
+        return;
+    gRefineTickScheduled = YES;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(cRefineTickSec * NSEC_PER_SEC)),
+                   dispatch_get_main_queue(), ^{
+                       gRefineTickScheduled = NO;
+                       if (evaluateLosslessRefine())
+                           scheduleLosslessRefineTick();
+                   });
+}
+
+// Main thread, after the framebuffer was replaced: what clients hold no longer matches the new geometry.
+static void resetLosslessRefine(void) {
+    free(gRefineTileChanged);
+    gRefineTileChanged = NULL;
+    if (!gScreen)
+        return;
+
+    rfbClientIteratorPtr it = rfbGetClientIterator(gScreen);
+    rfbClientPtr cl;
+    while ((cl = rfbClientIteratorNext(it))) {
+        TVClientState *st = tvGetClientState(cl);
+        if (!st)
+            continue;
+        pthread_mutex_lock(&cl->updateMutex);
+        if (st->lossyRegion)
+            sraRgnMakeEmpty(st->lossyRegion);
+        if (st->refineRegion) {
+            sraRgnDestroy(st->refineRegion);
+            st->refineRegion = NULL;
+        }
+        pthread_mutex_unlock(&cl->updateMutex);
+    }
+    rfbReleaseClientIterator(it);
+}
+
+// Output thread, from displayHook: track what goes out lossy, and send a pending refinement lossless.
+static void applyLosslessRefine(rfbClientPtr cl, TVClientState *st) {
+    if (cl->preferredEncoding != rfbEncodingTight)
+        return;
+
+    BOOL refineOnly = NO;
+    BOOL becameLossy = NO;
+    pthread_mutex_lock(&cl->updateMutex);
+    sraRegion *pending = sraRgnCreateRgn(cl->modifiedRegion);
+    sraRgnAnd(pending, cl->requestedRegion);
+    if (!sraRgnEmpty(pending)) {
+        if (st->refineRegion) {
+            sraRegion *rest = sraRgnCreateRgn(pending);
+            sraRgnSubtract(rest, st->refineRegion);
+            refineOnly = sraRgnEmpty(rest);
+            sraRgnDestroy(rest);
+            sraRgnDestroy(st->refineRegion);
+            st->refineRegion = NULL;
+        }
+
+        if (!st->lossyRegion)
+            st->lossyRegion = sraRgnCreate();
+        if (!refineOnly && cl->turboQualityLevel >= 0) {
+            becameLossy = sraRgnEmpty(st->lossyRegion);
+            sraRgnOr(st->lossyRegion, pending);
+        } else {
+            sraRgnSubtract(st->lossyRegion, pending);
+        }
+    }
+    pthread_mutex_unlock(&cl->updateMutex);
+    sraRgnDestroy(pending);
+
+    if (refineOnly) {
+        TVEncoderParams p = tvReadEncoderParams(cl);
+        p.tightQuality = -1;
+        p.turboQuality = -1;
+        tvOverrideEncoderParams(cl, st, &p);
+        st->refining = YES;
+        st->refineBytesAtStart = (uint32_t)rfbStatGetSentBytes(cl);
+    }
+    if (becameLossy) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            scheduleLosslessRefineTick();
+        });
+    }
+}
+
+// Output thread, from displayFinishedHook: charge the refinement to the client's budget.
+static void finishLosslessRefine(rfbClientPtr cl, TVClientState *st) {
+    if (!st->refining)
+        return;
+    st->refining = NO;
+
+    uint32_t sent = (uint32_t)rfbStatGetSentBytes(cl) - st->refineBytesAtStart;
+    pthread_mutex_lock(&cl->updateMutex);
+    st->refineTokens -= (double)sent;
+    pthread_mutex_unlock(&cl->updateMutex);
+}
+
+#pragma mark - Send Queue
+
+// Updates that the server composes itself (Raw, Hextile with -E, shared Tight rects with -b) are queued as
+// segments instead of being copied into one message: small parts such as rect headers go into the queue's
+// own buffer, pixels and encoded data are referenced where they lie, cached rects kept alive by their
+// shared_ptr (the cache may evict them meanwhile). The queue is then written with writev, up to cSendIovMax
+// segments per call, waiting for the socket to become writable when it is full, like rfbWriteExact does.
+//
+// TLS clients get the queue in writes of whole records: segments of cTlsRecordBytes or more go to SSL_write
+// in multiples of it straight from where they lie, smaller ones are gathered until a record is full. Every
+// record but the last of an update carries the full 16 KB, and no data is copied on the way to OpenSSL.
+// rfbWriteExact would have copied the update into one buffer and split it at 32 KB. Small messages that
+// libvncserver sends itself (cursor, clipboard, bell) keep their own small records.
+//
+// WebSocket clients (browsers, through -H) get the queue in binary frames of up to cWsFrameMaxBytes: the
+// frame headers are segments of their own, so the data is not copied. rfbWriteExact would copy the update
+// into a 32 KB frame at a time instead. libvncserver sends every message as one complete frame, so frames
+// written here can go between them. Clients that negotiated base64 text frames need libvncserver's
+// encoding; their queue is coalesced into one buffer and goes through rfbWriteExact.
+//
+// With -z, an update is not started while the client's socket backlog is above the high-water mark: its
+// requested region is held like a paced one (see Update Pacing) and the changes published meanwhile are
+// coalesced into the update that goes out once the backlog has drained. A stalled viewer then costs its
+// output thread nothing instead of blocking it in the middle of an update full of stale pixels.
+
+// A run of bytes in a send queue: a slice of a shared buffer, borrowed bytes that stay valid until the
+// queue is flushed (the framebuffer, under sendMutex), or a slice of the queue's own bytes.
+typedef struct {
+    std::shared_ptr<std::vector<uint8_t>> owner;
+    const uint8_t *borrowed;
+    size_t offset; // into owner or the queue's own bytes
+    size_t length;
+} TVSendSegment;
+
+typedef struct {
+    std::vector<TVSendSegment> segments;
+    std::vector<uint8_t> own; // bytes of the segments without an owner
+    size_t length = 0;        // total bytes queued
+} TVSendQueue;
+
+NS_INLINE BOOL isSendHighWaterEnabled(void) { return gSendHighWaterKB > 0; }
+
+// Whether the client's unsent data is above the high-water mark (-z).
+NS_INLINE BOOL sendBacklogAboveHighWater(rfbClientPtr cl) {
+    return isSendHighWaterEnabled() && tvSocketBacklog(cl->sock) > gSendHighWaterKB * 1024;
+}
+
+static void sendQueuePush(TVSendQueue *q, const void *bytes, size_t length) {
+    if (length == 0)
+        return;
+    size_t offset = q->own.size();
+    q->own.insert(q->own.end(), (const uint8_t *)bytes, (const uint8_t *)bytes + length);
+    q->length += length;
+
+    // Extend the last segment when it ends where these bytes start
+    if (!q->segments.empty()) {
+        TVSendSegment &last = q->segments.back();
+        if (!last.owner && !last.borrowed && last.offset + last.length == offset) {
+            last.length += length;
+            return;
+        }
+    }
+    q->segments.push_back(TVSendSegment{nullptr, NULL, offset, length});
+}
+
+NS_INLINE void sendQueuePushU16(TVSendQueue *q, uint16_t v) {
+    uint8_t b[2] = {(uint8_t)(v >> 8), (uint8_t)v};
+    sendQueuePush(q, b, sizeof(b));
+}
+
+static void sendQueuePushShared(TVSendQueue *q, const std::shared_ptr<std::vector<uint8_t>> &bytes, size_t offset) {
+    if (offset >= bytes->size())
+        return;
+    q->segments.push_back(TVSendSegment{bytes, NULL, offset, bytes->size() - offset});
+    q->length += bytes->size() - offset;
+}
+
+static void sendQueuePushBorrowed(TVSendQueue *q, const uint8_t *bytes, size_t length) {
+    if (length == 0)
+        return;
+    q->length += length;
+
+    // Rows of a full-width rect follow each other
+    if (!q->segments.empty()) {
+        TVSendSegment &last = q->segments.back();
+        if (last.borrowed && last.borrowed + last.length == bytes) {
+            last.length += length;
+            return;
+        }
+    }
+    q->segments.push_back(TVSendSegment{nullptr, bytes, 0, length});
+}
+
+NS_INLINE const uint8_t *sendSegmentBytes(const TVSendQueue *q, const TVSendSegment &seg) {
+    if (seg.borrowed)
+        return seg.borrowed;
+    return (seg.owner ? seg.owner->data() : q->own.data()) + seg.offset;
+}
+
+// Whether libvncserver sends this WebSocket client binary frames rather than base64 text frames. Encoding
+// one byte only fills the client's encode buffer, which rfbWriteExact uses under outputMutex.
+static BOOL wsClientTakesBinaryFrames(rfbClientPtr cl) {
+    char probe = 0;
+    char *frame = NULL;
+    pthread_mutex_lock(&cl->outputMutex);
+    int length = webSocketsEncode(cl, &probe, 1, &frame);
+    BOOL binary = length > 0 && frame && (frame[0] & 0x0F) == cWsOpcodeBinary;
+    pthread_mutex_unlock(&cl->outputMutex);
+    return binary;
+}
+
+// Header of an unmasked, final binary frame (RFC 6455, section 5.2); returns its length.
+static size_t wsPutFrameHeader(uint8_t *h, size_t payload) {
+    h[0] = 0x80 | cWsOpcodeBinary;
+    if (payload < 126) {
+        h[1] = (uint8_t)payload;
+        return 2;
+    }
+    if (payload <= 0xFFFF) {
+        h[1] = 126;
+        h[2] = (uint8_t)(payload >> 8);
+        h[3] = (uint8_t)payload;
+        return 4;
+    }
+    h[1] = 127;
+    for (int i = 0; i < 8; ++i)
+        h[2 + i] = (uint8_t)((uint64_t)payload >> (56 - 8 * i));
+    return cWsHeaderMaxBytes;
+}
+
+// The queue as iovecs, in WebSocket frames when wsHeads is given; the frame headers are written into it.
+static void sendQueueIovecs(const TVSendQueue *q, std::vector<uint8_t> *wsHeads, std::vector<struct iovec> &iov) {
+    size_t frames = wsHeads ? (q->length + cWsFrameMaxBytes - 1) / cWsFrameMaxBytes : 0;
+    if (wsHeads)
+        wsHeads->assign(frames * cWsHeaderMaxBytes, 0);
+    iov.reserve(q->segments.size() + frames * 2);
+
+    size_t unframed = q->length; // bytes not yet given a frame
+    size_t frameLeft = 0;        // bytes still to go into the current frame
+    size_t frame = 0;
+    for (const TVSendSegment &seg : q->segments) {
+        const uint8_t *p = sendSegmentBytes(q, seg);
+        size_t left = seg.length;
+        while (left > 0) {
+            if (wsHeads && frameLeft == 0) {
+                frameLeft = MIN(unframed, cWsFrameMaxBytes);
+                unframed -= frameLeft;
+                uint8_t *h = wsHeads->data() + frame++ * cWsHeaderMaxBytes;
+                iov.push_back(iovec{h, wsPutFrameHeader(h, frameLeft)});
+            }
+            // A segment that crosses a frame boundary is split
+            size_t n = wsHeads ? MIN(left, frameLeft) : left;
+            iov.push_back(iovec{(void *)p, n});
+            p += n;
+            left -= n;
+            if (wsHeads)
+                frameLeft -= n;
+        }
+    }
+}
+
+// libvncserver's TLS write (rfbssl.h is not installed): writes all of buf, or fails.
+extern "C" int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize);
+
+NS_INLINE BOOL tlsWriteAll(rfbClientPtr cl, const char *bytes, size_t length) {
+    if (cl->sock < 0 || rfbssl_write(cl, bytes, (int)length) != (int)length) {
+        errno = cl->sock < 0 ? EBADF : EIO;
+        return NO;
+    }
+    return YES;
+}
+
+// outputMutex held: the iovecs through TLS in whole records. Returns 1 or -1 (errno set).
+static int sendQueueWriteTls(rfbClientPtr cl, const std::vector<struct iovec> &iov) {
+    std::vector<char> record;
+    record.reserve(cTlsRecordBytes);
+
+    for (const struct iovec &v : iov) {
+        const char *p = (const char *)v.iov_base;
+        size_t left = v.iov_len;
+        while (left > 0) {
+            if (record.empty() && left >= cTlsRecordBytes) {
+                // Whole records straight from the segment; SSL_write splits them
+                size_t n = MIN(left - left % cTlsRecordBytes, cTlsRecordBytes * 64);
+                if (!tlsWriteAll(cl, p, n))
+                    return -1;
+                p += n;
+                left -= n;
+                continue;
+            }
+            size_t n = MIN(left, cTlsRecordBytes - record.size());
+            record.insert(record.end(), p, p + n);
+            p += n;
+            left -= n;
+            if (record.size() == cTlsRecordBytes) {
+                if (!tlsWriteAll(cl, record.data(), record.size()))
+                    return -1;
+                record.clear();
+            }
+        }
+    }
+    if (!record.empty() && !tlsWriteAll(cl, record.data(), record.size()))
+        return -1;
+    return 1;
+}
+
+// Output thread, sendMutex held. Returns 1 when everything was written, -1 (errno set) otherwise.
+static int sendQueueFlush(rfbClientPtr cl, TVSendQueue *q) {
+    if (q->length == 0)
+        return 1;
+
+    BOOL wsFrames = cl->wsctx && wsClientTakesBinaryFrames(cl);
+    if (cl->wsctx && !wsFrames) {
+        std::vector<uint8_t> flat;
+        flat.reserve(q->length);
+        for (const TVSendSegment &seg : q->segments) {
+            const uint8_t *p = sendSegmentBytes(q, seg);
+            flat.insert(flat.end(), p, p + seg.length);
+        }
+        return rfbWriteExact(cl, (const char *)flat.data(), (int)flat.size()) < 0 ? -1 : 1;
+    }
+
+    std::vector<uint8_t> wsHeads;
+    std::vector<struct iovec> iov;
+    sendQueueIovecs(q, wsFrames ? &wsHeads : NULL, iov);
+
+    if (cl->sslctx) {
+        pthread_mutex_lock(&cl->outputMutex);
+        int result = sendQueueWriteTls(cl, iov);
+        pthread_mutex_unlock(&cl->outputMutex);
+        TVClientState *st = tvGetClientState(cl);
+        if (st && result > 0)
+            st->tlsQueueBytes += q->length;
+        return result;
+    }
+
+    int timeoutMs = (cl->screen && cl->screen->maxClientWait) ? cl->screen->maxClientWait : rfbMaxClientWait;
+    int result = 1;
+    size_t next = 0;
+    pthread_mutex_lock(&cl->outputMutex);
+    while (next < iov.size()) {
+        if (cl->sock < 0) {
+            errno = EBADF;
+            result = -1;
+            break;
+        }
+        ssize_t n = writev(cl->sock, &iov[next], (int)MIN(iov.size() - next, (size_t)cSendIovMax));
+        if (n > 0) {
+            // Skip what was written; a partial segment continues where the write stopped
+            size_t left = (size_t)n;
+            while (next < iov.size() && left >= iov[next].iov_len)
+                left -= iov[next++].iov_len;
+            if (left > 0) {
+                iov[next].iov_base = (uint8_t *)iov[next].iov_base + left;
+                iov[next].iov_len -= left;
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            if (n == 0)
+                errno = EPIPE;
+            result = -1;
+            break;
+        }
+
+        struct pollfd pfd = {cl->sock, POLLOUT, 0};
+        int ready = poll(&pfd, 1, timeoutMs);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready <= 0) {
+            if (ready == 0) {
+                rfbErr("sendQueueFlush: write timeout\n");
+                errno = ETIMEDOUT;
+            }
+            result = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cl->outputMutex);
+    return result;
+}
+
+// Output thread, sendMutex held: take the client's pending update out of its regions like
+// rfbSendFramebufferUpdate does. Returns NO (nothing taken) when there is none, or when libvncserver has to
+// send it because of a resize or CopyRect.
+static BOOL takePendingUpdate(rfbClientPtr cl, sraRegion **region, sraRegion **requested) {
+    *region = NULL;
+    *requested = NULL;
+    pthread_mutex_lock(&cl->updateMutex);
+    if (!cl->newFBSizePending && !cl->requestedDesktopSizeChange && sraRgnEmpty(cl->copyRegion)) {
+        *region = sraRgnCreateRgn(cl->modifiedRegion);
+        if (sraRgnAnd(*region, cl->requestedRegion)) {
+            *requested = sraRgnCreateRgn(cl->requestedRegion);
+            sraRgnSubtract(cl->modifiedRegion, *region);
+            sraRgnMakeEmpty(cl->requestedRegion);
+        } else {
+            sraRgnDestroy(*region);
+            *region = NULL;
+        }
+    }
+    pthread_mutex_unlock(&cl->updateMutex);
+    return *region != NULL;
+}
+
+// Give an update taken by takePendingUpdate back to libvncserver; destroys both regions.
+static void returnPendingUpdate(rfbClientPtr cl, sraRegion *region, sraRegion *requested) {
+    pthread_mutex_lock(&cl->updateMutex);
+    sraRgnOr(cl->modifiedRegion, region);
+    sraRgnOr(cl->requestedRegion, requested);
+    pthread_mutex_unlock(&cl->updateMutex);
+    sraRgnDestroy(requested);
+    sraRgnDestroy(region);
+}
+
+#pragma mark - Raw Updates
+
+// Raw clients whose pixel format is the server's (libvncserver translates with rfbTranslateNone) get their
+// updates written straight from the framebuffer: each rect is a header in the send queue followed by its
+// rows, borrowed from the front buffer, so the pixels are copied once, by the kernel, instead of row by row
+// into updateBuf and out again 32 KB at a time. Full-width rects are one segment. The front buffer stays
+// put while the client's sendMutex is held (swapBuffers and resizes take every client's), and the queue is
+// flushed before displayHook returns. Scaled clients (-m), clients in another format and clients that
+// get the cursor drawn into the framebuffer keep the regular path.
+
+// Output thread, from displayHook (sendMutex held). Returns NO when the client is not eligible; libvncserver
+// then sends the update as usual.
+static BOOL sendRawUpdate(rfbClientPtr cl) {
+    rfbScreenInfoPtr screen = cl->screen;
+    if (cl->preferredEncoding != rfbEncodingRaw || cl->scaledScreen != screen || cl->translateFn != rfbTranslateNone)
+        return NO;
+    if (screen->cursor && !cl->enableCursorShapeUpdates)
+        return NO; // cursor is drawn into the framebuffer for this client
+
+    sraRegion *region = NULL;
+    sraRegion *requested = NULL;
+    if (!takePendingUpdate(cl, &region, &requested))
+        return NO;
+    unsigned long rectCount = sraRgnCountRects(region);
+    if (rectCount > 0xFFFF) {
+        returnPendingUpdate(cl, region, requested);
+        return NO;
+    }
+    sraRgnDestroy(requested);
+
+    const uint8_t *fb = (const uint8_t *)screen->frameBuffer;
+    size_t stride = (size_t)screen->paddedWidthInBytes;
+    int bpp = screen->serverFormat.bitsPerPixel / 8;
+
+    TVSendQueue q;
+    q.own.reserve(sz_rfbFramebufferUpdateMsg + rectCount * sz_rfbFramebufferUpdateRectHeader);
+    uint8_t head[2] = {rfbFramebufferUpdate, 0};
+    sendQueuePush(&q, head, sizeof(head));
+    sendQueuePushU16(&q, (uint16_t)rectCount);
+
+    std::vector<sraRect> rects;
+    rects.reserve(rectCount);
+    sraRectangleIterator *iter = sraRgnGetIterator(region);
+    sraRect r;
+    while (sraRgnIteratorNext(iter, &r)) {
+        sendQueuePushU16(&q, (uint16_t)r.x1);
+        sendQueuePushU16(&q, (uint16_t)r.y1);
+        sendQueuePushU16(&q, (uint16_t)(r.x2 - r.x1));
+        sendQueuePushU16(&q, (uint16_t)(r.y2 - r.y1));
+        uint8_t encoding[4] = {0, 0, 0, rfbEncodingRaw};
+        sendQueuePush(&q, encoding, sizeof(encoding));
+        size_t rowBytes = (size_t)(r.x2 - r.x1) * bpp;
+        for (int y = r.y1; y < r.y2; ++y)
+            sendQueuePushBorrowed(&q, fb + (size_t)y * stride + (size_t)r.x1 * bpp, rowBytes);
+        rects.push_back(r);
+    }
+    sraRgnReleaseIterator(iter);
+    sraRgnDestroy(region);
+
+    if (sendQueueFlush(cl, &q) < 0) {
+        rfbLogPerror("sendRawUpdate: write");
+        rfbCloseClient(cl);
+        return YES;
+    }
+
+    rfbStatRecordMessageSent(cl, rfbFramebufferUpdate, sz_rfbFramebufferUpdateMsg, sz_rfbFramebufferUpdateMsg);
+    for (const sraRect &b : rects) {
+        int bytes = sz_rfbFramebufferUpdateRectHeader + (b.x2 - b.x1) * (b.y2 - b.y1) * bpp;
+        rfbStatRecordEncodingSent(cl, rfbEncodingRaw, bytes, bytes);
+    }
+    return YES;
+}
+
+#pragma mark - Hextile Updates
+
+// With -E, Hextile clients in the server's pixel format are encoded by HextileEncoder.mm, whose colour
+// counts and run scans are vectorized, instead of libvncserver's scalar encoder. The encoder keeps no state
+// between rects, so the whole update is encoded into one buffer that goes to the send queue after the rect
+// count, with the same eligibility as Raw Updates. Everyone else keeps libvncserver's path.
+
+// Output thread, from displayHook (sendMutex held). Returns NO when the client is not eligible.
+static BOOL sendHextileUpdate(rfbClientPtr cl) {
+    rfbScreenInfoPtr screen = cl->screen;
+    if (cl->preferredEncoding != rfbEncodingHextile || cl->scaledScreen != screen ||
+        cl->translateFn != rfbTranslateNone || screen->serverFormat.bitsPerPixel != 32)
+        return NO;
+    if (screen->cursor && !cl->enableCursorShapeUpdates)
+        return NO; // cursor is drawn into the framebuffer for this client
+
+    sraRegion *region = NULL;
+    sraRegion *requested = NULL;
+    if (!takePendingUpdate(cl, &region, &requested))
+        return NO;
+    unsigned long rectCount = sraRgnCountRects(region);
+    if (rectCount > 0xFFFF) {
+        returnPendingUpdate(cl, region, requested);
+        return NO;
+    }
+    sraRgnDestroy(requested);
+
+    const uint8_t *fb = (const uint8_t *)screen->frameBuffer;
+    size_t stride = (size_t)screen->paddedWidthInBytes;
+
+    TVSendQueue q;
+    uint8_t head[2] = {rfbFramebufferUpdate, 0};
+    sendQueuePush(&q, head, sizeof(head));
+    sendQueuePushU16(&q, (uint16_t)rectCount);
+
+    auto encoded = std::make_shared<std::vector<uint8_t>>();
+    std::vector<std::pair<sraRect, size_t>> rects; // rect, encoded bytes including its header
+    rects.reserve(rectCount);
+    sraRectangleIterator *iter = sraRgnGetIterator(region);
+    sraRect r;
+    while (sraRgnIteratorNext(iter, &r)) {
+        size_t before = encoded->size();
+        TVHextileEncodeRect(fb, stride, r.x1, r.y1, r.x2 - r.x1, r.y2 - r.y1, *encoded);
+        rects.push_back({r, encoded->size() - before});
+    }
+    sraRgnReleaseIterator(iter);
+    sraRgnDestroy(region);
+    sendQueuePushShared(&q, encoded, 0);
+
+    if (sendQueueFlush(cl, &q) < 0) {
+        rfbLogPerror("sendHextileUpdate: write");
+        rfbCloseClient(cl);
+        return YES;
+    }
+
+    rfbStatRecordMessageSent(cl, rfbFramebufferUpdate, sz_rfbFramebufferUpdateMsg, sz_rfbFramebufferUpdateMsg);
+    for (const auto &rect : rects) {
+        const sraRect &b = rect.first;
+        int raw = sz_rfbFramebufferUpdateRectHeader + (b.x2 - b.x1) * (b.y2 - b.y1) * 4;
+        rfbStatRecordEncodingSent(cl, rfbEncodingHextile, (int)rect.second, raw);
+    }
+    return YES;
+}
+
+static void logHextileStats(void) {
+    TVHextileStats stats;
+    TVHextileGetStats(&stats);
+    if (stats.rects == 0)
+        return;
+    double mpix = stats.pixels / 1e6;
+    TVLog(@"Hextile encoder: %llu rects, %llu tiles (%llu raw), %.1f MP, %.2f B/px, %.2f ms/MP", stats.rects,
+          stats.tiles, stats.rawTiles, mpix, stats.pixels ? (double)stats.bytes / (double)stats.pixels : 0.0,
+          mpix > 0 ? stats.nanos / 1e6 / mpix : 0.0);
+}
+
+#pragma mark - Shared Encoding
+
+// With -b, Tight clients share encoded rects through a content-addressed cache. Updates are split along
+// 128px cells; each rect is looked up by a hash of its pixels, its size and the encoder parameters, so a
+// rect is encoded once no matter how many clients send it, and a screen that comes back (home screen,
+// app switcher, keyboard) is sent from the cache instead of being encoded again. Encoding uses the
+// stateless encoder in TightEncoder.mm. The cache is an LRU bounded by a share of the process memory
+// limit. Scaled clients (-m), clients without cursor shape updates and other encodings keep the regular
+// libvncserver path.
+//
+// On top of the LRU, the whole-cell rects of the current screen are kept as a keyframe per parameter set,
+// outside the budget, so a client that joins (or a burst of clients reconnecting) gets its first full
+// update without encoding even after incremental updates pushed those rects out of the LRU. Dirty tiles
+// drop keyframe cells; every cell is still checked against its content hash before it is used.
+
+// Cache key: the tile hash of the tiler is sampled sparsely, so rects are hashed in full here. Two CRCs
+// with different polynomials make a 64-bit hash on ARM.
+typedef struct TVSharedKey {
+    uint64_t content; // hash of the rect's pixels
+    uint64_t shape;   // rect size and encoder parameters
+    bool operator==(const TVSharedKey &o) const { return content == o.content && shape == o.shape; }
+} TVSharedKey;
+
+struct TVSharedKeyHash {
+    size_t operator()(const TVSharedKey &k) const { return (size_t)(k.content ^ (k.shape * 0x9E3779B97F4A7C15ULL)); }
+};
+
+typedef struct {
+    BOOL ready;                                  // NO while the creating client is still encoding
+    std::shared_ptr<std::vector<uint8_t>> bytes; // rect header + Tight data (header of the first use)
+    std::list<TVSharedKey>::iterator lru;        // position in gSharedLru once ready
+} TVSharedEntry;
+
+static pthread_mutex_t gSharedLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gSharedCond = PTHREAD_COND_INITIALIZER; // signalled when an entry is completed
+static std::unordered_map<TVSharedKey, TVSharedEntry, TVSharedKeyHash> gSharedCache;
+static std::list<TVSharedKey> gSharedLru; // ready entries, most recently used first
+static size_t gSharedCacheBytes = 0;
+static size_t gSharedCacheBudget = cSharedBudgetMinBytes; // set by setupRfbSharedEncoding
+
+typedef struct {
+    uint64_t content;                            // hash of the cell's pixels the bytes were encoded from
+    std::shared_ptr<std::vector<uint8_t>> bytes; // NULL until sent once, or after the cell got dirty
+} TVKeyframeCell;
+
+typedef struct {
+    uint64_t shape;                    // encoder parameters (sharedShapeKey with an empty size)
+    int cellsX, cellsY;                // cell grid the cells were stored for
+    double lastUsed;                   // for replacing the least recently used parameter set
+    std::vector<TVKeyframeCell> cells; // row-major, cellsX * cellsY
+} TVKeyframe;
+
+static std::vector<TVKeyframe> gSharedKeyframes; // at most cSharedKeyframeConfigs
+
+// Counters, guarded by gSharedLock
+static uint64_t gSharedHits = 0;      // rects sent from the cache
+static uint64_t gSharedKeyHits = 0;   // whole cells sent from a keyframe (not counted above)
+static uint64_t gSharedJoins = 0;     // rects another client was encoding at the time (counted as hits too)
+static uint64_t gSharedMisses = 0;    // rects encoded
+static uint64_t gSharedEvictions = 0; // entries dropped for the budget
+static CFAbsoluteTime gSharedLastStatsLog = 0;
+
+#if defined(__aarch64__) || defined(__ARM_FEATURE_CRC32)
+NS_INLINE uint32_t crc32c_update(uint32_t c, const uint8_t *p, size_t n) {
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = __builtin_arm_crc32cd(c, v);
+        p += 8;
+        n -= 8;
+    }
+    while (n--)
+        c = __builtin_arm_crc32cb(c, *p++);
+    return c;
+}
+#endif
+
+NS_INLINE uint64_t sharedContentHash(const uint8_t *fb, size_t stride, int x, int y, int w, int h) {
+    size_t rowBytes = (size_t)w * 4;
+#if defined(__aarch64__) || defined(__ARM_FEATURE_CRC32)
+    uint64_t a = 0;
+    uint32_t b = 0;
+    for (int r = 0; r < h; ++r) {
+        const uint8_t *row = fb + (size_t)(y + r) * stride + (size_t)x * 4;
+        a = crc32_update(a, row, rowBytes);
+        b = crc32c_update(b, row, rowBytes);
+    }
+    return a << 32 | b;
+#else
+    uint64_t a = fnv1a_basis();
+    for (int r = 0; r < h; ++r)
+        a = fnv1a_update(a, fb + (size_t)(y + r) * stride + (size_t)x * 4, rowBytes);
+    return a;
+#endif
+}
+
+NS_INLINE uint64_t sharedShapeKey(int w, int h, const TVTightParams *p) {
+    return (uint64_t)w << 48 | (uint64_t)h << 32 | (uint64_t)(p->jpegQuality + 1) << 16 |
+           (uint64_t)p->jpegSubsamp << 8 | (uint64_t)p->zlibLevel;
+}
+
+// Called with gSharedLock held.
+static void maybeLogSharedStats(BOOL force) {
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    if (!force && now - gSharedLastStatsLog < cSharedStatsLogSec)
+        return;
+    gSharedLastStatsLog = now;
+    uint64_t lookups = gSharedHits + gSharedMisses;
+    double hitPct = lookups ? 100.0 * (double)gSharedHits / (double)lookups : 0.0;
+    NSString *line = [NSString
+        stringWithFormat:@"Shared encoding: %.1f%% hits (%llu hits, %llu joined, %llu encoded), %llu keyframe cells, "
+                         @"%zu entries, %.1f/%.0f MB, %llu evicted",
+                         hitPct, gSharedHits, gSharedJoins, gSharedMisses, gSharedKeyHits, gSharedLru.size(),
+                         gSharedCacheBytes / 1048576.0, gSharedCacheBudget / 1048576.0, gSharedEvictions];
+
+    // Encoder cost per kind of rect, for profiling without the libvncserver encoders in the way
+    static NSString *const kindNames[TVTightKindCount] = {@"fill", @"palette", @"full", @"jpeg"};
+    TVTightKindStats kinds[TVTightKindCount];
+    TVTightGetStats(kinds);
+    NSMutableString *encoders = [NSMutableString stringWithString:@"Tight encoder:"];
+    for (int k = 0; k < TVTightKindCount; ++k) {
+        double mpix = kinds[k].pixels / 1e6;
+        [encoders appendFormat:@" %@ %llu rects %.1f MP %.2f B/px %.2f ms/MP;", kindNames[k], kinds[k].rects, mpix,
+                               kinds[k].pixels ? (double)kinds[k].bytes / (double)kinds[k].pixels : 0.0,
+                               mpix > 0 ? kinds[k].nanos / 1e6 / mpix : 0.0];
+    }
+
+    if (force) {
+        TVLog(@"%@", line);
+        TVLog(@"%@", encoders);
+    } else {
+        TVLogVerbose(@"%@", line);
+        TVLogVerbose(@"%@", encoders);
+    }
+}
+
+static void logSharedEncodingStats(void) {
+    pthread_mutex_lock(&gSharedLock);
+    maybeLogSharedStats(YES);
+    pthread_mutex_unlock(&gSharedLock);
+}
+
+// Encoded bytes of one rect whose pixels hash to content: from the cache, or encoded now and cached. The
+// rect header in the bytes is that of the first use; callers write their own. NULL if encoding failed.
+// *stable (optional) tells whether the bytes are known to match content: NO when the pixels changed while
+// they were encoded, in which case they are current enough to send but must not be kept under content.
+static std::shared_ptr<std::vector<uint8_t>> sharedEncodeRect(rfbScreenInfoPtr screen, int x, int y, int w, int h,
+                                                              const TVTightParams *params, uint64_t content,
+                                                              BOOL *stable) {
+    if (stable)
+        *stable = YES;
+    const uint8_t *fb = (const uint8_t *)screen->frameBuffer;
+    size_t stride = (size_t)screen->paddedWidthInBytes;
+    TVSharedKey key = {content, sharedShapeKey(w, h, params)};
+
+    pthread_mutex_lock(&gSharedLock);
+    BOOL joined = NO;
+    for (;;) {
+        auto it = gSharedCache.find(key);
+        if (it == gSharedCache.end())
+            break;
+        if (it->second.ready) {
+            gSharedLru.splice(gSharedLru.begin(), gSharedLru, it->second.lru);
+            gSharedHits++;
+            if (joined)
+                gSharedJoins++;
+            std::shared_ptr<std::vector<uint8_t>> bytes = it->second.bytes;
+            maybeLogSharedStats(NO);
+            pthread_mutex_unlock(&gSharedLock);
+            return bytes;
+        }
+        // Another client is encoding the same pixels; wait for its bytes
+        joined = YES;
+        pthread_cond_wait(&gSharedCond, &gSharedLock);
+    }
+    TVSharedEntry pending = {NO, nullptr, gSharedLru.end()};
+    gSharedCache[key] = pending;
+    gSharedMisses++;
+    pthread_mutex_unlock(&gSharedLock);
+
+    auto bytes = std::make_shared<std::vector<uint8_t>>();
+    bool ok = TVTightEncodeRect(fb, stride, x, y, w, h, params, *bytes);
+    // Pixels that changed while encoding (copies outside the client locks) must not be cached under the key
+    BOOL unchanged = ok && sharedContentHash(fb, stride, x, y, w, h) == key.content;
+    if (stable)
+        *stable = unchanged;
+
+    pthread_mutex_lock(&gSharedLock);
+    auto it = gSharedCache.find(key);
+    if (unchanged) {
+        it->second.ready = YES;
+        it->second.bytes = bytes;
+        gSharedLru.push_front(key);
+        it->second.lru = gSharedLru.begin();
+        gSharedCacheBytes += bytes->size();
+        while (gSharedCacheBytes > gSharedCacheBudget && gSharedLru.size() > 1) {
+            auto victim = gSharedCache.find(gSharedLru.back());
+            gSharedCacheBytes -= victim->second.bytes->size();
+            gSharedCache.erase(victim);
+            gSharedLru.pop_back();
+            gSharedEvictions++;
+        }
+    } else {
+        gSharedCache.erase(it);
+    }
+    pthread_cond_broadcast(&gSharedCond);
+    pthread_mutex_unlock(&gSharedLock);
+    return ok ? bytes : nullptr;
+}
+
+// Keyframe of a parameter set for the given cell grid; replaces the least recently used set when all are
+// taken. Called with gSharedLock held.
+static TVKeyframe *sharedKeyframeFor(const TVTightParams *params, int cellsX, int cellsY) {
+    uint64_t shape = sharedShapeKey(0, 0, params);
+    TVKeyframe *kf = NULL;
+    for (TVKeyframe &k : gSharedKeyframes) {
+        if (k.shape == shape) {
+            kf = &k;
+            break;
+        }
+    }
+    if (!kf) {
+        if ((int)gSharedKeyframes.size() < cSharedKeyframeConfigs) {
+            gSharedKeyframes.emplace_back();
+            kf = &gSharedKeyframes.back();
+        } else {
+            kf = &gSharedKeyframes[0];
+            for (TVKeyframe &k : gSharedKeyframes) {
+                if (k.lastUsed < kf->lastUsed)
+                    kf = &k;
+            }
+        }
+        kf->shape = shape;
+        kf->cells.clear();
+    }
+    if (kf->cellsX != cellsX || kf->cellsY != cellsY || kf->cells.empty()) {
+        kf->cellsX = cellsX;
+        kf->cellsY = cellsY;
+        kf->cells.assign((size_t)cellsX * (size_t)cellsY, TVKeyframeCell{0, nullptr});
+    }
+    kf->lastUsed = CFAbsoluteTimeGetCurrent();
+    return kf;
+}
+
+// Encoded bytes of a whole cell: from the keyframe when it still matches the pixels, otherwise through the
+// cache, and kept in the keyframe for the next client unless the pixels changed during the encode.
+static std::shared_ptr<std::vector<uint8_t>> sharedEncodeCell(rfbScreenInfoPtr screen, int cell, int cellsX,
+                                                              int cellsY, const sraRect &b,
+                                                              const TVTightParams *params, uint64_t content) {
+    pthread_mutex_lock(&gSharedLock);
+    TVKeyframeCell &kc = sharedKeyframeFor(params, cellsX, cellsY)->cells[cell];
+    if (kc.bytes && kc.content == content) {
+        std::shared_ptr<std::vector<uint8_t>> bytes = kc.bytes;
+        gSharedKeyHits++;
+        pthread_mutex_unlock(&gSharedLock);
+        return bytes;
+    }
+    pthread_mutex_unlock(&gSharedLock);
+
+    BOOL stable = NO;
+    auto bytes = sharedEncodeRect(screen, b.x1, b.y1, b.x2 - b.x1, b.y2 - b.y1, params, content, &stable);
+    if (bytes && stable) {
+        pthread_mutex_lock(&gSharedLock);
+        sharedKeyframeFor(params, cellsX, cellsY)->cells[cell] = TVKeyframeCell{content, bytes};
+        pthread_mutex_unlock(&gSharedLock);
+    }
+    return bytes;
+}
+
+// Main thread, after dirty rects were published: drop the keyframe cells they touch.
+static void invalidateSharedKeyframes(const DirtyRect *rects, int rectCount) {
+    pthread_mutex_lock(&gSharedLock);
+    for (TVKeyframe &kf : gSharedKeyframes) {
+        for (int i = 0; i < rectCount; ++i) {
+            const DirtyRect &r = rects[i];
+            if (r.w <= 0 || r.h <= 0)
+                continue;
+            int cx2 = MIN((r.x + r.w - 1) >> cSharedCellShift, kf.cellsX - 1);
+            int cy2 = MIN((r.y + r.h - 1) >> cSharedCellShift, kf.cellsY - 1);
+            for (int cy = r.y >> cSharedCellShift; cy <= cy2; ++cy) {
+                for (int cx = r.x >> cSharedCellShift; cx <= cx2; ++cx)
+                    kf.cells[(size_t)cy * kf.cellsX + cx].bytes = nullptr;
+            }
+        }
+    }
+    pthread_mutex_unlock(&gSharedLock);
+}
+
+// Output thread, from displayHook (sendMutex held): send the client's pending update from shared rects.
+// Afterwards libvncserver finds nothing left to send except pseudo-encodings (cursor etc.). Returns NO
+// when the client is not eligible or encoding failed; libvncserver then sends the update as usual.
+static BOOL sendSharedEncodedUpdate(rfbClientPtr cl) {
+    rfbScreenInfoPtr screen = cl->screen;
+    if (cl->preferredEncoding != rfbEncodingTight || cl->scaledScreen != screen || !TVTightFormatSupported(&cl->format))
+        return NO;
+    if (screen->cursor && !cl->enableCursorShapeUpdates)
+        return NO; // cursor is drawn into the framebuffer for this client
+
+    sraRegion *region = NULL;
+    sraRegion *requested = NULL;
+    if (!takePendingUpdate(cl, &region, &requested))
+        return NO;
+
+    // Parameters as left by the quality overrides of displayHook
+    TVTightParams params;
+    params.jpegQuality = (cl->turboQualityLevel >= 1 && cl->turboQualityLevel <= 100) ? cl->turboQualityLevel : -1;
+    params.jpegSubsamp = (cl->turboSubsampLevel >= cTurboSubsamp444 && cl->turboSubsampLevel <= cTurboSubsampGray)
+                             ? cl->turboSubsampLevel
+                             : cTurboSubsamp444;
+    params.zlibLevel = MIN(MAX(cl->tightCompressLevel, 0), 9);
+
+    // Bounding box of the update within each cell
+    int cell = 1 << cSharedCellShift;
+    int cellsX = (screen->width + cell - 1) >> cSharedCellShift;
+    int cellsY = (screen->height + cell - 1) >> cSharedCellShift;
+    std::vector<sraRect> boxes((size_t)cellsX * (size_t)cellsY, sraRect{INT_MAX, INT_MAX, 0, 0});
+    sraRectangleIterator *iter = sraRgnGetIterator(region);
+    sraRect r;
+    while (sraRgnIteratorNext(iter, &r)) {
+        for (int cy = r.y1 >> cSharedCellShift; cy <= (r.y2 - 1) >> cSharedCellShift && cy < cellsY; ++cy) {
+            for (int cx = r.x1 >> cSharedCellShift; cx <= (r.x2 - 1) >> cSharedCellShift && cx < cellsX; ++cx) {
+                sraRect &b = boxes[(size_t)cy * cellsX + cx];
+                b.x1 = MIN(b.x1, MAX(r.x1, cx * cell));
+                b.y1 = MIN(b.y1, MAX(r.y1, cy * cell));
+                b.x2 = MAX(b.x2, MIN(r.x2, (cx + 1) * cell));
+                b.y2 = MAX(b.y2, MIN(r.y2, (cy + 1) * cell));
+            }
+        }
+    }
+    sraRgnReleaseIterator(iter);
+
+    const uint8_t *fb = (const uint8_t *)screen->frameBuffer;
+    size_t stride = (size_t)screen->paddedWidthInBytes;
+    std::vector<std::pair<sraRect, std::shared_ptr<std::vector<uint8_t>>>> parts;
+    BOOL ok = YES;
+    for (int i = 0; i < cellsX * cellsY; ++i) {
+        const sraRect &b = boxes[i];
+        if (b.x2 <= b.x1 || b.y2 <= b.y1)
+            continue;
+        int cx = i % cellsX, cy = i / cellsX;
+        BOOL wholeCell = b.x1 == cx * cell && b.y1 == cy * cell && b.x2 == MIN((cx + 1) * cell, screen->width) &&
+                         b.y2 == MIN((cy + 1) * cell, screen->height);
+        uint64_t content = sharedContentHash(fb, stride, b.x1, b.y1, b.x2 - b.x1, b.y2 - b.y1);
+        auto bytes = wholeCell ? sharedEncodeCell(screen, i, cellsX, cellsY, b, &params, content)
+                               : sharedEncodeRect(screen, b.x1, b.y1, b.x2 - b.x1, b.y2 - b.y1, &params, content, NULL);
+        if (!bytes) {
+            ok = NO;
+            break;
+        }
+        parts.emplace_back(b, bytes);
+    }
+
+    if (!ok || parts.empty()) {
+        returnPendingUpdate(cl, region, requested);
+        return NO;
+    }
+    sraRgnDestroy(requested);
+    sraRgnDestroy(region);
+
+    TVSendQueue q;
+    q.own.reserve(sz_rfbFramebufferUpdateMsg + parts.size() * 8);
+    q.segments.reserve(parts.size() * 2 + 1);
+    uint8_t head[2] = {rfbFramebufferUpdate, 0};
+    sendQueuePush(&q, head, sizeof(head));
+    sendQueuePushU16(&q, (uint16_t)parts.size());
+    for (const auto &part : parts) {
+        // Rect header (x, y, w, h, encoding; big-endian) for this position, then the cached Tight data
+        const sraRect &b = part.first;
+        sendQueuePushU16(&q, (uint16_t)b.x1);
+        sendQueuePushU16(&q, (uint16_t)b.y1);
+        sendQueuePushU16(&q, (uint16_t)(b.x2 - b.x1));
+        sendQueuePushU16(&q, (uint16_t)(b.y2 - b.y1));
+        sendQueuePushShared(&q, part.second, 8);
+    }
+
+    if (sendQueueFlush(cl, &q) < 0) {
+        rfbLogPerror("sendSharedEncodedUpdate: write");
+        rfbCloseClient(cl);
+        return YES;
+    }
+
+    rfbStatRecordMessageSent(cl, rfbFramebufferUpdate, sz_rfbFramebufferUpdateMsg, sz_rfbFramebufferUpdateMsg);
+    for (const auto &part : parts) {
+        const sraRect &b = part.first;
+        rfbStatRecordEncodingSent(cl, rfbEncodingTight, (int)part.second->size(),
+                                  sz_rfbFramebufferUpdateRectHeader +
+                                      (b.x2 - b.x1) * (b.y2 - b.y1) * (cl->format.bitsPerPixel / 8));
+    }
+    return YES;
+}
+
+#pragma mark - Open H.264
+
+// With -x, clients that list the Open H.264 encoding (50) in SetEncodings get every update as one H.264
+// frame of the whole framebuffer, from a VideoToolbox encoder of their own (see H264Encoder.mm). Video,
+// games and scrolling then cost a fraction of the bandwidth of tile encodings. Frames only go out for
+// full-screen requests; partial requests, scaled clients (-m) and clients without cursor shape updates
+// fall back to the tile encodings, as do clients that never listed the encoding.
+//
+// Keyframes: the first frame of an encoder (which also resets the client's decoder), a non-incremental
+// request, and at least every cH264KeyframeSec. The bit rate follows the link statistics: it drops to the
+// measured delivery rate while a backlog builds up and creeps back up while the socket drains freely.
+
+static const int cOpenH264Encoding = 50;
+
+// Rect data flag of the Open H.264 encoding; updates always carry one full-screen rect, so a new encoder
+// resets all of the client's decoder contexts rather than the one of a rect (ResetContext = 1)
+static const uint32_t cH264ResetAllContexts = 2;
+
+static int gH264PseudoEncodings[] = {cOpenH264Encoding, 0};
+
+// Input thread, from SetEncodings. 0 means the client's encoding list starts over. Once enabled, the
+// extension also sees encodings of other extensions (-u); those leave the state alone.
+static rfbBool h264EnablePseudoEncoding(rfbClientPtr cl, void **data, int encodingNumber) {
+    (void)data;
+    if (encodingNumber != 0 && encodingNumber != cOpenH264Encoding)
+        return FALSE;
+    TVClientState *st = tvGetClientState(cl);
+    if (st)
+        st->h264Supported = encodingNumber == cOpenH264Encoding;
+    return encodingNumber == cOpenH264Encoding;
+}
+
+static rfbProtocolExtension gH264Extension = {
+    .pseudoEncodings = gH264PseudoEncodings,
+    .enablePseudoEncoding = h264EnablePseudoEncoding,
+};
+
+// Output thread: follow the link at most once per cH264RateAdjustSec.
+static void adjustH264BitRate(TVClientState *st, double now) {
+    if (now - st->h264LastAdjust < cH264RateAdjustSec)
+        return;
+    st->h264LastAdjust = now;
+
+    double drainSec = 0, queueDelay = 0;
+    linkSnapshot(st, &drainSec, &queueDelay);
+    double deliveredBits = st->link.throughput * 8.0;
+
+    double rate = st->h264BitRate;
+    if (drainSec > cH264DrainHighSec) {
+        rate *= cH264RateStepDown;
+        if (deliveredBits > 0)
+            rate = MIN(rate, deliveredBits * cH264RateHeadroom);
+    } else if (drainSec < cH264DrainLowSec) {
+        rate *= cH264RateStepUp;
+    }
+    int bitRate = (int)MIN(MAX(rate, (double)cH264MinBitRate), (double)cH264MaxBitRate);
+    if (bitRate == st->h264BitRate)
+        return;
+
+    TVLogVerbose(@"Client %s: H.264 bit rate %d -> %d kbit/s (drain %.0f ms, delivered %.0f kbit/s)", st->clientId8,
+                 st->h264BitRate / 1000, bitRate / 1000, drainSec * 1000.0, deliveredBits / 1000.0);
+    st->h264BitRate = bitRate;
+    TVH264EncoderSetBitRate(st->h264, bitRate);
+}
+
+// Output thread, from displayHook (sendMutex held): send the client's pending update as one H.264 frame.
+// Returns NO when the client is not eligible or encoding failed; libvncserver then sends the update as
+// usual.
+static BOOL sendH264Update(rfbClientPtr cl, TVClientState *st) {
+    rfbScreenInfoPtr screen = cl->screen;
+    if (!st->h264Supported || cl->scaledScreen != screen)
+        return NO;
+    if (screen->cursor && !cl->enableCursorShapeUpdates)
+        return NO; // cursor is drawn into the framebuffer for this client
+
+    // The frame replaces the whole framebuffer, so it needs a request that covers all of it
+    sraRegion *modified = NULL;
+    sraRegion *requested = NULL;
+    BOOL keyframe = NO;
+    pthread_mutex_lock(&cl->updateMutex);
+    if (!cl->newFBSizePending && !cl->requestedDesktopSizeChange && sraRgnEmpty(cl->copyRegion)) {
+        sraRegion *uncovered = sraRgnCreateRect(0, 0, screen->width, screen->height);
+        sraRgnSubtract(uncovered, cl->requestedRegion);
+        sraRegion *pending = sraRgnCreateRgn(cl->modifiedRegion);
+        if (sraRgnEmpty(uncovered) && sraRgnAnd(pending, cl->requestedRegion)) {
+            modified = sraRgnCreateRgn(cl->modifiedRegion);
+            requested = sraRgnCreateRgn(cl->requestedRegion);
+            sraRgnMakeEmpty(cl->modifiedRegion);
+            sraRgnMakeEmpty(cl->requestedRegion);
+            keyframe = st->h264Keyframe;
+            st->h264Keyframe = NO;
+        }
+        sraRgnDestroy(pending);
+        sraRgnDestroy(uncovered);
+    }
+    pthread_mutex_unlock(&cl->updateMutex);
+    if (!modified)
+        return NO;
+
+    // A new geometry needs a new encoder (and a new decoder context on the client)
+    if (st->h264 &&
+        (TVH264EncoderWidth(st->h264) != screen->width || TVH264EncoderHeight(st->h264) != screen->height)) {
+        TVH264EncoderDestroy(st->h264);
+        st->h264 = NULL;
+    }
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    if (!st->h264) {
+        if (st->h264BitRate <= 0)
+            st->h264BitRate = cH264StartBitRate;
+        st->h264 = TVH264EncoderCreate(screen->width, screen->height, st->h264BitRate, cH264KeyframeSec);
+        if (!st->h264) {
+            TVLog(@"Client %s: no H.264 encoder for %dx%d; using tile encodings", st->clientId8, screen->width,
+                  screen->height);
+            st->h264Supported = NO;
+        }
+        st->h264Fresh = YES;
+        st->h264LastAdjust = now;
+    } else {
+        adjustH264BitRate(st, now);
+    }
+
+    std::vector<uint8_t> msg;
+    BOOL ok = st->h264 != NULL;
+    if (ok) {
+        uint32_t flags = st->h264Fresh ? cH264ResetAllContexts : 0;
+        uint16_t geom[4] = {0, 0, (uint16_t)screen->width, (uint16_t)screen->height};
+        msg.reserve(sz_rfbFramebufferUpdateMsg + sz_rfbFramebufferUpdateRectHeader + 8 +
+                    (size_t)st->h264BitRate / 8);
+        msg.push_back(rfbFramebufferUpdate);
+        msg.push_back(0);
+        msg.push_back(0);
+        msg.push_back(1);
+        for (uint16_t v : geom) {
+            msg.push_back((uint8_t)(v >> 8));
+            msg.push_back((uint8_t)v);
+        }
+        uint32_t words[3] = {(uint32_t)cOpenH264Encoding, 0 /* length */, flags};
+        for (uint32_t v : words) {
+            msg.push_back((uint8_t)(v >> 24));
+            msg.push_back((uint8_t)(v >> 16));
+            msg.push_back((uint8_t)(v >> 8));
+            msg.push_back((uint8_t)v);
+        }
+
+        size_t dataStart = msg.size();
+        bool isKeyframe = false;
+        ok = TVH264EncodeFrame(st->h264, (const uint8_t *)screen->frameBuffer, (size_t)screen->paddedWidthInBytes,
+                               st->h264Fresh || keyframe, msg, &isKeyframe);
+        if (ok) {
+            uint32_t length = (uint32_t)(msg.size() - dataStart);
+            uint8_t *p = msg.data() + dataStart - 8;
+            p[0] = (uint8_t)(length >> 24);
+            p[1] = (uint8_t)(length >> 16);
+            p[2] = (uint8_t)(length >> 8);
+            p[3] = (uint8_t)length;
+            if (isKeyframe)
+                TVLogVerbose(@"Client %s: H.264 keyframe %u bytes", st->clientId8, length);
+        }
+    }
+
+    if (!ok) {
+        // Give the update back to libvncserver; the next frame is a keyframe in case this one was lost
+        pthread_mutex_lock(&cl->updateMutex);
+        sraRgnOr(cl->modifiedRegion, modified);
+        sraRgnOr(cl->requestedRegion, requested);
+        st->h264Keyframe = YES;
+        pthread_mutex_unlock(&cl->updateMutex);
+        sraRgnDestroy(requested);
+        sraRgnDestroy(modified);
+        return NO;
+    }
+    sraRgnDestroy(requested);
+    sraRgnDestroy(modified);
+    st->h264Fresh = NO;
+
+    if (rfbWriteExact(cl, (const char *)msg.data(), (int)msg.size()) < 0) {
+        rfbLogPerror("sendH264Update: write");
+        rfbCloseClient(cl);
+        return YES;
+    }
+
+    rfbStatRecordMessageSent(cl, rfbFramebufferUpdate, sz_rfbFramebufferUpdateMsg, sz_rfbFramebufferUpdateMsg);
+    rfbStatRecordEncodingSent(cl, cOpenH264Encoding, (int)msg.size() - sz_rfbFramebufferUpdateMsg,
+                              sz_rfbFramebufferUpdateRectHeader +
+                                  screen->width * screen->height * (cl->format.bitsPerPixel / 8));
+    return YES;
+}
+
+#pragma mark - Continuous Updates
+
+// With -u, clients that list the ContinuousUpdates and Fence pseudo-encodings can ask for an area to be kept
+// current (EnableContinuousUpdates). Their updates then go out as soon as handleFramebuffer publishes dirty
+// rects instead of one round trip later with the next FramebufferUpdateRequest: every update that uses up
+// the requested region re-arms it with that area.
+//
+// Pacing: each continuous update is followed by a fence (BlockBefore) that the client answers once it has
+// processed the update. Bytes not yet confirmed that way are in flight and must fit the client's window;
+// when they do not, the request stays disarmed until the next answer. The window grows by the confirmed
+// bytes while it held updates back, and shrinks by a quarter, at most once per round trip, while the fence
+// round trip runs cContinuousQueueDelaySec above its baseline, i.e. while data queues on the way.
+//
+// Fences from the client are answered right away. Messages are handled in order, so BlockBefore and
+// BlockAfter hold as they are; SyncNext is not supported and left out of the answer.
+
+static const int cFenceEncoding = -312;
+static const int cContinuousUpdatesEncoding = -313;
+static const uint8_t cFenceMsg = 248;
+static const uint8_t cContinuousUpdatesMsg = 150; // EnableContinuousUpdates, EndOfContinuousUpdates
+
+// Fence flags
+static const uint32_t cFenceBlockBefore = 1u << 0;
+static const uint32_t cFenceBlockAfter = 1u << 1;
+static const uint32_t cFenceRequest = 1u << 31;
+static const int cFenceMaxPayload = 64;
+
+static int gContinuousPseudoEncodings[] = {cFenceEncoding, cContinuousUpdatesEncoding, 0};
+
+// sendMutex held.
+static BOOL writeFence(rfbClientPtr cl, uint32_t flags, const uint8_t *payload, uint8_t length) {
+    uint8_t msg[9 + cFenceMaxPayload] = {cFenceMsg, 0, 0, 0, (uint8_t)(flags >> 24), (uint8_t)(flags >> 16),
+                                         (uint8_t)(flags >> 8), (uint8_t)flags, length};
+    if (length > 0)
+        memcpy(msg + 9, payload, length);
+    if (rfbWriteExact(cl, (const char *)msg, 9 + length) < 0) {
+        rfbLogPerror("writeFence: write");
+        rfbCloseClient(cl);
+        return NO;
+    }
+    rfbStatRecordMessageSent(cl, cFenceMsg, 9 + length, 9 + length);
+    return YES;
+}
+
+// sendMutex held.
+static BOOL writeEndOfContinuousUpdates(rfbClientPtr cl) {
+    if (rfbWriteExact(cl, (const char *)&cContinuousUpdatesMsg, 1) < 0) {
+        rfbLogPerror("writeEndOfContinuousUpdates: write");
+        rfbCloseClient(cl);
+        return NO;
+    }
+    rfbStatRecordMessageSent(cl, cContinuousUpdatesMsg, 1, 1);
+    return YES;
+}
+
+// Input thread: read the rest of a message whose type libvncserver already consumed.
+static BOOL readMessageBody(rfbClientPtr cl, uint8_t *buf, int len) {
+    int n = rfbReadExact(cl, (char *)buf, len);
+    if (n <= 0) {
+        if (n != 0)
+            rfbLogPerror("readMessageBody: read");
+        rfbCloseClient(cl);
+        return NO;
+    }
+    return YES;
+}
+
+// cl->updateMutex held: put the continuous area back into the requested region if the window has room,
+// otherwise leave that to the next fence answer. Returns YES when re-armed.
+static BOOL continuousRearm(rfbClientPtr cl, TVClientState *st) {
+    uint32_t inFlight = st->cuSent - st->cuAcked;
+    if (st->cuPingCount > 0 && (double)inFlight >= st->cuWindow) {
+        st->cuHeld = YES;
+        st->cuLimited = YES;
+        return NO;
+    }
+    st->cuHeld = NO;
+    sraRgnOr(cl->requestedRegion, st->cuRegion);
+    return YES;
+}
+
+// Input thread: a fence that followed an update came back, so the client has processed everything up to it.
+static void continuousFenceAnswered(rfbClientPtr cl, TVClientState *st, uint32_t seq) {
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    double rtt = -1;
+
+    pthread_mutex_lock(&cl->updateMutex);
+    // Answers come in order; fences older than seq that are still waiting were skipped by the client
+    while (st->cuPingCount > 0) {
+        TVFencePing ping = st->cuPings[st->cuPingHead];
+        st->cuPingHead = (st->cuPingHead + 1) % cFenceMaxInFlight;
+        st->cuPingCount--;
+        if (ping.seq != seq)
+            continue;
+
+        rtt = now - ping.sentAt;
+        uint32_t acked = ping.sent - st->cuAcked;
+        st->cuAcked = ping.sent;
+
+        // Let the baseline follow route changes slowly
+        if (st->cuRttMin <= 0 || rtt < st->cuRttMin)
+            st->cuRttMin = rtt;
+        else
+            st->cuRttMin += (rtt - st->cuRttMin) * 0.01;
+
+        if (rtt - st->cuRttMin > cContinuousQueueDelaySec) {
+            if (now - st->cuLastDecrease > rtt) {
+                st->cuWindow = MAX(st->cuWindow * cContinuousWindowDecrease, cContinuousMinWindow);
+                st->cuLastDecrease = now;
+            }
+        } else if (st->cuLimited) {
+            st->cuWindow = MIN(st->cuWindow + (double)acked, cContinuousMaxWindow);
+            st->cuLimited = NO;
+        }
+        break;
+    }
+    if (st->cuEnabled && st->cuHeld && continuousRearm(cl, st))
+        pthread_cond_signal(&cl->updateCond);
+    pthread_mutex_unlock(&cl->updateMutex);
+
+    if (rtt >= 0 && isLinkStatsEnabled())
+        linkFenceAnswered(st, rtt);
+}
+
+// Input thread, ClientFence.
+static void handleClientFence(rfbClientPtr cl) {
+    uint8_t head[8]; // padding[3], flags, length
+    if (!readMessageBody(cl, head, sizeof(head)))
+        return;
+    uint32_t flags = ((uint32_t)head[3] << 24) | ((uint32_t)head[4] << 16) | ((uint32_t)head[5] << 8) | head[6];
+    uint8_t length = head[7];
+    if (length > cFenceMaxPayload) {
+        rfbLog("handleClientFence: payload of %d bytes is too long\n", length);
+        rfbCloseClient(cl);
+        return;
+    }
+    uint8_t payload[cFenceMaxPayload];
+    if (length > 0 && !readMessageBody(cl, payload, length))
+        return;
+
+    if (flags & cFenceRequest) {
+        pthread_mutex_lock(&cl->sendMutex);
+        writeFence(cl, flags & (cFenceBlockBefore | cFenceBlockAfter), payload, length);
+        pthread_mutex_unlock(&cl->sendMutex);
+        return;
+    }
+
+    // Answers to our announcement carry no payload; those to update fences carry their sequence number
+    TVClientState *st = tvGetClientState(cl);
+    if (st && length == sizeof(uint32_t)) {
+        uint32_t seq = ((uint32_t)payload[0] << 24) | ((uint32_t)payload[1] << 16) | ((uint32_t)payload[2] << 8) |
+                       payload[3];
+        continuousFenceAnswered(cl, st, seq);
+    }
+}
+
+// Input thread, EnableContinuousUpdates. Turning them off is confirmed with EndOfContinuousUpdates.
+static void handleEnableContinuousUpdates(rfbClientPtr cl) {
+    uint8_t body[9]; // enable, x, y, width, height
+    if (!readMessageBody(cl, body, sizeof(body)))
+        return;
+    TVClientState *st = tvGetClientState(cl);
+    if (!st)
+        return;
+
+    BOOL enable = body[0] != 0;
+    int x1 = (body[1] << 8) | body[2];
+    int y1 = (body[3] << 8) | body[4];
+    int x2 = x1 + ((body[5] << 8) | body[6]);
+    int y2 = y1 + ((body[7] << 8) | body[8]);
+
+    // The area is given in the client's (possibly scaled, -m) screen
+    rfbScreenInfoPtr screen = cl->screen;
+    rfbScreenInfoPtr scaled = cl->scaledScreen;
+    if (scaled && scaled != screen && scaled->width > 0 && scaled->height > 0) {
+        x1 = x1 * screen->width / scaled->width;
+        y1 = y1 * screen->height / scaled->height;
+        x2 = (x2 * screen->width + scaled->width - 1) / scaled->width;
+        y2 = (y2 * screen->height + scaled->height - 1) / scaled->height;
+    }
+    x2 = MIN(x2, screen->width);
+    y2 = MIN(y2, screen->height);
+
+    pthread_mutex_lock(&cl->updateMutex);
+    if (!st->cuSupported) {
+        pthread_mutex_unlock(&cl->updateMutex);
+        TVLog(@"Client %s: EnableContinuousUpdates without ContinuousUpdates in SetEncodings; ignored",
+              st->clientId8);
+        return;
+    }
+    BOOL wasEnabled = st->cuEnabled;
+    if (st->cuRegion) {
+        sraRgnDestroy(st->cuRegion);
+        st->cuRegion = NULL;
+    }
+    st->cuEnabled = enable && x2 > x1 && y2 > y1;
+    st->cuHeld = NO;
+    if (st->cuEnabled) {
+        st->cuRegion = sraRgnCreateRect(x1, y1, x2, y2);
+        if (st->cuWindow <= 0)
+            st->cuWindow = cContinuousStartWindow;
+        if (continuousRearm(cl, st))
+            pthread_cond_signal(&cl->updateCond);
+    }
+    BOOL enabled = st->cuEnabled;
+    pthread_mutex_unlock(&cl->updateMutex);
+
+    if (enabled) {
+        if (!wasEnabled)
+            TVLog(@"Client %s: continuous updates on for %dx%d at (%d,%d)", st->clientId8, x2 - x1, y2 - y1, x1,
+                  y1);
+        return;
+    }
+    pthread_mutex_lock(&cl->sendMutex);
+    writeEndOfContinuousUpdates(cl);
+    pthread_mutex_unlock(&cl->sendMutex);
+    if (wasEnabled)
+        TVLog(@"Client %s: continuous updates off", st->clientId8);
+}
+
+// Enabled for every client, so that their Fence and EnableContinuousUpdates messages reach the handler.
+static rfbBool continuousNewClient(rfbClientPtr cl, void **data) {
+    (void)cl;
+    (void)data;
+    return TRUE;
+}
+
+// Input thread, from SetEncodings. Support is announced once per client: a Fence request for Fence, then
+// EndOfContinuousUpdates for ContinuousUpdates, which needs Fence for its pacing.
+static rfbBool continuousEnablePseudoEncoding(rfbClientPtr cl, void **data, int encodingNumber) {
+    (void)data;
+    if (encodingNumber == 0)
+        return TRUE; // stay enabled when the client's encoding list starts over
+    if (encodingNumber != cFenceEncoding && encodingNumber != cContinuousUpdatesEncoding)
+        return FALSE;
+    TVClientState *st = tvGetClientState(cl);
+    if (!st)
+        return TRUE;
+
+    BOOL announceFence = NO;
+    BOOL announceContinuous = NO;
+    pthread_mutex_lock(&cl->updateMutex);
+    if (encodingNumber == cFenceEncoding) {
+        announceFence = !st->fenceSupported;
+        st->fenceSupported = YES;
+    } else {
+        st->cuListed = YES;
+    }
+    if (st->fenceSupported && st->cuListed && !st->cuSupported) {
+        st->cuSupported = YES;
+        announceContinuous = YES;
+    }
+    pthread_mutex_unlock(&cl->updateMutex);
+
+    if (!announceFence && !announceContinuous)
+        return TRUE;
+    pthread_mutex_lock(&cl->sendMutex);
+    BOOL ok = !announceFence || writeFence(cl, cFenceRequest, NULL, 0);
+    if (ok && announceContinuous)
+        ok = writeEndOfContinuousUpdates(cl);
+    pthread_mutex_unlock(&cl->sendMutex);
+    if (ok && announceContinuous)
+        TVLog(@"Client %s: continuous updates offered", st->clientId8);
+    return TRUE;
+}
+
+// Input thread: libvncserver has read the message type, the handlers read the rest.
+static rfbBool continuousHandleMessage(rfbClientPtr cl, void *data, const rfbClientToServerMsg *message) {
+    (void)data;
+    if (message->type == cFenceMsg) {
+        handleClientFence(cl);
+        return TRUE;
+    }
+    if (message->type == cContinuousUpdatesMsg) {
+        handleEnableContinuousUpdates(cl);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static rfbProtocolExtension gContinuousExtension = {
+    .newClient = continuousNewClient,
+    .pseudoEncodings = gContinuousPseudoEncodings,
+    .enablePseudoEncoding = continuousEnablePseudoEncoding,
+    .handleMessage = continuousHandleMessage,
+};
+
+// Output thread, from displayHook.
+NS_INLINE void continuousBeginUpdate(rfbClientPtr cl, TVClientState *st) {
+    st->cuBytesAtStart = (uint32_t)rfbStatGetSentBytes(cl);
+}
+
+// Output thread, from displayFinishedHook (sendMutex held): count the update as in flight, follow it with a
+// fence and re-arm the request it used up.
+static void continuousFinishUpdate(rfbClientPtr cl, TVClientState *st) {
+    uint32_t sent = (uint32_t)rfbStatGetSentBytes(cl) - st->cuBytesAtStart;
+    BOOL ping = NO;
+    uint32_t seq = 0;
+
+    pthread_mutex_lock(&cl->updateMutex);
+    if (st->cuEnabled) {
+        if (sent > 0) {
+            st->cuSent += sent;
+            if (st->cuPingCount < cFenceMaxInFlight) {
+                seq = ++st->cuPingSeq;
+                TVFencePing *p = &st->cuPings[(st->cuPingHead + st->cuPingCount) % cFenceMaxInFlight];
+                p->seq = seq;
+                p->sent = st->cuSent;
+                p->sentAt = CFAbsoluteTimeGetCurrent();
+                st->cuPingCount++;
+                ping = YES;
+            }
+        }
+        // A request held by the pacing (-l) comes back when the bucket refills
+        if (sraRgnEmpty(cl->requestedRegion) && !st->pacedRequest)
+            continuousRearm(cl, st);
+    }
+    pthread_mutex_unlock(&cl->updateMutex);
+
+    if (ping) {
+        uint8_t payload[4] = {(uint8_t)(seq >> 24), (uint8_t)(seq >> 16), (uint8_t)(seq >> 8), (uint8_t)seq};
+        writeFence(cl, cFenceRequest | cFenceBlockBefore, payload, sizeof(payload));
+    }
+}
+
+#pragma mark - Socket Tuning
+
+// With -j, each client's socket is tuned for latency rather than throughput. libvncserver already turns
+// Nagle off on the sockets it accepts or connects; it is set again here so that no path is left out.
+// TCP_NOTSENT_LOWAT keeps the socket from reporting itself writable while more than cSockNotsentLowat bytes
+// are still unsent, so an output thread that found the socket full waits until the backlog has almost
+// drained instead of topping it up with another chunk of an old frame.
+//
+// Once the link statistics have measured a delivery rate, SO_SNDBUF is set to cSockBufBdpFactor times the
+// bandwidth-delay product (rate x baseline round trip): enough to keep the link busy, too little for
+// seconds of stale frames to queue up behind a slow link as they do with the kernel's auto-sized buffers.
+// The product also feeds the frame drop of -Q: a client whose socket already holds more than that is not
+// counted as ready, so under load the frame it gets next is the newest one rather than one that waited in
+// a queue.
+
+// Main thread, from newClientHook.
+static void tuneClientSocket(rfbClientPtr cl) {
+    if (cl->sock < 0)
+        return;
+    int one = 1;
+    setsockopt(cl->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef TCP_NOTSENT_LOWAT
+    int lowat = cSockNotsentLowat;
+    if (setsockopt(cl->sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) != 0)
+        TVLogVerbose(@"TCP_NOTSENT_LOWAT not applied: %s", strerror(errno));
+#endif
+}
+
+// Output thread, from displayFinishedHook after linkFinishUpdate: follow the bandwidth-delay product at most
+// once per cSockTuneSec.
+static void tuneSendBuffer(rfbClientPtr cl, TVClientState *st) {
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    if (now - st->sockLastTune < cSockTuneSec || st->link.throughput <= 0)
+        return;
+    st->sockLastTune = now;
+
+    pthread_mutex_lock(&st->link.lock);
+    double rttMin = st->link.rttMin;
+    pthread_mutex_unlock(&st->link.lock);
+
+    double bdp = st->link.throughput * MAX(rttMin, cSockBufMinRtt);
+    pthread_mutex_lock(&cl->updateMutex);
+    st->sockBdp = (int)MIN(bdp, (double)cSockBufMax);
+    pthread_mutex_unlock(&cl->updateMutex);
+
+    int size = (int)MIN(MAX(bdp * cSockBufBdpFactor, (double)cSockBufMin), (double)cSockBufMax);
+    if (st->sockSndBuf > 0 && fabs((double)(size - st->sockSndBuf)) < st->sockSndBuf * cSockBufChange)
+        return;
+    if (cl->sock < 0 || setsockopt(cl->sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) != 0)
+        return;
+    TVLogVerbose(@"Client %s: send buffer %d -> %d KB (%.0f KB/s, rtt %.0f ms)", st->clientId8,
+                 st->sockSndBuf / 1024, size / 1024, st->link.throughput / 1024.0, rttMin * 1000.0);
+    st->sockSndBuf = size;
+}
+
+// cl->updateMutex held: whether the client's socket already holds a round trip's worth of unsent data.
+NS_INLINE BOOL sockBacklogFull(rfbClientPtr cl, TVClientState *st) {
+    return st->sockBdp > 0 && tvSocketBacklog(cl->sock) > st->sockBdp;
+}
+
+#pragma mark - TLS Sessions
+
+// With -e/-k, libvncserver accepts TLS on the WebSocket port (wss). It creates an SSL_CTX for every
+// connection and finishes the handshake before newClientHook, so neither session tickets nor a session
+// cache survive from one connection to the next, and the cipher is negotiated with OpenSSL's defaults
+// (the client's preference, which browsers set to AES-GCM on CPUs with AES instructions and ChaCha20
+// otherwise). What the server controls is how data reaches OpenSSL (see Send Queue); the counters below
+// show what sessions cost.
+
+static uint64_t gTlsSessions = 0; // TLS handshakes completed, main thread
+
+// Main thread, from newClientHook.
+static void tlsSessionStarted(TVClientState *st) {
+    st->tlsSession = YES;
+    st->tlsStartedAt = CFAbsoluteTimeGetCurrent();
+    gTlsSessions++;
+    TVLog(@"Client %s: TLS session started (full handshake %llu)", st->clientId8, (unsigned long long)gTlsSessions);
+}
+
+// Output thread, from displayFinishedHook, and once more when the session ends. libvncserver counts sent
+// bytes in 32 bits, which wrap after 4 GB; the difference since the last call never does, so it is added up
+// in 64 bits instead.
+static void tlsCountSentBytes(rfbClientPtr cl, TVClientState *st) {
+    uint32_t sent = (uint32_t)rfbStatGetSentBytes(cl);
+    st->tlsSentBytes += (uint32_t)(sent - st->tlsSentMark);
+    st->tlsSentMark = sent;
+}
+
+// From clientGoneHook, once the client's output thread has ended.
+static void tlsSessionEnded(rfbClientPtr cl, TVClientState *st) {
+    double seconds = MAX(CFAbsoluteTimeGetCurrent() - st->tlsStartedAt, 0.001);
+    tlsCountSentBytes(cl, st);
+    double sent = (double)st->tlsSentBytes;
+    TVLog(@"Client %s: TLS session ended: %.1f MB in %.0f s (%.0f KB/s), %.0f%% by the send queue", st->clientId8,
+          sent / (1024.0 * 1024.0), seconds, sent / 1024.0 / seconds,
+          sent > 0 ? MIN((double)st->tlsQueueBytes / sent, 1.0) * 100.0 : 0.0);
+}
+
+#pragma mark - Update Pacing
+
+// With -l, each client's updates are paced by a token bucket that fills at the client's measured delivery
+// rate (see Link Statistics), a little above it so that the rate keeps being measured, and holds at most a
+// round trip's worth. An update due while the bucket is empty, or while the socket backlog needs more than
+// cPaceMaxDrainSec to drain, is held: its requested region is set aside until a tick on the main thread finds
+// the bucket refilled. Changes published meanwhile pile up in the client's modified region, so the update
+// that finally goes out carries the latest pixels of all of them. Slow clients get fewer, larger updates;
+// clients whose link keeps up never build a backlog, have no measured rate and are never held. The
+// high-water mark of -z holds updates the same way, without -l too (see Send Queue).
+//
+// The frame drop of -Q looks at clients one by one: a frame is skipped only while the encoders are busy and
+// no client could take it, i.e. every client is sending, held by its pacing, or held by its continuous-updates
+// window (-u). One slow client no longer costs the others frames.
+
+static BOOL gPaceTickScheduled = NO;
+
+// cl->updateMutex held.
+NS_INLINE void paceRefill(TVClientState *st, double now) {
+    if (st->paceRate > 0)
+        st->paceTokens = MIN(st->paceTokens + (now - st->paceRefill) * st->paceRate, st->paceDepth);
+    st->paceRefill = now;
+}
+
+// cl->updateMutex held.
+NS_INLINE BOOL paceMustHold(rfbClientPtr cl, TVClientState *st) {
+    if (sendBacklogAboveHighWater(cl))
+        return YES;
+    if (st->paceRate <= 0)
+        return NO;
+    if (st->paceTokens < 0)
+        return YES;
+    return (double)tvSocketBacklog(cl->sock) / st->paceRate > cPaceMaxDrainSec;
+}
+
+// Main thread. Releases held requests of clients whose bucket has refilled, and returns YES while any client
+// is still held, so that the caller keeps the tick running.
+static BOOL evaluateUpdatePacing(void) {
+    if (!gScreen)
+        return NO;
+
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    BOOL anyHeld = NO;
+    BOOL anyReleased = NO;
+    rfbClientIteratorPtr it = rfbGetClientIterator(gScreen);
+    rfbClientPtr cl;
+    while ((cl = rfbClientIteratorNext(it))) {
+        TVClientState *st = tvGetClientState(cl);
+        if (!st)
+            continue;
+        pthread_mutex_lock(&cl->updateMutex);
+        if (st->pacedRequest) {
+            paceRefill(st, now);
+            if (paceMustHold(cl, st)) {
+                anyHeld = YES;
+            } else {
+                sraRgnOr(cl->requestedRegion, st->pacedRequest);
+                sraRgnDestroy(st->pacedRequest);
+                st->pacedRequest = NULL;
+                pthread_cond_signal(&cl->updateCond);
+                anyReleased = YES;
+            }
+        }
+        pthread_mutex_unlock(&cl->updateMutex);
+    }
+    rfbReleaseClientIterator(it);
+
+    if (anyReleased)
+        tvReactorWake();
+    return anyHeld;
+}
+
+static void schedulePaceTick(void) {
+    if (gPaceTickScheduled)
+        return;
+    gPaceTickScheduled = YES;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(cPaceTickSec * NSEC_PER_SEC)),
+                   dispatch_get_main_queue(), ^{
+                       gPaceTickScheduled = NO;
+                       if (evaluateUpdatePacing())
+                           schedulePaceTick();
+                   });
+}
+
+// Output thread, from displayHook: set the requested region aside while the client's bucket is empty or its
+// backlog is above the high-water mark.
+// Returns YES when the update is held.
+static BOOL paceHoldUpdate(rfbClientPtr cl, TVClientState *st) {
+    st->paceBytesAtStart = (uint32_t)rfbStatGetSentBytes(cl);
+
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    BOOL held = NO;
+    BOOL startTick = NO;
+    pthread_mutex_lock(&cl->updateMutex);
+    paceRefill(st, now);
+    if (!sraRgnEmpty(cl->requestedRegion) && paceMustHold(cl, st)) {
+        if (!st->pacedRequest) {
+            st->pacedRequest = sraRgnCreate();
+            startTick = YES;
+        }
+        sraRgnOr(st->pacedRequest, cl->requestedRegion);
+        sraRgnMakeEmpty(cl->requestedRegion);
+        held = YES;
+    }
+    pthread_mutex_unlock(&cl->updateMutex);
+
+    if (startTick) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            schedulePaceTick();
+        });
+    }
+    return held;
 }
 
-// Build dirty rectangles from tile hash diffs. Returns number of rects written, up to maxRects.
-static int buildDirtyRects(DirtyRect *rects, int maxRects, int *outChangedTiles) {
-    int rectCount = 0;
-    int changedTiles = 0;
+// Output thread, from displayFinishedHook after linkFinishUpdate: charge the update to the bucket and
+// follow the measured rate.
+static void paceFinishUpdate(rfbClientPtr cl, TVClientState *st) {
+    uint32_t sent = (uint32_t)rfbStatGetSentBytes(cl) - st->paceBytesAtStart;
+    double rate = st->link.throughput * cPaceRateGain;
+
+    pthread_mutex_lock(&st->link.lock);
+    double rttMin = st->link.rttMin;
+    pthread_mutex_unlock(&st->link.lock);
+
+    pthread_mutex_lock(&cl->updateMutex);
+    st->paceRate = rate;
+    st->paceDepth = rate * MAX(cPaceBurstSec, rttMin);
+    st->paceTokens = rate > 0 ? MIN(st->paceTokens, st->paceDepth) - (double)sent : 0.0;
+    pthread_mutex_unlock(&cl->updateMutex);
+}
 
-    // First pass: horizontal merge per tile row
-    for (int ty = 0; ty < gTilesY; ++ty) {
-        int tx = 0;
-        while (tx < gTilesX) {
-            size_t idx = (size_t)ty * (size_t)gTilesX + (size_t)tx;
-            int changed = (gCurrHash[idx] != gPrevHash[idx]);
-            if (!changed) {
-                tx++;
-                continue;
-            }
+// Output thread: whether the client is sending an update, for the -Q gate.
+NS_INLINE void markClientSending(rfbClientPtr cl, TVClientState *st, BOOL sending) {
+    pthread_mutex_lock(&cl->updateMutex);
+    st->sending = sending;
+    pthread_mutex_unlock(&cl->updateMutex);
+}
 
-            // Start of a run
-            int runStart = tx;
-            changedTiles++;
-            tx++;
-            while (tx < gTilesX) {
-                size_t idx2 = (size_t)ty * (size_t)gTilesX + (size_t)tx;
-                if (gCurrHash[idx2] != gPrevHash[idx2]) {
-                    changedTiles++;
-                    tx++;
-                } else
-                    break;
-            }
+// Main thread: whether any client could take a new frame now.
+static BOOL anyClientReady(void) {
+    if (!gScreen)
+        return NO;
 
-            // Emit rect for this horizontal run
-            if (rectCount < maxRects) {
-                int x = runStart * gTileSize;
-                int w = (tx - runStart) * gTileSize;
-                int y = ty * gTileSize;
-                int h = gTileSize;
-                // Clip to screen bounds
-                if (x + w > gWidth)
-                    w = gWidth - x;
-                if (y + h > gHeight)
-                    h = gHeight - y;
-                rects[rectCount++] = (DirtyRect){x, y, w, h};
-            } else {
-                // Too many rects; caller may fallback to fullscreen
-                if (outChangedTiles)
-                    *outChangedTiles = changedTiles;
-                return rectCount;
-            }
-        }
+    BOOL ready = NO;
+    rfbClientIteratorPtr it = rfbGetClientIterator(gScreen);
+    rfbClientPtr cl;
+    while (!ready && (cl = rfbClientIteratorNext(it))) {
+        TVClientState *st = tvGetClientState(cl);
+        if (!st)
+            continue;
+        pthread_mutex_lock(&cl->updateMutex);
+        ready = !st->sending && !st->pacedRequest && !st->cuHeld &&
+                !(gSocketTuningEnabled && sockBacklogFull(cl, st));
+        pthread_mutex_unlock(&cl->updateMutex);
     }
+    rfbReleaseClientIterator(it);
+    return ready;
+}
 
-    // Optional vertical merge: merge rects with same x,w and contiguous vertically
-    // Simple O(n^2) merge for small rect counts
-    for (int i = 0; i < rectCount; ++i) {
-        for (int j = i + 1; j < rectCount; ++j) {
-            if (rects[j].w == 0 || rects[j].h == 0)
-                continue;
-            if (rects[i].x == rects[j].x && rects[i].w == rects[j].w) {
-                if (rects[i].y + rects[i].h == rects[j].y) {
-                    rects[i].h += rects[j].h;
-                    rects[j].w = rects[j].h = 0; // mark removed
-                } else if (rects[j].y + rects[j].h == rects[i].y) {
-                    rects[j].h += rects[i].h;
-                    rects[i].w = rects[i].h = 0;
-                }
+#pragma mark - Display Hooks
+
+static std::atomic<int> gInflight(0);
+
+// Split an update that covers both video regions and UI so the parts go out on alternate updates, and
+// encode the video part lossy. The part left out stays in modifiedRegion for the next request.
+// Returns YES when this update sends video.
+static BOOL shapeVideoRegionUpdate(rfbClientPtr cl, TVClientState *st) {
+    sraRegion *video = copyVideoRegion();
+    if (!video)
+        return NO;
+
+    BOOL videoTurn = NO;
+    pthread_mutex_lock(&cl->updateMutex);
+    if (!cl->newFBSizePending && sraRgnEmpty(cl->copyRegion)) {
+        sraRegion *ui = sraRgnCreateRgn(cl->modifiedRegion);
+        sraRgnAnd(ui, cl->requestedRegion);
+        sraRegion *videoPart = sraRgnCreateRgn(ui);
+        sraRgnAnd(videoPart, video);
+        sraRgnSubtract(ui, video);
+
+        BOOL hasUI = !sraRgnEmpty(ui);
+        if (!sraRgnEmpty(videoPart)) {
+            videoTurn = !hasUI || st->videoTurnNext;
+            if (hasUI) {
+                st->shapedRequest = sraRgnCreateRgn(cl->requestedRegion);
+                if (videoTurn)
+                    sraRgnAnd(cl->requestedRegion, video);
+                else
+                    sraRgnSubtract(cl->requestedRegion, video);
+                st->videoTurnNext = !videoTurn;
             }
         }
-    }
 
-    // Compact removed entries
-    int k = 0;
-    for (int i = 0; i < rectCount; ++i) {
-        if (rects[i].w > 0 && rects[i].h > 0)
-            rects[k++] = rects[i];
+        sraRgnDestroy(videoPart);
+        sraRgnDestroy(ui);
     }
+    pthread_mutex_unlock(&cl->updateMutex);
+    sraRgnDestroy(video);
 
-    rectCount = k;
-    if (outChangedTiles)
-        *outChangedTiles = changedTiles;
-    return rectCount;
+    // Lossless sessions (no QualityLevel requested) are left alone
+    if (videoTurn && cl->turboQualityLevel > gVideoRegionQuality) {
+        TVEncoderParams base = tvReadEncoderParams(cl);
+        TVEncoderParams lossy = tvLossyEncoderParams(&base, gVideoRegionQuality);
+        tvOverrideEncoderParams(cl, st, &lossy);
+    }
+    return videoTurn;
 }
 
-// Build rects from pending mask by temporarily mapping to hashes
-static int buildRectsFromPending(DirtyRect *rects, int maxRects) {
-    if (!gPendingDirty)
-        return 0;
+// With -f, an update on a congested link is split around the client's pointer: the part within a box
+// around the last pointer event goes out first, at the client's own quality if adaptive quality (-q) or the
+// encoding policy (-o) lowered it, and the rest follows on the next update, which is never split. Where the
+// user is working feels responsive even while the far parts of the screen take a round trip longer. The
+// link counts as congested while its backlog or queueing delay is up (see Link Statistics); the pointer
+// only places focus for cFocusRecentSec after its last event.
+
+// Input thread, from ptrAddEvent.
+static void recordPointerFocus(rfbClientPtr cl, TVClientState *st, int x, int y) {
+    pthread_mutex_lock(&cl->updateMutex);
+    st->focusX = x;
+    st->focusY = y;
+    st->focusAt = CFAbsoluteTimeGetCurrent();
+    pthread_mutex_unlock(&cl->updateMutex);
+}
 
-    // Temporarily mark curr!=prev for pending tiles
-    // Save originals
-    // For efficiency, we only synthesize gCurrHash markers without touching buffers
-    size_t changed = 0;
-    for (size_t i = 0; i < gTileCount; ++i) {
-        if (gPendingDirty[i]) {
-            if (gCurrHash[i] == gPrevHash[i])
-                gCurrHash[i] ^= 0x1ULL;
-            changed++;
-        }
+// Output thread, from displayHook. Returns YES when this update was narrowed to the focus.
+static BOOL shapePointerFocusUpdate(rfbClientPtr cl, TVClientState *st) {
+    if (st->shapedRequest)
+        return NO; // a video turn shaped this update already
+    if (st->focusRestNext) {
+        st->focusRestNext = NO;
+        return NO;
     }
 
-    int dummyTiles = 0;
-    int cnt = buildDirtyRects(rects, maxRects, &dummyTiles);
+    double drainSec = 0, queueDelay = 0;
+    linkSnapshot(st, &drainSec, &queueDelay);
+    if (drainSec < cFocusDrainSec && queueDelay < cFocusQueueDelaySec)
+        return NO;
 
-    // Restore hashes for tiles we toggled
-    for (size_t i = 0; i < gTileCount; ++i) {
-        if (gPendingDirty[i]) {
-            if (gCurrHash[i] == gPrevHash[i])
-                gCurrHash[i] ^= 0x1ULL; // unlikely path
-            else if ((gCurrHash[i] ^ 0x1ULL) == gPrevHash[i])
-                gCurrHash[i] ^= 0x1ULL;
-        }
-    }
+    rfbScreenInfoPtr screen = cl->screen;
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    BOOL shaped = NO;
+    pthread_mutex_lock(&cl->updateMutex);
+    if (st->focusAt > 0 && now - st->focusAt < cFocusRecentSec && !cl->newFBSizePending &&
+        sraRgnEmpty(cl->copyRegion)) {
+        int radius = (int)(MAX(screen->width, screen->height) * cFocusRadiusFrac);
+        sraRegion *focus = sraRgnCreateRect(MAX(st->focusX - radius, 0), MAX(st->focusY - radius, 0),
+                                            MIN(st->focusX + radius, screen->width),
+                                            MIN(st->focusY + radius, screen->height));
+        sraRegion *farPart = sraRgnCreateRgn(cl->modifiedRegion);
+        sraRgnAnd(farPart, cl->requestedRegion);
+        sraRegion *nearPart = sraRgnCreateRgn(farPart);
+        sraRgnAnd(nearPart, focus);
+        sraRgnSubtract(farPart, focus);
+
+        if (!sraRgnEmpty(nearPart) && !sraRgnEmpty(farPart)) {
+            st->shapedRequest = sraRgnCreateRgn(cl->requestedRegion);
+            sraRgnAnd(cl->requestedRegion, focus);
+            st->focusRestNext = YES;
+            shaped = YES;
+        }
+
+        sraRgnDestroy(nearPart);
+        sraRgnDestroy(farPart);
+        sraRgnDestroy(focus);
+    }
+    pthread_mutex_unlock(&cl->updateMutex);
+
+    // The focus part is small; give it the quality the viewer asked for
+    if (shaped && st->encOverridden && st->encSaved.turboQuality > st->encApplied.turboQuality) {
+        TVEncoderParams own = st->encSaved;
+        tvOverrideEncoderParams(cl, st, &own);
+    }
+    return shaped;
+}
 
-    (void)changed;
-    return cnt;
+// With -y, an update that would keep the client's link busy for longer than gSliceTargetMs is sent as a
+// horizontal slice of it: a band of full-width rows, as tall as the link's measured delivery rate and the
+// client's encoded bytes per pixel allow. The rest stays in modifiedRegion, so the next slice is cut from
+// whatever is pending then: changes published meanwhile preempt the stale pixels of slices not yet sent,
+// and input feedback never waits behind more than one slice. Slices go round from top to bottom so every
+// area gets its turn. Clients whose link keeps up have no measured rate and are never sliced. Unlike
+// libvncserver's progressiveSliceHeight, which is one height for all clients and every update, slices
+// follow each client's link and only large updates are cut.
+
+NS_INLINE long long regionArea(sraRegion *region, sraRect *bbox) {
+    long long area = 0;
+    *bbox = sraRect{INT_MAX, INT_MAX, 0, 0};
+    sraRectangleIterator *iter = sraRgnGetIterator(region);
+    sraRect r;
+    while (sraRgnIteratorNext(iter, &r)) {
+        area += (long long)(r.x2 - r.x1) * (r.y2 - r.y1);
+        bbox->x1 = MIN(bbox->x1, r.x1);
+        bbox->y1 = MIN(bbox->y1, r.y1);
+        bbox->x2 = MAX(bbox->x2, r.x2);
+        bbox->y2 = MAX(bbox->y2, r.y2);
+    }
+    sraRgnReleaseIterator(iter);
+    return area;
 }
 
-NS_INLINE void markRectsModified(DirtyRect *rects, int rectCount) {
-    for (int i = 0; i < rectCount; ++i) {
-        rfbMarkRectAsModified(gScreen, rects[i].x, rects[i].y, rects[i].x + rects[i].w, rects[i].y + rects[i].h);
-    }
+// Output thread, from displayHook. Returns YES when this update was narrowed to a slice.
+static BOOL shapeSlicedUpdate(rfbClientPtr cl, TVClientState *st) {
+    st->slicePixels = 0;
+    st->sliceBytesAtStart = (uint32_t)rfbStatGetSentBytes(cl);
+    if (st->shapedRequest)
+        return NO; // a video turn or the pointer focus shaped this update already
+
+    rfbScreenInfoPtr screen = cl->screen;
+    double budget = st->link.throughput * gSliceTargetMs / 1000.0;
+    double bytesPerPixel = st->sliceBytesPerPixel > 0 ? st->sliceBytesPerPixel : cSliceStartBytesPerPixel;
+    BOOL sliced = NO;
+    pthread_mutex_lock(&cl->updateMutex);
+    if (!cl->newFBSizePending && sraRgnEmpty(cl->copyRegion)) {
+        sraRegion *pending = sraRgnCreateRgn(cl->modifiedRegion);
+        sraRgnAnd(pending, cl->requestedRegion);
+        sraRect bbox;
+        long long area = regionArea(pending, &bbox);
+        st->slicePixels = area;
+
+        if (budget > 0 && (double)area * bytesPerPixel > budget) {
+            // Rows in proportion to the share of the update that fits the budget
+            int rows = (int)((bbox.y2 - bbox.y1) * budget / ((double)area * bytesPerPixel));
+            rows = MAX(rows, cSliceMinRows);
+            int y = (st->sliceY >= bbox.y1 && st->sliceY < bbox.y2) ? st->sliceY : bbox.y1;
+            int y2 = MIN(y + rows, bbox.y2);
+
+            sraRegion *slice = sraRgnCreateRect(0, y, screen->width, y2);
+            sraRgnAnd(pending, slice);
+            sraRect sliceBox;
+            st->slicePixels = regionArea(pending, &sliceBox);
+            st->shapedRequest = sraRgnCreateRgn(cl->requestedRegion);
+            sraRgnAnd(cl->requestedRegion, slice);
+            sraRgnDestroy(slice);
+            st->sliceY = y2 < bbox.y2 ? y2 : 0;
+            sliced = YES;
+        }
+        sraRgnDestroy(pending);
+    }
+    pthread_mutex_unlock(&cl->updateMutex);
+    return sliced;
 }
 
-NS_INLINE void copyRectsFromBackToFront(DirtyRect *rects, int rectCount) {
-    size_t fbBPR = (size_t)gWidth * (size_t)gBytesPerPixel;
-    for (int i = 0; i < rectCount; ++i) {
-        int x = rects[i].x, y = rects[i].y, w = rects[i].w, h = rects[i].h;
-        size_t rowBytes = (size_t)w * (size_t)gBytesPerPixel;
-        for (int r = 0; r < h; ++r) {
-            uint8_t *dst = (uint8_t *)gFrontBuffer + (size_t)(y + r) * fbBPR + (size_t)x * gBytesPerPixel;
-            uint8_t *src = (uint8_t *)gBackBuffer + (size_t)(y + r) * fbBPR + (size_t)x * gBytesPerPixel;
-            memcpy(dst, src, rowBytes);
-        }
+// Output thread, from displayFinishedHook: learn the encoded size per pixel.
+static void finishSlicedUpdate(rfbClientPtr cl, TVClientState *st) {
+    uint32_t sent = (uint32_t)rfbStatGetSentBytes(cl) - st->sliceBytesAtStart;
+    if (st->slicePixels <= 0 || sent == 0)
+        return;
+    double ratio = (double)sent / (double)st->slicePixels;
+    st->sliceBytesPerPixel =
+        st->sliceBytesPerPixel > 0 ? st->sliceBytesPerPixel * (1.0 - cSliceRatioGain) + ratio * cSliceRatioGain
+                                   : ratio;
+    st->slicePixels = 0;
+}
+
+// Updates made only of solid, palette and text tiles go out lossless: Tight's palette and zlib paths do
+// better than JPEG on such content and keep text sharp. Mixed or unclassified updates keep the client's
+// quality.
+static void applyContentEncoderPolicy(rfbClientPtr cl, TVClientState *st) {
+    if (cl->turboQualityLevel < 0)
+        return;
+
+    sraRegion *lossless = copyLosslessRegion();
+    if (!lossless)
+        return;
+
+    BOOL allLossless = NO;
+    pthread_mutex_lock(&cl->updateMutex);
+    sraRegion *pending = sraRgnCreateRgn(cl->modifiedRegion);
+    sraRgnAnd(pending, cl->requestedRegion);
+    if (!sraRgnEmpty(pending)) {
+        sraRgnSubtract(pending, lossless);
+        allLossless = sraRgnEmpty(pending);
+    }
+    pthread_mutex_unlock(&cl->updateMutex);
+    sraRgnDestroy(pending);
+    sraRgnDestroy(lossless);
+
+    if (allLossless) {
+        TVEncoderParams p = tvReadEncoderParams(cl);
+        p.tightQuality = -1;
+        p.turboQuality = -1;
+        tvOverrideEncoderParams(cl, st, &p);
     }
 }
 
-#pragma mark - Display Hooks
+// Output thread, from displayFinishedHook: undo the narrowing of a video turn or a pointer focus update.
+static void finishShapedUpdate(rfbClientPtr cl, TVClientState *st) {
+    if (!st->shapedRequest)
+        return;
 
-static std::atomic<int> gInflight(0);
+    // An update that ended up empty leaves requestedRegion untouched; give back what was taken from it
+    pthread_mutex_lock(&cl->updateMutex);
+    if (!sraRgnEmpty(cl->requestedRegion))
+        sraRgnOr(cl->requestedRegion, st->shapedRequest);
+    pthread_mutex_unlock(&cl->updateMutex);
+
+    sraRgnDestroy(st->shapedRequest);
+    st->shapedRequest = NULL;
+}
 
 // Track encode life-cycle to provide backpressure via inflight counter
 static void displayHook(rfbClientPtr cl) {
-    (void)cl;
     gInflight.fetch_add(1, std::memory_order_relaxed);
+
+    TVClientState *st = tvGetClientState(cl);
+    if (!st)
+        return;
+    markClientSending(cl, st, YES);
+    if (isLinkStatsEnabled())
+        linkBeginUpdate(cl, st);
+    if (gContinuousUpdatesEnabled)
+        continuousBeginUpdate(cl, st);
+    if ((gUpdatePacingEnabled || isSendHighWaterEnabled()) && paceHoldUpdate(cl, st))
+        return;
+    if (gEncodingPolicyEnabled)
+        applyEncodingPolicy(cl, st);
+    if (isAdaptiveQualityEnabled())
+        aqBeginUpdate(cl, st);
+    if (gH264Enabled && sendH264Update(cl, st))
+        return;
+    BOOL videoTurn = gVideoRegionQuality > 0 && shapeVideoRegionUpdate(cl, st);
+    if (gPointerFocusEnabled && !videoTurn)
+        shapePointerFocusUpdate(cl, st);
+    if (gSliceTargetMs > 0)
+        shapeSlicedUpdate(cl, st);
+    if (gTileClassesEnabled && !videoTurn)
+        applyContentEncoderPolicy(cl, st);
+    if (isLosslessRefineEnabled())
+        applyLosslessRefine(cl, st);
+    if (gSharedEncodingEnabled && sendSharedEncodedUpdate(cl))
+        return;
+    if (!sendRawUpdate(cl) && gHextileEncodingEnabled)
+        sendHextileUpdate(cl);
 }
 
 static void displayFinishedHook(rfbClientPtr cl, int result) {
-    (void)cl;
     (void)result;
+
+    TVClientState *st = tvGetClientState(cl);
+    if (st) {
+        finishShapedUpdate(cl, st);
+        if (gSliceTargetMs > 0)
+            finishSlicedUpdate(cl, st);
+        finishLosslessRefine(cl, st);
+        tvRestoreEncoderParams(cl, st);
+        if (isLinkStatsEnabled() && linkFinishUpdate(cl, st) && isAdaptiveQualityEnabled())
+            aqFinishUpdate(cl, st);
+        if (gUpdatePacingEnabled)
+            paceFinishUpdate(cl, st);
+        if (gSocketTuningEnabled)
+            tuneSendBuffer(cl, st);
+        if (gContinuousUpdatesEnabled)
+            continuousFinishUpdate(cl, st);
+        if (st->tlsSession)
+            tlsCountSentBytes(cl, st);
+        markClientSending(cl, st, NO);
+    }
+
     gInflight.fetch_sub(1, std::memory_order_relaxed);
 }
 
+static void fbUpdateRequestHook(rfbClientPtr cl, rfbFramebufferUpdateRequestMsg *furMsg) {
+    TVClientState *st = tvGetClientState(cl);
+    if (st && isLinkStatsEnabled())
+        linkUpdateRequested(st);
+
+    // A full refresh means the client lost its picture; the next H.264 frame has to stand alone
+    if (st && gH264Enabled && !furMsg->incremental) {
+        pthread_mutex_lock(&cl->updateMutex);
+        st->h264Keyframe = YES;
+        pthread_mutex_unlock(&cl->updateMutex);
+    }
+}
+
 static int setDesktopSizeHook(int width, int height, int numScreens, rfbExtDesktopScreen *extDesktopScreens,
                               rfbClientPtr cl) {
-    (void)cl;
     (void)numScreens;
     (void)extDesktopScreens;
+    gFrameFingerprintStale.store(true, std::memory_order_relaxed);
     [[ScreenCapturer sharedCapturer] forceNextFrameUpdate];
-    // We do not support client-initiated resizing
+
+    // The framebuffer itself is never resized for a client; with -m the client gets the closest level
+    TVClientState *st = tvGetClientState(cl);
+    if (gClientScalingEnabled && st && width > 0 && height > 0) {
+        int level = clientScaleLevelForSize(width, height);
+        TVLog(@"Client %s asked for %dx%d; serving %dx%d (1/%d)", st->clientId8, width, height, gWidth >> level,
+              gHeight >> level, 1 << level);
+        applyClientScaleLevel(cl, st, level);
+        return rfbExtDesktopSize_Success;
+    }
     return rfbExtDesktopSize_ResizeProhibited;
 }
 
-#pragma mark - Display Tiling Constants
-
-// Hashing performance controls
-static const int cHashStrideX = 4;              // sparse sampling stride X (>=1; 1 = full scan)
-static const int cHashStrideY = 4;              // sparse sampling stride Y (>=1; 1 = full scan)
-static const BOOL cSparseHashDuringDefer = YES; // use sparse hashing while within defer window
-// Skip vImage scaling when src/dst size difference is small; copy with pad/crop instead
-static const int cNoScalePadThresholdPx = 8; // if both |dW| and |dH| <= this, do pad/crop copy
-
-// Flush-time hashing optimization
-static const BOOL cParallelHashOnFlush = YES; // use parallel hashing at flush to reduce wall time
-
 #pragma mark - Frame Handlers
 
 static std::atomic<int> gRotationQuad(0); // 0=0°, 1=90°, 2=180°, 3=270° (clockwise)
@@ -1956,25 +6270,27 @@ NS_INLINE void alignDimensions(int rawW, int rawH, int *alignedW, int *alignedH)
 }
 
 // Resize framebuffer according to rotation (0/180 keep WxH from src, 90/270 swap), then apply scale
-NS_INLINE void maybeResizeFramebufferForRotation(int rotQ) {
+// Returns YES when the framebuffer was replaced; the new front buffer is blank until the next swap.
+NS_INLINE BOOL maybeResizeFramebufferForRotation(int rotQ) {
     // Source capture size (portrait-orientated)
     int srcW = gSrcWidth;
     int srcH = gSrcHeight;
     if (srcW <= 0 || srcH <= 0)
-        return;
+        return NO;
 
     // Rotate at source dimension stage
     int rotW = (rotQ % 2 == 0) ? srcW : srcH;
     int rotH = (rotQ % 2 == 0) ? srcH : srcW;
 
     // Apply output scaling then align width to multiple of 4 (adjust height to preserve aspect)
-    int outWraw = (gScale > 0.0 && gScale < 1.0) ? MAX(1, (int)floor((double)rotW * gScale)) : rotW;
-    int outHraw = (gScale > 0.0 && gScale < 1.0) ? MAX(1, (int)floor((double)rotH * gScale)) : rotH;
+    double scale = effectiveOutputScale();
+    int outWraw = (scale > 0.0 && scale < 1.0) ? MAX(1, (int)floor((double)rotW * scale)) : rotW;
+    int outHraw = (scale > 0.0 && scale < 1.0) ? MAX(1, (int)floor((double)rotH * scale)) : rotH;
     int outW = 0, outH = 0;
     alignDimensions(outWraw, outHraw, &outW, &outH);
 
     if (outW == gWidth && outH == gHeight)
-        return; // no change
+        return NO; // no change
 
     // Allocate new double buffers
     size_t newFBSize = (size_t)outW * (size_t)outH * (size_t)gBytesPerPixel;
@@ -2017,14 +6333,24 @@ NS_INLINE void maybeResizeFramebufferForRotation(int rotQ) {
     if (gScreen)
         gScreen->frameBuffer = (char *)gFrontBuffer;
 
+    // Scaled screens keep the old geometry; clients on a reduced level need one of the new size
+    if (gClientScalingEnabled)
+        reapplyClientScaleLevels();
+
     // Re-init tiling/hash state for new geometry
     initializeTilingOrReset();
+    invalidateChangeTolerance();
+    resetVideoRegions();
+    resetTileClasses();
+    if (isLosslessRefineEnabled())
+        resetLosslessRefine();
     // Clear pending dirty flags to avoid carrying over old-geometry state into the new geometry
     if (gPendingDirty)
         memset(gPendingDirty, 0, gTileCount);
 
     gHasPending = NO;
-    TVLog(@"Resize: framebuffer changed to %dx%d (rotQ=%d, scale=%.3f)", gWidth, gHeight, rotQ, gScale);
+    TVLog(@"Resize: framebuffer changed to %dx%d (rotQ=%d, scale=%.3f)", gWidth, gHeight, rotQ, scale);
+    return YES;
 }
 
 // Ensure scratch buffer for rotation is available and large enough
@@ -2193,14 +6519,22 @@ static void handleFramebuffer(CMSampleBufferRef sampleBuffer) {
         return;
     }
 
-    // Busy-drop: if encoders are busy and limit reached, skip this frame (disabled when -Q 0)
-    if (gMaxInflightUpdates > 0 && gInflight.load(std::memory_order_relaxed) >= gMaxInflightUpdates) {
+    // Busy-drop: if encoders are busy, limit reached and no client could take the frame, skip it (disabled when
+    // -Q 0)
+    if (gMaxInflightUpdates > 0 && gInflight.load(std::memory_order_relaxed) >= gMaxInflightUpdates &&
+        !anyClientReady()) {
         // When busy dropping, skip all hashing/dirty work.
-        TVLogVerbose(@"drop frame due to inflight=%d >= limit=%d", gInflight.load(std::memory_order_relaxed),
-                     gMaxInflightUpdates);
+        TVLogVerbose(@"drop frame due to inflight=%d >= limit=%d, no client ready",
+                     gInflight.load(std::memory_order_relaxed), gMaxInflightUpdates);
+        if (isOutputDownshiftEnabled())
+            noteOutputDownshiftFrame(YES);
         return;
     }
 
+    // Judge congestion before the resize check below, so that a new output scale applies to this frame
+    if (isOutputDownshiftEnabled())
+        noteOutputDownshiftFrame(NO);
+
 #if DEBUG
     CFAbsoluteTime __tv_tLock0 = CFAbsoluteTimeGetCurrent();
 #endif
@@ -2221,11 +6555,33 @@ static void handleFramebuffer(CMSampleBufferRef sampleBuffer) {
     // Determine rotation and resize framebuffer if orientation implies new dimensions.
     int rotQ = (gOrientationSyncEnabled ? gRotationQuad.load(std::memory_order_relaxed) : 0) & 3;
 
+#if DEBUG
+    CFAbsoluteTime __tv_tFp0 = CFAbsoluteTimeGetCurrent();
+#endif
+
+    // Early-out: nothing visible changed since the last processed frame
+    if (shouldDropIdenticalFrame(base, width, height, srcBPR, rotQ)) {
+        CVPixelBufferUnlockBaseAddress(pb, kCVPixelBufferLock_ReadOnly);
+
+#if DEBUG
+        CFAbsoluteTime __tv_tFp1 = CFAbsoluteTimeGetCurrent();
+        TVLogVerbose(@"drop frame identical to last processed (fingerprint took %.3f ms)",
+                     (__tv_tFp1 - __tv_tFp0) * 1000.0);
+#endif
+
+        return;
+    }
+
+#if DEBUG
+    CFAbsoluteTime __tv_tFp1 = CFAbsoluteTimeGetCurrent();
+    TVLogVerbose(@"frame fingerprint took %.3f ms", (__tv_tFp1 - __tv_tFp0) * 1000.0);
+#endif
+
 #if DEBUG
     CFAbsoluteTime __tv_tResize0 = CFAbsoluteTimeGetCurrent();
 #endif
 
-    maybeResizeFramebufferForRotation(rotQ);
+    BOOL geometryChanged = maybeResizeFramebufferForRotation(rotQ);
 
 #if DEBUG
     CFAbsoluteTime __tv_tResize1 = CFAbsoluteTimeGetCurrent();
@@ -2239,9 +6595,9 @@ static void handleFramebuffer(CMSampleBufferRef sampleBuffer) {
         static BOOL sLoggedSizeInfoOnce = NO;
         if (!sLoggedSizeInfoOnce) {
             sLoggedSizeInfoOnce = YES;
-            if (gScale != 1.0) {
+            if (effectiveOutputScale() != 1.0) {
                 TVLogVerbose(@"Scaling source %zux%zu -> output %dx%d (scale=%.3f)", width, height, gWidth, gHeight,
-                             gScale);
+                             effectiveOutputScale());
             } else {
                 TVLogVerbose(@"Captured frame size %zux%zu differs from server %dx%d; cropping/copying minimum region.",
                              width, height, gWidth, gHeight);
@@ -2253,8 +6609,11 @@ static void handleFramebuffer(CMSampleBufferRef sampleBuffer) {
     // We rotate by UI orientation then scale to server size.
     BOOL dirtyDisabled = (gFullscreenThresholdPercent == 0);
 
+    // A new geometry (rotation, -s/-S scale change) takes the same path: the new front buffer is blank, and
+    // with an idle screen no further frame would arrive to fill it
     static int sLastRotQ = -1;
-    bool rotationChanged = (sLastRotQ == -1) ? false : ((rotQ & 3) != (sLastRotQ & 3));
+    bool rotationChanged =
+        geometryChanged || ((sLastRotQ == -1) ? false : ((rotQ & 3) != (sLastRotQ & 3)));
     bool needsRotate = (rotQ != 0);
 
     vImage_Buffer srcBuf = {
@@ -2330,7 +6689,7 @@ static void handleFramebuffer(CMSampleBufferRef sampleBuffer) {
                             .height = (vImagePixelCount)gHeight,
                             .width = (vImagePixelCount)gWidth,
                             .rowBytes = (size_t)gWidth * (size_t)gBytesPerPixel};
-    if (stage.width == dstBuf.width && stage.height == dstBuf.height && gScale == 1.0) {
+    if (stage.width == dstBuf.width && stage.height == dstBuf.height && effectiveOutputScale() == 1.0) {
 
 #if DEBUG
         CFAbsoluteTime __tv_tCopy0 = CFAbsoluteTimeGetCurrent();
@@ -2411,13 +6770,16 @@ static void handleFramebuffer(CMSampleBufferRef sampleBuffer) {
     TVLogVerbose(@"unlock pixel buffer took %.3f ms", __tv_msUnlock);
 #endif
 
-    // If rotation just changed, force a full-screen update and reset dirty state
+    // If rotation or geometry just changed, force a full-screen update and reset dirty state
     // to avoid mixing hashes/pending dirties from the previous orientation.
     if (rotationChanged) {
         // Clear pending mask/state
         if (gPendingDirty)
             memset(gPendingDirty, 0, gTileCount);
         gHasPending = NO;
+        invalidateChangeTolerance();
+        resetVideoRegions();
+        resetTileClasses();
 
 #if DEBUG
         CFAbsoluteTime __tv_tSwap0 = CFAbsoluteTimeGetCurrent();
@@ -2464,6 +6826,7 @@ static void handleFramebuffer(CMSampleBufferRef sampleBuffer) {
 
         // Skip dirty detection for this frame after rotation; return early
         sLastRotQ = rotQ;
+        commitFrameFingerprint();
 
         // Rotation may not change geometry (0<->180). Maintain hashes here so
         // the next frame recomputes curr and swaps to form a clean baseline.
@@ -2483,6 +6846,9 @@ static void handleFramebuffer(CMSampleBufferRef sampleBuffer) {
 
     // If dirty detection is disabled, perform a full-screen update
     if (dirtyDisabled) {
+        invalidateChangeTolerance();
+        resetVideoRegions();
+        resetTileClasses();
 
 #if DEBUG
         CFAbsoluteTime __tv_tSwap0 = CFAbsoluteTimeGetCurrent();
@@ -2528,6 +6894,8 @@ static void handleFramebuffer(CMSampleBufferRef sampleBuffer) {
 #endif
         }
 
+        commitFrameFingerprint();
+
 #if DEBUG
         CFAbsoluteTime __tv_tEnd = CFAbsoluteTimeGetCurrent();
         TVLogVerbose(
@@ -2643,6 +7011,23 @@ static void handleFramebuffer(CMSampleBufferRef sampleBuffer) {
 #endif
     }
 
+    // Hold back tiles whose change stays within the perceptual tolerance
+    int suppressedTiles = 0;
+    if (gChangeTolerance > 0) {
+
+#if DEBUG
+        CFAbsoluteTime __tv_tTol0 = CFAbsoluteTimeGetCurrent();
+#endif
+
+        suppressedTiles = applyChangeTolerance();
+
+#if DEBUG
+        CFAbsoluteTime __tv_tTol1 = CFAbsoluteTimeGetCurrent();
+        TVLogVerbose(@"change tolerance took %.3f ms (held back %d tiles, thr=%d)", (__tv_tTol1 - __tv_tTol0) * 1000.0,
+                     suppressedTiles, gChangeTolerance);
+#endif
+    }
+
 // Promote pending tiles into rects
 #if DEBUG
     CFAbsoluteTime __tv_tRects0 = CFAbsoluteTimeGetCurrent();
@@ -2693,7 +7078,27 @@ static void handleFramebuffer(CMSampleBufferRef sampleBuffer) {
         TVLogVerbose(@"rects exceeded limit -> collapse to bbox");
     }
 
-    fullScreen = (changedPct >= gFullscreenThresholdPercent) || rectCount == 0;
+    fullScreen = (changedPct >= gFullscreenThresholdPercent) || (rectCount == 0 && suppressedTiles == 0);
+
+    // Shrink small dirty sets from whole tiles to the exact changed pixels
+    if (!fullScreen && cRefineMaxRects > 0 && rectCount <= cRefineMaxRects) {
+
+#if DEBUG
+        CFAbsoluteTime __tv_tRefine0 = CFAbsoluteTimeGetCurrent();
+        int __tv_rectsBefore = rectCount;
+#endif
+
+        rectCount = refineDirtyRects(rects, rectCount, MIN(gMaxRectsLimit, kRectBuf));
+
+#if DEBUG
+        CFAbsoluteTime __tv_tRefine1 = CFAbsoluteTimeGetCurrent();
+        TVLogVerbose(@"refine rects took %.3f ms (rects %d -> %d)", (__tv_tRefine1 - __tv_tRefine0) * 1000.0,
+                     __tv_rectsBefore, rectCount);
+#endif
+    }
+
+    if (!fullScreen && gChangeTolerance > 0)
+        rectCount = appendStaleToleranceTiles(rects, rectCount, MIN(gMaxRectsLimit, kRectBuf));
 
 #if DEBUG
     CFAbsoluteTime __tv_tRects1 = CFAbsoluteTimeGetCurrent();
@@ -2704,12 +7109,37 @@ static void handleFramebuffer(CMSampleBufferRef sampleBuffer) {
                  fullScreen ? @"YES" : @"NO");
 #endif
 
+    // Track per-tile change rates and content classes; both are published before the flush reaches clients
+    if (gVideoRegionQuality > 0 && updateVideoRegions(YES))
+        scheduleVideoRegionTick();
+    if (gTileClassesEnabled)
+        updateTileClasses();
+
     // Clear pending
     if (gPendingDirty)
         memset(gPendingDirty, 0, gTileCount);
 
     gHasPending = NO;
 
+    if (!fullScreen && rectCount == 0) {
+        // Tiles were flagged but refinement found no pixel that differs from what clients already have
+        // (or every change was held back by the tolerance)
+        if (gChangeTolerance > 0) {
+            // Output threads read the front buffer; -a accepts tearing here like its copy fallback does
+            if (!gAsyncSwapEnabled)
+                lockAllClientsBlocking();
+            copySuppressedTilesToFront();
+            if (!gAsyncSwapEnabled)
+                unlockAllClientsBlocking();
+            finishChangeTolerance(NO);
+        }
+        swapTileHashes();
+        sLastRotQ = rotQ;
+        commitFrameFingerprint();
+        TVLogVerbose(@"no pixel changes after refinement (skip publish)");
+        return;
+    }
+
 #if DEBUG
     CFAbsoluteTime __tv_tSwap0 = CFAbsoluteTimeGetCurrent();
 #endif
@@ -2750,6 +7180,8 @@ static void handleFramebuffer(CMSampleBufferRef sampleBuffer) {
             } else {
                 // Only copy dirty regions from back to front to reduce tearing and bandwidth
                 copyRectsFromBackToFront(rects, rectCount);
+                if (gChangeTolerance > 0)
+                    copySuppressedTilesToFront();
                 markRectsModified(rects, rectCount);
 
 #if DEBUG
@@ -2777,9 +7209,17 @@ static void handleFramebuffer(CMSampleBufferRef sampleBuffer) {
 #endif
     }
 
+    if (gChangeTolerance > 0)
+        finishChangeTolerance(fullScreen);
+    if (gSharedEncodingEnabled && !fullScreen)
+        invalidateSharedKeyframes(rects, rectCount);
+    if (isLosslessRefineEnabled())
+        noteRefineTilesChanged(rects, rectCount, fullScreen);
+
     // Prepare for next frame: current hashes become previous
     swapTileHashes();
     sLastRotQ = rotQ;
+    commitFrameFingerprint();
 
 #if DEBUG
     CFAbsoluteTime __tv_tEnd = CFAbsoluteTimeGetCurrent();
@@ -3034,19 +7474,6 @@ NS_INLINE CGPoint vncPointToDevicePoint(int vx, int vy) {
 - (void)_updateTouchPoints:(CGPoint *)points count:(NSUInteger)count;
 @end
 
-#define CLIENT_ID_LEN 8
-
-// Per-client state stored in cl->clientData to avoid cross-client conflicts.
-typedef struct {
-    int lastButtonMask;                // last received pointer button mask from this client
-    double wheelAccumPx;               // accumulated scroll in pixels (+down, -up) for this client
-    BOOL wheelFlushScheduled;          // whether a flush is pending for this client
-    BOOL isRepeaterClient;             // whether this client is a repeater
-    char clientId8[CLIENT_ID_LEN + 1]; // cached 8-char client id (NUL-terminated)
-} TVClientState;
-
-NS_INLINE TVClientState *tvGetClientState(rfbClientPtr cl) { return cl ? (TVClientState *)cl->clientData : NULL; }
-
 static dispatch_queue_t gWheelQueue = nil; // serial queue for wheel gestures
 
 static void wheelScheduleFlush(rfbClientPtr cl, CGPoint anchorPoint, double delaySec, int rotQ) {
@@ -3145,13 +7572,15 @@ static void wheelScheduleFlush(rfbClientPtr cl, CGPoint anchorPoint, double dela
 }
 
 static void ptrAddEvent(int buttonMask, int x, int y, rfbClientPtr cl) {
+    TVClientState *st = tvGetClientState(cl);
+    if (st && gPointerFocusEnabled)
+        recordPointerFocus(cl, st, x, y);
     if (gViewOnly)
         return;
 
     STHIDEventGenerator *gen = [STHIDEventGenerator sharedGenerator];
     CGPoint pt = vncPointToDevicePoint(x, y);
 
-    TVClientState *st = tvGetClientState(cl);
     int lastMask = st ? st->lastButtonMask : 0;
 
     // Left button (bit 0)
@@ -3916,6 +8345,21 @@ static void clientGoneHook(rfbClientPtr cl) {
         if (st->clientId8[0] != '\0') {
             removeKey = [NSString stringWithUTF8String:st->clientId8];
         }
+        if (st->shapedRequest)
+            sraRgnDestroy(st->shapedRequest);
+        if (st->lossyRegion)
+            sraRgnDestroy(st->lossyRegion);
+        if (st->refineRegion)
+            sraRgnDestroy(st->refineRegion);
+        if (st->h264)
+            TVH264EncoderDestroy(st->h264);
+        if (st->cuRegion)
+            sraRgnDestroy(st->cuRegion);
+        if (st->pacedRequest)
+            sraRgnDestroy(st->pacedRequest);
+        if (st->tlsSession)
+            tlsSessionEnded(cl, st);
+        pthread_mutex_destroy(&st->link.lock);
         free(st);
         cl->clientData = NULL;
     }
@@ -3935,6 +8379,10 @@ static void clientGoneHook(rfbClientPtr cl) {
 
     NSString *host = (cl && cl->host) ? [NSString stringWithUTF8String:cl->host] : @"";
     TVLog(@"Client %@ disconnected, active clients=%d", host, gClientCount);
+    if (gSharedEncodingEnabled)
+        logSharedEncodingStats();
+    if (gHextileEncodingEnabled)
+        logHextileStats();
 
     if (gIsCaptureStarted && gClientCount == 0) {
         [[ScreenCapturer sharedCapturer] endCapture];
@@ -3992,8 +8440,12 @@ static enum rfbNewClientAction newClientHook(rfbClientPtr cl) {
         st->wheelAccumPx = 0;
         st->wheelFlushScheduled = NO;
         st->clientId8[0] = '\0';
+        pthread_mutex_init(&st->link.lock, NULL);
         cl->clientData = st;
     }
+    if (gSocketTuningEnabled)
+        tuneClientSocket(cl);
+    cl->clientFramebufferUpdateRequestHook = fbUpdateRequestHook;
 
     gClientCount++;
     TVLog(@"Client connected, active clients=%d", gClientCount);
@@ -4009,6 +8461,8 @@ static enum rfbNewClientAction newClientHook(rfbClientPtr cl) {
             st->clientId8[n] = '\0';
         }
     }
+    if (st && cl->sslctx)
+        tlsSessionStarted(st);
     NSString *host = (cl && cl->host) ? [NSString stringWithUTF8String:cl->host] : @"";
     NSDate *now = [NSDate date];
     NSDictionary *entry = @{
@@ -4300,6 +8754,7 @@ static void prepareScreenCapturer(void) {
 
     gFrameHandler = ^(CMSampleBufferRef _Nonnull sampleBuffer) {
         handleFramebuffer(sampleBuffer);
+        tvReactorWake();
     };
 }
 
@@ -4445,6 +8900,40 @@ static void setupRfbScreen(int argc, const char *argv[]) {
     gScreen->setDesktopSizeHook = setDesktopSizeHook;
 }
 
+// Open H.264 (-x): clients opt in through the pseudo-encoding list handled by the extension.
+static void setupRfbH264Encoding(void) {
+    if (!gH264Enabled)
+        return;
+    rfbRegisterProtocolExtension(&gH264Extension);
+    TVLog(@"Open H.264: offered to clients that list encoding %d", cOpenH264Encoding);
+}
+
+static void setupRfbContinuousUpdates(void) {
+    if (!gContinuousUpdatesEnabled)
+        return;
+    rfbRegisterProtocolExtension(&gContinuousExtension);
+    TVLog(@"Continuous updates: offered to clients that list encodings %d and %d", cFenceEncoding,
+          cContinuousUpdatesEncoding);
+}
+
+// Shared encoding (-b): size the cache from the jetsam limit set in OhMyJetsam.mm, or from physical memory
+// when the process has no limit.
+static void setupRfbSharedEncoding(void) {
+    if (!gSharedEncodingEnabled)
+        return;
+
+    int limitMB = -1;
+#if !TARGET_OS_SIMULATOR
+    memorystatus_memlimit_properties_t props = {};
+    if (memorystatus_control(MEMORYSTATUS_CMD_GET_MEMLIMIT_PROPERTIES, getpid(), 0, &props, sizeof(props)) == 0)
+        limitMB = props.memlimit_active;
+#endif
+    uint64_t total = limitMB > 0 ? (uint64_t)limitMB << 20 : [NSProcessInfo processInfo].physicalMemory;
+    size_t budget = (size_t)(total / cSharedBudgetDivisor);
+    gSharedCacheBudget = MIN(MAX(budget, cSharedBudgetMinBytes), cSharedBudgetMaxBytes);
+    TVLog(@"Shared encoding: cache budget %.0f MB (memory limit %d MB)", gSharedCacheBudget / 1048576.0, limitMB);
+}
+
 static void setupRfbEventHandlers(void) {
     gScreen->ptrAddEvent = ptrAddEvent;
     gScreen->kbdAddEvent = kbdAddEvent;
@@ -4616,15 +9105,31 @@ static std::atomic<int> gRfbEventThreadRunning(0);
 
 static void *tvRfbEventThreadMain(void *arg) {
     (void)arg;
+    BOOL reactor = tvReactorOpen();
+    if (!reactor)
+        TVLog(@"Event reactor unavailable; polling every %ld us", cSelectTimeout);
     for (;;) {
         if (!gRfbEventThreadRunning.load(std::memory_order_relaxed))
             break;
         if (!gScreen)
             break;
-        rfbProcessEvents(gScreen, cSelectTimeout);
+        if (!reactor) {
+            rfbProcessEvents(gScreen, cSelectTimeout);
+            if (!rfbIsActive(gScreen))
+                break;
+            continue;
+        }
+
+        // The reactor did the waiting; handle what is ready and send what is due
+        rfbProcessEvents(gScreen, 0);
         if (!rfbIsActive(gScreen))
             break;
+        double timeoutSec = tvReactorUpdateDeferred(gScreen) ? MAX(gScreen->deferUpdateTime, 1) / 1000.0
+                                                             : cReactorIdleSec;
+        tvReactorWait(gScreen, timeoutSec);
     }
+    if (reactor)
+        tvReactorClose();
     CFRunLoopStop(CFRunLoopGetMain());
     gRfbEventThreadRunning.store(0, std::memory_order_relaxed);
     return NULL;
@@ -4978,6 +9483,9 @@ int main(int argc, const char *argv[]) {
         setupRfbLogging();
         setupRfbScreen(argc, argv);
         setupRfbEventHandlers();
+        setupRfbSharedEncoding();
+        setupRfbH264Encoding();
+        setupRfbContinuousUpdates();
         setupRfbClassicAuthentication();
         setupRfbCutTextHandlers();
         setupRfbServerSideCursor();